@@ -50,6 +50,10 @@ local function get_attrib(opt, inout)
 	elseif inout == "absent" then
 		desc.absent = true
 		assert(not desc.opt)
+	elseif inout == "changed" then
+		desc.r = true
+		desc.changed = true
+		assert(not desc.opt)
 	else
 		assert(inout == "new")
 	end
@@ -62,6 +66,9 @@ local function cache_world(obj, k)
 		id = 0,
 		select = {},
 		ref = {},
+		setexpr = {},
+		systems = {},
+		changed = {},
 	}
 
 	local function gen_ref_pat(key)
@@ -155,8 +162,13 @@ local function cache_world(obj, k)
 
 	local function cache_select(cache, pat)
 		local pat_desc = gen_select_pat(pat)
-		cache[pat] = k:_groupiter(pat_desc)
-		return cache[pat]
+		local iter = k:_groupiter(pat_desc)
+		if pat:find ":changed" then
+			-- keep the last run of changed patterns, the cache is weak
+			c.changed[pat] = iter
+		end
+		cache[pat] = iter
+		return iter
 	end
 
 	setmetatable(c.select, {
@@ -175,6 +187,45 @@ local function cache_world(obj, k)
 		__index = cache_ref,
 		})
 
+	local setop = {
+		["&"] = ecs._SET_INTERSECT,
+		["|"] = ecs._SET_UNION,
+		["-"] = ecs._SET_DIFFERENCE,
+	}
+
+	-- "a & b - c" : left-associative, & intersect, | union, - difference
+	local function cache_setexpr(cache, expr)
+		local typenames = c.typenames
+		local e = {}
+		local s = expr:gsub("%s", "")
+		local pos = 1
+		while true do
+			local name, op, nextpos = s:match("^([%w_]+)([&|%-]?)()", pos)
+			if name == nil then
+				error("Invalid set expression " .. expr)
+			end
+			local tc = typenames[name]
+			if tc == nil then
+				error("Unknown type " .. name)
+			end
+			e[#e+1] = tc.id
+			pos = nextpos
+			if op == "" then
+				break
+			end
+			e[#e+1] = setop[op]
+		end
+		if pos <= #s then
+			error("Invalid set expression " .. expr)
+		end
+		cache[expr] = e
+		return e
+	end
+
+	setmetatable(c.setexpr, {
+		__index = cache_setexpr,
+		})
+
 	obj[k] = c
 	return c
 end
@@ -229,18 +280,42 @@ do	-- newtype
 		end
 	end
 
+	-- "name field1 field2 ... type=int order sparse bitset chunk layout=soa ref" , for snapshot
+	local function schema(typeclass)
+		local s = { typeclass.name }
+		for _, v in ipairs(typeclass) do
+			s[#s+1] = v
+		end
+		if typeclass.type then
+			s[#s+1] = "type=" .. typeclass.type
+		end
+		for _, k in ipairs { "order", "sparse", "bitset", "chunk", "ref" } do
+			if typeclass[k] then
+				s[#s+1] = k
+			end
+		end
+		if typeclass.layout then
+			s[#s+1] = "layout=" .. typeclass.layout
+		end
+		return table.concat(s, " ")
+	end
+
 	function M:register(typeclass)
 		local name = assert(typeclass.name)
 		local ctx = context[self]
 		ctx.all = nil	-- clear all pattern
 		local typenames = ctx.typenames
 		local id = ctx.id + 1
-		assert(typenames[name] == nil and id <= ecs._MAXTYPE)
+		if typenames[name] then
+			error("Duplicate type " .. name)
+		end
+		assert(id <= ecs._MAXTYPE, "Too many types")
 		ctx.id = id
 		local c = {
 			id = id,
 			name = name,
 			size = 0,
+			schema = schema(typeclass),
 		}
 		for i, v in ipairs(typeclass) do
 			c[i] = align(c, parse(v))
@@ -266,8 +341,34 @@ do	-- newtype
 				c.tag = true
 			end
 		end
+		local flags = 0
+		if typeclass.sparse then
+			assert(c.tag ~= "ORDER", "Order key can't be sparse")
+			flags = flags | ecs._SPARSE
+		end
+		if typeclass.bitset then
+			assert(c.tag == true, "Only tag can be a bitset")
+			assert(not typeclass.sparse, "bitset and sparse storage are exclusive")
+			flags = flags | ecs._BITSET
+		end
+		if typeclass.chunk then
+			assert(c.size > 0, "Only value component can be chunked")
+			flags = flags | ecs._CHUNK
+		end
+		local layout
+		if typeclass.layout == "soa" then
+			assert(c[1] and not typeclass.chunk, "Only struct component can be soa")
+			flags = flags | ecs._SOA
+			layout = {}
+			for i, f in ipairs(c) do
+				layout[i*2-1] = f[3]
+				layout[i*2] = typesize[f[1]]
+			end
+		else
+			assert(typeclass.layout == nil, "Invalid layout")
+		end
 		typenames[name] = c
-		self:_newtype(id, c.size)
+		self:_newtype(id, c.size, nil, flags, layout)
 		if typeclass.ref then
 			c.ref = true
 			self:register { name = name .. "_dead" }
@@ -315,6 +416,47 @@ function M:new(obj)
 	end
 end
 
+-- Create count entities from template, each pool grows once.
+-- A function value v is called as v(i) to make the component of the i-th entity.
+-- Returns the eid of the first one and count, the eids of them are eid .. eid + count - 1 (for world:tag_batch).
+function M:new_batch(template, count)
+	assert(template.reference == nil, "Can't create references in batch")
+	if count <= 0 then
+		return
+	end
+	local eid = self:_newentity(count)
+	local ctx = context[self]
+	local typenames = ctx.typenames
+	for k,v in pairs(template) do
+		local tc = typenames[k]
+		if not tc then
+			error ("Invalid key : ".. k)
+		end
+		if v then
+			local id = self:_addcomponent(eid, tc.id, count)
+			if tc.tag == "ORDER" or tc.tag == true then
+				-- nothing to write
+			elseif type(v) == "function" then
+				local values = {}
+				for i = 1, count do
+					values[i] = v(i)
+				end
+				self._objects(ctx.ref[k], values, id, count)
+			elseif tc.size == ecs._LUAOBJECT then
+				local values = {}
+				for i = 1, count do
+					values[i] = v
+				end
+				self._objects(ctx.ref[k], values, id, count)
+			else
+				self:object(k, id, v)
+				self:_fill(tc.id, id, count)
+			end
+		end
+	end
+	return eid, count
+end
+
 function M:ref(name, refobj)
 	local obj = assert(refobj[name])
 	local ctx = context[self]
@@ -364,10 +506,141 @@ function M:context(t)
 	return self:_context(id)
 end
 
+-- Access set of a pattern, component id -> true for write, false for read
+local function access_set(typenames, pat)
+	local set = {}
+	local function access(id, write)
+		set[id] = set[id] or write
+	end
+	for token in pat:gmatch "[^ ]+" do
+		local key, padding = token:match "^([_%w]+)(.*)"
+		assert(key, "Invalid pattern")
+		local opt, inout
+		if padding ~= "" then
+			opt, inout = padding:match "^([:?])(%l+)$"
+			assert(opt, "Invalid pattern")
+		end
+		local tc = typenames[key]
+		if tc == nil then
+			error("Unknown type " .. key)
+		end
+		local a = get_attrib(opt, inout)
+		access(tc.id, a.w or inout == "new")
+		if tc.ref then
+			access(typenames[key .. "_dead"].id, false)
+		end
+	end
+	return set
+end
+
+local function conflict(a, b)
+	for id, w in pairs(a) do
+		local bw = b[id]
+		if bw ~= nil and (w or bw) then
+			return true
+		end
+	end
+	return false
+end
+
+-- The level of a system is the longest path to it in the DAG of conflicts, the systems of one level make a wave.
+local function build_schedule(systems)
+	local level = {}
+	local waves = {}
+	for i, s in ipairs(systems) do
+		local l = 1
+		for j = 1, i - 1 do
+			if level[j] >= l and conflict(s.access, systems[j].access) then
+				l = level[j] + 1
+			end
+		end
+		level[i] = l
+		local wave = waves[l]
+		if wave == nil then
+			wave = { names = {}, lua = {}, c = {} }
+			waves[l] = wave
+		end
+		wave.names[#wave.names+1] = s.name
+		if s.context then
+			local c = wave.c
+			c[#c+1] = s.func
+			c[#c+1] = s.context
+		else
+			wave.lua[#wave.lua+1] = s.func
+		end
+	end
+	return waves
+end
+
+-- Register a system with the pattern of its access. func is a Lua function func(world),
+-- or a C system (lightuserdata of struct ecs_system) with the component names of its context.
+-- Systems conflict if one writes a component the other one reads or writes, they run in the order of registration.
+function M:system(name, pattern, func, names)
+	local ctx = context[self]
+	for _, s in ipairs(ctx.systems) do
+		if s.name == name then
+			error("Duplicate system " .. name)
+		end
+	end
+	local s = {
+		name = name,
+		access = access_set(ctx.typenames, pattern),
+		func = func,
+	}
+	if type(func) == "userdata" then
+		s.context = self:context(assert(names, "C system needs the names of context"))
+	else
+		assert(type(func) == "function", "Invalid system")
+	end
+	ctx.systems[#ctx.systems+1] = s
+	ctx.schedule = nil
+end
+
+-- Returns the names of systems in each wave
+function M:schedule()
+	local ctx = context[self]
+	local schedule = ctx.schedule or build_schedule(ctx.systems)
+	ctx.schedule = schedule
+	local r = {}
+	for i, wave in ipairs(schedule) do
+		r[i] = wave.names
+	end
+	return r
+end
+
+-- Runs all the systems wave by wave. The Lua systems of a wave run first in the calling thread,
+-- then the C systems run in parallel.
+function M:run_systems()
+	local ctx = context[self]
+	local schedule = ctx.schedule or build_schedule(ctx.systems)
+	ctx.schedule = schedule
+	for _, wave in ipairs(schedule) do
+		for _, f in ipairs(wave.lua) do
+			f(self)
+		end
+		self:_systems(wave.c)
+	end
+end
+
 function M:select(pat)
 	return context[self].select[pat]()
 end
 
+-- Iterate n entities at a time. chunk.n is the count, and the fields are arrays : chunk.name[i] for a value,
+-- object or tag, chunk.name.field[i] for a struct. The arrays of out components are written back at next step,
+-- the nil entries are skipped. Tags can't be written, and the pools in pattern shouldn't change during iteration.
+function M:select_chunk(pat, n)
+	return self:_chunkiter(context[self].select[pat], n or 256)
+end
+
+-- Like select, but a struct component is a view into the pool instead of a copy, v.name.field reads or writes
+-- the component directly. A view moves to the entity of each step, so it's only valid in the current step
+-- (and until the next structural change of its pool). Don't keep it, copy the fields instead.
+-- The other components can only be read.
+function M:select_view(pat)
+	return self:_viewiter(context[self].select[pat])
+end
+
 function M:sync(pat, iter)
 	local p = context[self].select[pat]
 	self:_sync(p, iter)
@@ -390,11 +663,46 @@ function M:dumpid(name)
 	return self:_dumpid(typenames[name].id)
 end
 
+function M:count(expr)
+	return self:_setop(context[self].setexpr[expr])
+end
+
+function M:ids(expr)
+	return self:_setop(context[self].setexpr[expr], true)
+end
+
+-- Enable the tag of name for a list of entity ids (from world:ids), or disable it if enable is false.
+-- It's one merge for all of them, but don't use it on the tag in iteration.
+function M:tag_batch(name, eids, enable)
+	local id = assert(context[self].typenames[name].id)
+	self:_tagbatch(id, eids, enable ~= false)
+end
+
 function M:update()
 	self:_update_reference(REFERENCE_ID)
 	self:_update()
 end
 
+-- Renumber entity ids to 1..n. With budget, each update renumbers at most budget entities until it's done.
+function M:rearrange(budget)
+	self:_rearrange(budget)
+end
+
+-- Generational handle of the entity of iterator, it's stale after the entity is removed.
+function M:handle(iter)
+	return self:_handle(iter[2], iter[1])
+end
+
+-- Returns an iterator of component name for the handle, can be used by sync/readall.
+-- Returns nil if the handle is stale or the entity has no name.
+function M:fetch(handle, name)
+	local id = assert(context[self].typenames[name].id)
+	local index = self:_fetch(handle, id)
+	if index then
+		return { index, id }
+	end
+end
+
 function M:remove_reference(ref)
 	ref.reference = false
 	self:sync("reference:out", ref)
@@ -428,8 +736,70 @@ do
 	end
 end
 
-function ecs.world()
-	local w = ecs._world()
+-- Save the world to the file of path, or call writer(s) with each section of the snapshot.
+-- Lua components are saved as encode(name, object), it should return a string.
+function M:save(target, encode)
+	local typenames = context[self].typenames
+	local schema = {}
+	local names = {}
+	for name, tc in pairs(typenames) do
+		if tc.schema then
+			schema[tc.id] = tc.schema
+		end
+		names[tc.id] = name
+	end
+	local function encoder(id, obj)
+		local name = names[id]
+		if encode == nil then
+			error("Need encode for lua component " .. name)
+		end
+		return encode(name, obj)
+	end
+	schema = table.concat(schema, "\n")
+	if type(target) == "string" then
+		local f <close> = assert(io.open(target, "wb"))
+		self:_save(function(s) f:write(s) end, encoder, schema)
+	else
+		self:_save(target, encoder, schema)
+	end
+end
+
+local function delta_spec(typenames, names)
+	local spec = {}
+	for i, name in ipairs(names) do
+		local tc = typenames[name]
+		if tc == nil then
+			error("Unknown type " .. name)
+		end
+		local s = { tc.id }
+		for j, f in ipairs(tc) do
+			s[j*2] = f[3]
+			s[j*2+1] = typesize[f[1]]
+		end
+		spec[i] = s
+	end
+	return spec
+end
+
+-- Encoder of the components of names for world:delta_encode, they should be value, struct or tag components.
+function M:delta_encoder(names)
+	return self:_deltaencoder(delta_spec(context[self].typenames, names))
+end
+
+-- Returns the changes of the components since the last delta of encoder as a string, the first one has all of them.
+-- Entities are identified by their ids, so a rearrange makes a large delta.
+function M:delta_encode(encoder)
+	return self:_deltaencode(encoder)
+end
+
+-- Apply a delta from world:delta_encode with the same names. The world is a replica of the encoded one,
+-- its entities are created by the deltas only.
+function M:delta_apply(delta, names)
+	self:_deltaapply(delta, delta_spec(context[self].typenames, names))
+end
+
+function ecs.world(opt)
+	local w = ecs._world(opt and opt.allocator)
 	context[w].typenames.REMOVED = {
 		name = "REMOVED",
 		id = ecs._REMOVED,
@@ -441,7 +811,83 @@ function ecs.world()
 		type = "lua",
 	}
 	assert(context[w].typenames.reference.id == REFERENCE_ID)
+	if opt and opt.handle then
+		-- a reserved name, so it doesn't clash with the types of user
+		w:register {
+			name = "__handle",
+			type = "int",
+		}
+		w:_handletype(context[w].typenames.__handle.id)
+	end
 	return w
 end
 
+local function parse_schema(line)
+	local typeclass = {}
+	for token in line:gmatch "%S+" do
+		if typeclass.name == nil then
+			typeclass.name = token
+		elseif token:find ":" then
+			typeclass[#typeclass+1] = token
+		else
+			local k, v = token:match "^(%w+)=(%w+)$"
+			if k then
+				typeclass[k] = v
+			else
+				typeclass[token] = true
+			end
+		end
+	end
+	return typeclass
+end
+
+local function load_snapshot(data, decode, opt)
+	local schema, handle = ecs._snapshot(data)
+	local w = ecs.world { handle = handle, allocator = opt and opt.allocator }
+	local typenames = context[w].typenames
+	local names = {}
+	local id = 0
+	for line in schema:gmatch "[^\n]+" do
+		id = id + 1
+		local typeclass = parse_schema(line)
+		local tc = typenames[typeclass.name]
+		if tc == nil then
+			w:register(typeclass)
+			tc = typenames[typeclass.name]
+		end
+		assert(tc.id == id and tc.schema == line, "Invalid schema " .. line)
+		names[id] = typeclass.name
+	end
+	w:_load(data, function(id, s)
+		if decode == nil then
+			error("Need decode for lua component " .. names[id])
+		end
+		return decode(names[id], s)
+	end)
+	return w
+end
+
+-- Load a world saved by world:save from the file of path, or from the strings returned by reader() until nil.
+-- Lua components are created by decode(name, s). opt is the same as ecs.world .
+function ecs.load(source, decode, opt)
+	local data
+	if type(source) == "string" then
+		local f <close> = assert(io.open(source, "rb"))
+		data = f:read "a"
+	else
+		local t = {}
+		for s in source do
+			t[#t+1] = s
+		end
+		data = table.concat(t)
+	end
+	return load_snapshot(data, decode, opt)
+end
+
+-- Like ecs.load, but the pools point into the file mapped in memory instead of being loaded.
+-- The pages are shared between processes until they are written, and a pool is copied out at its first structural change.
+function ecs.map(filename, decode, opt)
+	return load_snapshot(ecs._map(filename), decode, opt)
+end
+
 return ecs
@@ -18,29 +18,257 @@
 #define STRIDE_ORDER -2
 #define DUMMY_PTR (void *)(uintptr_t)(~0)
 #define REARRANGE_THRESHOLD 0x80000000
+#define REARRANGE_INCREMENTAL (REARRANGE_THRESHOLD / 2)	// start an incremental pass from here
+
+#define POOL_SPARSE 1
+#define POOL_BITSET 2
+#define POOL_CHUNK 4
+#define POOL_SOA 8
+#define POOL_DIRTY 0x100	// id array of bitset pool is out of date
+#define POOL_STAMP 0x200	// the changes are stamped, since the first pattern with name:changed
+
+#define SPARSE_PAGE_SHIFT 12
+#define SPARSE_PAGE_SIZE (1 << SPARSE_PAGE_SHIFT)
+#define SPARSE_PAGE_MASK (SPARSE_PAGE_SIZE - 1)
+
+#define CHUNK_SHIFT 14
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+
+#define SOA_ALIGN 64
+
+#define MASK_PAGE_SHIFT 12
+#define MASK_PAGE_SIZE (1 << MASK_PAGE_SHIFT)
+#define MASK_BLOCK_SHIFT 5	// entities in a block share one mask of pools
+#define MASK_BLOCKS (MASK_PAGE_SIZE >> MASK_BLOCK_SHIFT)
+#define MASK_WORDS (MAX_COMPONENT / 64)
+
+#define PARALLEL_MAXTHREAD 64
+
+struct soa_column {
+	int offset;	// offset in the struct of component
+	int size;
+	size_t pos;	// offset of the column from the aligned buffer, depends on cap
+};
 
 struct component_pool {
 	int cap;
 	int n;
 	int stride;	// -1 means lua object
 	int last_lookup;
+	int flags;
+	int sparse_n;
 	unsigned int *id;
 	void *buffer;
+	int **sparse;	// paged eid -> index + 1, only for POOL_SPARSE
+	uint64_t *bits;	// bitset of eid, only for POOL_BITSET
+	int bits_n;
+	int bits_count;
+	void **chunk;	// blocks of CHUNK_SIZE components, only for POOL_CHUNK
+	int chunk_n;
+	int soa_n;
+	struct soa_column *soa;	// one column per field, only for POOL_SOA
+	void *row;	// scratch struct for gather/scatter of POOL_SOA
+	unsigned int version;	// changed when any id in the pool is added, removed or moved
+	unsigned int *stamp;	// change version of each component, only for POOL_STAMP
+	unsigned int stamp_max;	// the latest change version in stamp
+};
+
+// Default allocator of world, small blocks come from size classes carved from pages.
+
+#define ARENA_MINSHIFT 4
+#define ARENA_CLASSES 12	// 16 bytes to 32K
+#define ARENA_PAGESIZE (64 * 1024)
+#define ARENA_HEADER 64
+
+struct arena_page {
+	struct arena_page *next;
+};
+
+struct ecs_arena {
+	void *freelist[ARENA_CLASSES];
+	struct arena_page *page;
+	char *ptr;
+	size_t left;
+};
+
+// Which pools may have the entities of each block, so update only compacts the pools touched by removed entities.
+struct mask_page {
+	int live;	// entities created in this page and not removed yet
+	uint64_t block[MASK_BLOCKS][MASK_WORDS];
+};
+
+// A snapshot file mapped by ecs.map, the pools may point into it. The mapping is copy-on-write,
+// and the memory in it is never freed by the allocator.
+struct ecs_image {
+	char *base;
+	size_t size;
+};
+
+// A handle is (generation << 32 | slot), the slot points to the entity id, and it's updated when the id is rearranged.
+struct handle_slot {
+	unsigned int eid;	// 0 means free
+	unsigned int gen;
+	int next;	// next free slot
+};
+
+// A deferred structural change, see entity_command_
+struct command {
+	int op;
+	int cid;
+	int key;
+	int thread;
+	int seq;	// index in the buffer of thread
+	uint64_t entity;	// target, it's the new eid of ECS_CMD_NEW after playback
+	size_t payload;	// offset + 1 in data, 0 means none
+};
+
+// Commands of one thread
+struct command_buffer {
+	struct command *cmd;
+	int n;
+	int cap;
+	int failed;	// out of memory, reported in playback
+	char *data;
+	size_t size;
+	size_t data_cap;
 };
 
 struct entity_world {
 	unsigned int max_id;
+	struct ecs_allocator alloc;
+	size_t memory;	// bytes allocated from alloc
+	struct ecs_arena arena;
+	struct mask_page **mask;	// eid >> MASK_PAGE_SHIFT -> page
+	int mask_n;
+	int mask_lost;	// out of memory for the masks, update scans all the pools
+	int handle_cid;	// component of handle slot index, 0 means no handle
+	int slot_n;
+	int slot_cap;
+	int slot_free;	// head of free slots, -1 means none
+	struct handle_slot *slot;
+	struct ecs_image image;
+	struct ecs_parallel *parallel;	// thread pool, created by the first parallel_for
+	int in_parallel;	// no structural change during parallel_for
+	struct command_buffer cmd[PARALLEL_MAXTHREAD];
+	unsigned int rearrange_from;	// ids below it are renumbered in current pass, 0 means no pass
+	unsigned int rearrange_id;	// next new id of current pass
+	int rearrange_budget;	// entities renumbered in each update, 0 means all at once
+	int rearrange_holes;	// renumbered entities are removed during the pass
+	unsigned int change_version;	// stamp of the changes from now on, see POOL_STAMP
 	struct component_pool c[MAX_COMPONENT];
 };
 
+static inline int
+arena_class(size_t sz) {
+	size_t csz = (size_t)1 << ARENA_MINSHIFT;
+	int c = 0;
+	while (csz < sz && c < ARENA_CLASSES) {
+		csz <<= 1;
+		++c;
+	}
+	return c;
+}
+
+static void *
+arena_malloc(struct ecs_arena *a, int c) {
+	void *p = a->freelist[c];
+	if (p) {
+		a->freelist[c] = *(void **)p;
+		return p;
+	}
+	size_t sz = (size_t)1 << (c + ARENA_MINSHIFT);
+	if (a->left < sz) {
+		struct arena_page *page = (struct arena_page *)malloc(ARENA_PAGESIZE);
+		if (page == NULL)
+			return NULL;
+		// put the rest of current page into free lists
+		while (a->left >= ((size_t)1 << ARENA_MINSHIFT)) {
+			int rc = ARENA_CLASSES - 1;
+			while (((size_t)1 << (rc + ARENA_MINSHIFT)) > a->left)
+				--rc;
+			*(void **)a->ptr = a->freelist[rc];
+			a->freelist[rc] = a->ptr;
+			a->ptr += (size_t)1 << (rc + ARENA_MINSHIFT);
+			a->left -= (size_t)1 << (rc + ARENA_MINSHIFT);
+		}
+		page->next = a->page;
+		a->page = page;
+		a->ptr = (char *)page + ARENA_HEADER;
+		a->left = ARENA_PAGESIZE - ARENA_HEADER;
+	}
+	p = a->ptr;
+	a->ptr += sz;
+	a->left -= sz;
+	return p;
+}
+
+static void
+arena_free(struct ecs_arena *a, void *ptr, size_t sz) {
+	int c = arena_class(sz);
+	if (c < ARENA_CLASSES) {
+		*(void **)ptr = a->freelist[c];
+		a->freelist[c] = ptr;
+	} else {
+		free(ptr);
+	}
+}
+
+static void *
+arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct ecs_arena *a = (struct ecs_arena *)ud;
+	if (nsize == 0) {
+		if (ptr)
+			arena_free(a, ptr, osize);
+		return NULL;
+	}
+	int nc = arena_class(nsize);
+	if (ptr) {
+		int oc = arena_class(osize);
+		if (oc == nc && nc < ARENA_CLASSES)
+			return ptr;
+		if (oc == ARENA_CLASSES && nc == ARENA_CLASSES)
+			return realloc(ptr, nsize);
+	}
+	void *ret = (nc < ARENA_CLASSES) ? arena_malloc(a, nc) : malloc(nsize);
+	if (ret && ptr) {
+		memcpy(ret, ptr, osize < nsize ? osize : nsize);
+		arena_free(a, ptr, osize);
+	}
+	return ret;
+}
+
+static void
+arena_release(struct ecs_arena *a) {
+	struct arena_page *page = a->page;
+	while (page) {
+		struct arena_page *next = page->next;
+		free(page);
+		page = next;
+	}
+	memset(a, 0, sizeof(*a));
+}
+
 static void
-init_component_pool(struct entity_world *w, int index, int stride, int opt_size) {
+init_component_pool(struct entity_world *w, int index, int stride, int opt_size, int flags) {
 	struct component_pool *c = &w->c[index];
 	c->cap = opt_size;
 	c->n = 0;
 	c->stride = stride;
 	c->id = NULL;
 	c->last_lookup = 0;
+	c->flags = flags;
+	c->sparse_n = 0;
+	c->sparse = NULL;
+	c->bits = NULL;
+	c->bits_n = 0;
+	c->bits_count = 0;
+	c->chunk = NULL;
+	c->chunk_n = 0;
+	c->soa_n = 0;
+	c->soa = NULL;
+	c->row = NULL;
+	c->version = 0;
 	if (stride > 0) {
 		c->buffer = NULL;
 	} else {
@@ -49,14 +277,29 @@ init_component_pool(struct entity_world *w, int index, int stride, int opt_size)
 }
 
 static void
-entity_new_type(lua_State *L, struct entity_world *w, int cid, int stride, int opt_size) {
+entity_new_type(lua_State *L, struct entity_world *w, int cid, int stride, int opt_size, int flags) {
 	if (opt_size <= 0) {
 		opt_size = DEFAULT_SIZE;
 	}
 	if (cid < 0 || cid >=MAX_COMPONENT || w->c[cid].cap != 0) {
 		luaL_error(L, "Can't new type %d", cid);
 	}
-	init_component_pool(w, cid, stride, opt_size);
+	if ((flags & POOL_SPARSE) && stride == STRIDE_ORDER) {
+		luaL_error(L, "Order key %d can't be sparse", cid);
+	}
+	if ((flags & POOL_BITSET) && stride != STRIDE_TAG) {
+		luaL_error(L, "Only tag %d can be a bitset", cid);
+	}
+	if ((flags & POOL_BITSET) && (flags & POOL_SPARSE)) {
+		luaL_error(L, "Tag %d : bitset and sparse storage are exclusive", cid);
+	}
+	if ((flags & POOL_CHUNK) && stride <= 0) {
+		luaL_error(L, "Only value component %d can be chunked", cid);
+	}
+	if ((flags & POOL_SOA) && (stride <= 0 || (flags & POOL_CHUNK))) {
+		luaL_error(L, "Only value component %d can be soa", cid);
+	}
+	init_component_pool(w, cid, stride, opt_size, flags);
 }
 
 static inline struct entity_world *
@@ -64,1716 +307,6152 @@ getW(lua_State *L) {
 	return (struct entity_world *)luaL_checkudata(L, 1, "ENTITY_WORLD");
 }
 
-static int
-lnew_type(lua_State *L) {
-	struct entity_world *w = getW(L);
-	int cid = luaL_checkinteger(L, 2);
-	int stride = luaL_checkinteger(L, 3);
-	int size = luaL_optinteger(L, 4, 0);
-	entity_new_type(L, w, cid, stride, size);
-	return 0;
+static inline int
+image_owns(struct entity_world *w, const void *ptr) {
+	return w->image.base && (const char *)ptr >= w->image.base && (const char *)ptr < w->image.base + w->image.size;
 }
 
-static int
-lcount_memory(lua_State *L) {
-	struct entity_world *w = getW(L);
-	size_t sz = sizeof(*w);
-	int i;
-	size_t msz = sz;
-	for (i=0;i<MAX_COMPONENT;i++) {
-		struct component_pool *c = &w->c[i];
-		if (c->id) {
-			sz += c->cap * sizeof(unsigned int);
-			msz += c->n * sizeof(unsigned int);
-		}
-		if (c->buffer != DUMMY_PTR) {
-			sz += c->cap * c->stride;
-			msz += c->cap * c->stride;
-		}
+// All the component memory is owned by the world allocator, and freed explicitly.
+static inline void *
+world_realloc(struct entity_world *w, void *ptr, size_t osize, size_t nsize) {
+	if (ptr == NULL) {
+		osize = 0;
+	} else if (image_owns(w, ptr)) {
+		// copy out of the image, and never free it
+		if (nsize == 0)
+			return NULL;
+		void *ret = world_realloc(w, NULL, 0, nsize);
+		if (ret)
+			memcpy(ret, ptr, osize < nsize ? osize : nsize);
+		return ret;
 	}
-	lua_pushinteger(L, sz);
-	lua_pushinteger(L, msz);
-	return 2;
+	void *ret = w->alloc.alloc(w->alloc.ud, ptr, osize, nsize);
+	if (ret || nsize == 0)
+		w->memory = w->memory - osize + nsize;
+	return ret;
 }
 
-static void
-shrink_component_pool(lua_State *L, struct component_pool *c, int id) {
-	if (c->id == NULL)
-		return;
-	if (c->n == 0) {
-		c->id = NULL;
-		if (c->stride > 0)
-			c->buffer = NULL;
-		lua_pushnil(L);
-		lua_setiuservalue(L, 1, id * 2 + 1);
-		lua_pushnil(L);
-		lua_setiuservalue(L, 1, id * 2 + 2);
-	} else if (c->stride > 0 && c->n < c->cap) {
-		c->cap = c->n;
-		c->id = (unsigned int *)lua_newuserdatauv(L, c->n * sizeof(unsigned int), 0);
-		lua_setiuservalue(L, 1, id * 2 + 1);
-		c->buffer = lua_newuserdatauv(L, c->n * c->stride, 0);
-		lua_setiuservalue(L, 1, id * 2 + 2);
-	}
+static inline void
+world_free(struct entity_world *w, void *ptr, size_t sz) {
+	if (ptr)
+		world_realloc(w, ptr, sz, 0);
 }
 
-static int
-lcollect_memory(lua_State *L) {
-	struct entity_world *w = getW(L);
+static void *
+world_alloc(lua_State *L, struct entity_world *w, void *ptr, size_t osize, size_t nsize) {
+	void *ret = world_realloc(w, ptr, osize, nsize);
+	if (ret == NULL && nsize > 0)
+		luaL_error(L, "Out of memory");
+	return ret;
+}
+
+static void
+mask_release(struct entity_world *w) {
 	int i;
-	for (i=0;i<MAX_COMPONENT;i++) {
-		shrink_component_pool(L, &w->c[i], i);
+	for (i=0;i<w->mask_n;i++) {
+		world_free(w, w->mask[i], sizeof(struct mask_page));
 	}
-	return 0;
+	world_free(w, w->mask, w->mask_n * sizeof(struct mask_page *));
+	w->mask = NULL;
+	w->mask_n = 0;
 }
 
-static int
-add_component_id_(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid) {
-	struct component_pool *pool = &w->c[cid];
-	int cap = pool->cap;
-	int index = pool->n;
-	if (pool->n == 0) {
-		if (pool->id == NULL) {
-			pool->id = (unsigned int *)lua_newuserdatauv(L, cap * sizeof(unsigned int), 0);
-			lua_setiuservalue(L, world_index, cid * 2 + 1);
-		}
-		if (pool->buffer == NULL) {
-			pool->buffer = lua_newuserdatauv(L, cap * pool->stride, 0);
-			lua_setiuservalue(L, world_index, cid * 2 + 2);
-		} else if (pool->stride == STRIDE_LUA) {
-			lua_newtable(L);
-			lua_setiuservalue(L, world_index, cid * 2 + 2);
-		}
-	} else if (pool->n >= pool->cap) {
-		// expand pool
-		int newcap = cap * 3 / 2;
-		unsigned int *newid = (unsigned int *)lua_newuserdatauv(L, newcap * sizeof(unsigned int), 0);
-		lua_setiuservalue(L, world_index, cid * 2 + 1);
-		memcpy(newid, pool->id,  cap * sizeof(unsigned int));
-		pool->id = newid;
-		int stride = pool->stride;
-		if (stride > 0) {
-			void *newbuffer = lua_newuserdatauv(L, newcap * stride, 0);
-			lua_setiuservalue(L, world_index, cid * 2 + 2);
-			memcpy(newbuffer, pool->buffer, cap * stride);
-			pool->buffer = newbuffer;
-		}
-		pool->cap = newcap;
+static inline void
+mask_lost(struct entity_world *w) {
+	mask_release(w);
+	w->mask_lost = 1;
+}
+
+static struct mask_page *
+mask_page(struct entity_world *w, unsigned int eid) {
+	unsigned int p = eid >> MASK_PAGE_SHIFT;
+	if (p >= (unsigned int)w->mask_n) {
+		int n = w->mask_n * 3 / 2;
+		if (n <= p)
+			n = p + 1;
+		struct mask_page **m = (struct mask_page **)world_realloc(w, w->mask, w->mask_n * sizeof(*m), n * sizeof(*m));
+		if (m == NULL)
+			return NULL;
+		memset(m + w->mask_n, 0, (n - w->mask_n) * sizeof(*m));
+		w->mask = m;
+		w->mask_n = n;
 	}
-	++pool->n;
-	pool->id[index] = eid;
-	if (pool->stride != STRIDE_ORDER && index > 0 && eid < pool->id[index-1]) {
-		luaL_error(L, "Add component %d fail", cid);
+	struct mask_page *page = w->mask[p];
+	if (page == NULL) {
+		page = (struct mask_page *)world_realloc(w, NULL, 0, sizeof(*page));
+		if (page == NULL)
+			return NULL;
+		memset(page, 0, sizeof(*page));
+		w->mask[p] = page;
 	}
-	return index;
+	return page;
 }
 
-static inline void *
-get_ptr(struct component_pool *c, int index) {
-	if (c->stride > 0)
-		return (void *)((char *)c->buffer + c->stride * index);
-	else
-		return DUMMY_PTR;
+// pool cid has entity eid now
+static inline void
+mask_mark(struct entity_world *w, int cid, unsigned int eid) {
+	if (w->mask_lost)
+		return;
+	unsigned int p = eid >> MASK_PAGE_SHIFT;
+	struct mask_page *page = p < (unsigned int)w->mask_n ? w->mask[p] : NULL;
+	if (page == NULL && (page = mask_page(w, eid)) == NULL) {
+		mask_lost(w);
+		return;
+	}
+	uint64_t *m = page->block[(eid & (MASK_PAGE_SIZE - 1)) >> MASK_BLOCK_SHIFT];
+	m[cid / 64] |= (uint64_t)1 << (cid % 64);
 }
 
-static void *
-add_component_(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid, const void *buffer) {
-	int index = add_component_id_(L, world_index, w, cid, eid);
-	struct component_pool *pool = &w->c[cid];
-	void *ret = get_ptr(pool, index);
-	if (buffer) {
-		assert(pool->stride >= 0);
-		memcpy(ret, buffer, pool->stride);
+// count entities [from, to) as alive
+static void
+mask_live(struct entity_world *w, unsigned int from, unsigned int to) {
+	while (from < to && !w->mask_lost) {
+		unsigned int next = ((from >> MASK_PAGE_SHIFT) + 1) << MASK_PAGE_SHIFT;
+		if (next > to || next == 0)
+			next = to;
+		struct mask_page *page = mask_page(w, from);
+		if (page == NULL) {
+			mask_lost(w);
+			return;
+		}
+		page->live += next - from;
+		from = next;
 	}
-	return ret;
 }
 
-static inline int
-check_cid(lua_State *L, struct entity_world *w, int index) {
-	int cid = luaL_checkinteger(L, index);
-	struct component_pool *c = &w->c[cid];
-	if (cid < 0 || 	cid >=MAX_COMPONENT || c->cap == 0) {
-		luaL_error(L, "Invalid type %d", cid);
+// entity eid is gone
+static void
+mask_kill(struct entity_world *w, unsigned int eid) {
+	unsigned int p = eid >> MASK_PAGE_SHIFT;
+	if (w->mask_lost || p >= (unsigned int)w->mask_n)
+		return;
+	struct mask_page *page = w->mask[p];
+	if (page && page->live > 0 && --page->live == 0) {
+		world_free(w, page, sizeof(*page));
+		w->mask[p] = NULL;
 	}
-	return cid;
 }
 
+// Collect the pools which may have removed entities, and free the pages of dead entities.
+// Returns 0 if the masks are lost.
 static int
-ladd_component(lua_State *L) {
-	struct entity_world *w = getW(L);
-	unsigned int eid = luaL_checkinteger(L, 2);
-	int cid = check_cid(L, w, 3);
-	int index = add_component_id_(L, 1, w, cid, eid);
-	lua_pushinteger(L, index + 1);
+mask_collect(struct entity_world *w, struct component_pool *removed, uint64_t dirty[MASK_WORDS]) {
+	if (w->mask_lost)
+		return 0;
+	unsigned int last_id = 0;
+	unsigned int last_page = 0;
+	int i, j;
+	for (i=0;i<removed->n;i++) {
+		unsigned int eid = removed->id[i];
+		if (eid == last_id)
+			continue;
+		last_id = eid;
+		unsigned int p = eid >> MASK_PAGE_SHIFT;
+		if (p >= (unsigned int)w->mask_n || w->mask[p] == NULL)
+			return 0;
+		struct mask_page *page = w->mask[p];
+		if (p != last_page) {
+			struct mask_page *lp = w->mask[last_page];
+			if (lp && lp->live == 0) {
+				world_free(w, lp, sizeof(*lp));
+				w->mask[last_page] = NULL;
+			}
+			last_page = p;
+		}
+		uint64_t *m = page->block[(eid & (MASK_PAGE_SIZE - 1)) >> MASK_BLOCK_SHIFT];
+		for (j=0;j<MASK_WORDS;j++) {
+			dirty[j] |= m[j];
+		}
+		if (page->live > 0)
+			--page->live;
+	}
+	struct mask_page *lp = w->mask[last_page];
+	if (lp && lp->live == 0) {
+		world_free(w, lp, sizeof(*lp));
+		w->mask[last_page] = NULL;
+	}
 	return 1;
 }
 
+static unsigned int
+new_entity_id(lua_State *L, struct entity_world *w, int count) {
+	unsigned int eid = w->max_id + 1;
+	if (eid + (unsigned int)count < eid)
+		luaL_error(L, "Too many entities");
+	w->max_id += count;
+	mask_live(w, eid, eid + count);
+	return eid;
+}
+
 static int
-lnew_entity(lua_State *L) {
+lnew_type(lua_State *L) {
 	struct entity_world *w = getW(L);
-	unsigned int eid = ++w->max_id;
-	assert(eid != 0);
-	lua_pushinteger(L, eid);
-	return 1;
+	int cid = luaL_checkinteger(L, 2);
+	int stride = luaL_checkinteger(L, 3);
+	int size = luaL_optinteger(L, 4, 0);
+	int flags = luaL_optinteger(L, 5, 0);
+	entity_new_type(L, w, cid, stride, size, flags);
+	if (flags & POOL_SOA) {
+		// { offset1, size1, offset2, size2, ... }
+		luaL_checktype(L, 6, LUA_TTABLE);
+		int n = lua_rawlen(L, 6) / 2;
+		if (n <= 0)
+			return luaL_error(L, "Invalid soa layout of type %d", cid);
+		struct component_pool *c = &w->c[cid];
+		c->soa = (struct soa_column *)world_alloc(L, w, NULL, 0, n * sizeof(struct soa_column));
+		c->soa_n = n;
+		int i;
+		for (i=0;i<n;i++) {
+			struct soa_column *col = &c->soa[i];
+			lua_rawgeti(L, 6, i*2+1);
+			lua_rawgeti(L, 6, i*2+2);
+			col->offset = lua_tointeger(L, -2);
+			col->size = lua_tointeger(L, -1);
+			col->pos = 0;
+			lua_pop(L, 2);
+			if (col->offset < 0 || col->size <= 0 || col->offset + col->size > stride)
+				return luaL_error(L, "Invalid soa field %d of type %d", i, cid);
+		}
+		c->row = world_alloc(L, w, NULL, 0, stride);
+	}
+	return 0;
+}
+
+// Soa pools keep each field in its own column, columns are aligned to SOA_ALIGN.
+
+static inline size_t
+soa_column_size(int cap, int size) {
+	return ((size_t)cap * size + SOA_ALIGN - 1) & ~(size_t)(SOA_ALIGN - 1);
 }
 
+static inline char *
+soa_base(void *buffer) {
+	return (char *)(((uintptr_t)buffer + SOA_ALIGN - 1) & ~(uintptr_t)(SOA_ALIGN - 1));
+}
+
+static size_t
+buffer_size(struct component_pool *c, int cap) {
+	if (!(c->flags & POOL_SOA))
+		return (size_t)cap * c->stride;
+	size_t sz = SOA_ALIGN;
+	int i;
+	for (i=0;i<c->soa_n;i++) {
+		sz += soa_column_size(cap, c->soa[i].size);
+	}
+	return sz;
+}
+
+// copy n components into the columns of buffer with cap, and set the pos of columns
 static void
-insert_id(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid) {
-	struct component_pool *c = &w->c[cid];
-	assert(c->stride == STRIDE_TAG);
-	int from = 0;
-	int to = c->n;
-	while(from < to) {
-		int mid = (from + to)/2;
-		int aa = c->id[mid];
-		if (aa == eid)
-			return;
-		else if (aa < eid) {
-			from = mid + 1;
-		} else {
-			to = mid;
+soa_move_buffer(struct component_pool *c, void *buffer, int cap, int n) {
+	char *to = soa_base(buffer);
+	char *from = c->buffer ? soa_base(c->buffer) : NULL;
+	size_t pos = 0;
+	int i;
+	for (i=0;i<c->soa_n;i++) {
+		struct soa_column *col = &c->soa[i];
+		if (from)
+			memcpy(to + pos, from + col->pos, (size_t)n * col->size);
+		col->pos = pos;
+		pos += soa_column_size(cap, col->size);
+	}
+}
+
+// Resize id and buffer to newcap together, the pool is unchanged if out of memory.
+static void
+pool_resize(lua_State *L, struct entity_world *w, struct component_pool *c, int newcap) {
+	size_t bsize = (c->stride > 0 && !(c->flags & POOL_CHUNK)) ? buffer_size(c, newcap) : 0;
+	unsigned int *id = (unsigned int *)world_alloc(L, w, NULL, 0, newcap * sizeof(unsigned int));
+	void *buffer = NULL;
+	unsigned int *stamp = NULL;
+	if (bsize) {
+		buffer = world_realloc(w, NULL, 0, bsize);
+		if (buffer == NULL) {
+			world_free(w, id, newcap * sizeof(unsigned int));
+			luaL_error(L, "Out of memory");
 		}
 	}
-	// insert eid at [from]
-	if (from < c->n - 1) {
-		int i;
-		// Any dup id ?
-		for (i=from;i<c->n-1;i++) {
-			if (c->id[i] == c->id[i+1]) {
-				memmove(c->id + from + 1, c->id + from, sizeof(unsigned int) * (i - from));
-				c->id[from] = eid;
-				return;
-			}
+	if (c->flags & POOL_STAMP) {
+		stamp = (unsigned int *)world_realloc(w, NULL, 0, newcap * sizeof(unsigned int));
+		if (stamp == NULL) {
+			world_free(w, id, newcap * sizeof(unsigned int));
+			world_free(w, buffer, bsize);
+			luaL_error(L, "Out of memory");
 		}
 	}
-	// 0xffffffff max uint avoid check
-	add_component_id_(L, world_index, w, cid, 0xffffffff);
-	memmove(c->id + from + 1, c->id + from, sizeof(unsigned int) * (c->n - from - 1));
-	c->id[from] = eid;
+	int n = c->n < newcap ? c->n : newcap;
+	if (c->id) {
+		memcpy(id, c->id, n * sizeof(unsigned int));
+		world_free(w, c->id, c->cap * sizeof(unsigned int));
+	}
+	if (stamp) {
+		if (c->stamp) {
+			memcpy(stamp, c->stamp, n * sizeof(unsigned int));
+			world_free(w, c->stamp, c->cap * sizeof(unsigned int));
+		}
+		c->stamp = stamp;
+	}
+	if (bsize) {
+		if (c->flags & POOL_SOA) {
+			soa_move_buffer(c, buffer, newcap, n);
+		} else if (c->buffer) {
+			memcpy(buffer, c->buffer, n * c->stride);
+		}
+		world_free(w, c->buffer, buffer_size(c, c->cap));
+		c->buffer = buffer;
+	}
+	c->id = id;
+	c->cap = newcap;
 }
 
 static void
-entity_enable_tag_(struct entity_world *w, int cid, int index, int tag_id, void *L, int world_index) {
-	struct component_pool *c = &w->c[cid];
-	assert(index >=0 && index < c->n);
-	unsigned int eid = c->id[index];
-	insert_id((lua_State *)L, world_index, w, tag_id, eid);
+pool_free(struct entity_world *w, struct component_pool *c) {
+	world_free(w, c->id, c->cap * sizeof(unsigned int));
+	c->id = NULL;
+	world_free(w, c->stamp, c->cap * sizeof(unsigned int));
+	c->stamp = NULL;
+	if (c->stride > 0) {
+		if (!(c->flags & POOL_CHUNK))
+			world_free(w, c->buffer, buffer_size(c, c->cap));
+		c->buffer = NULL;
+	}
+	world_free(w, c->bits, c->bits_n * sizeof(uint64_t));
+	c->bits = NULL;
+	c->bits_n = 0;
 }
 
-static int
-binary_search(unsigned int *a, int from, int to, unsigned int v) {
-	while(from < to) {
-		int mid = (from + to)/2;
-		int aa = a[mid];
-		if (aa == v)
-			return mid;
-		else if (aa < v) {
-			from = mid + 1;
-		} else {
-			to = mid;
-		}
+// The components of POOL_STAMP are stamped when they are added or changed, see world:select "name:changed"
+static inline void
+stamp_row(struct entity_world *w, struct component_pool *c, int index) {
+	if (c->stamp) {
+		c->stamp[index] = w->change_version;
+		// stamp_max is shared by threads, parallel_dispatch sets it after the parallel region
+		if (!w->in_parallel)
+			c->stamp_max = w->change_version;
 	}
-	return -1;
 }
 
-#define GUESS_RANGE 64
+// Start to stamp the changes of pool, all the components are changed at first
+static void
+stamp_track(lua_State *L, struct entity_world *w, struct component_pool *c) {
+	if (c->flags & POOL_STAMP)
+		return;
+	if (c->id) {
+		unsigned int *stamp = (unsigned int *)world_alloc(L, w, NULL, 0, c->cap * sizeof(unsigned int));
+		int i;
+		for (i=0;i<c->n;i++) {
+			stamp[i] = w->change_version;
+		}
+		c->stamp = stamp;
+	}
+	c->flags |= POOL_STAMP;
+	c->stamp_max = w->change_version;
+}
 
+// The sparse index maps eid to index + 1. An entry is trusted only if it points back to the same eid,
+// and every eid in the pool always has a valid entry, so a stale entry means the eid is absent.
 static inline int
-lookup_component(struct component_pool *pool, unsigned int eid, int guess_index) {
-	int n = pool->n;
-	if (n == 0)
+sparse_index_lookup(struct component_pool *pool, unsigned int eid) {
+	unsigned int p = eid >> SPARSE_PAGE_SHIFT;
+	if (p >= (unsigned int)pool->sparse_n)
 		return -1;
-	if (guess_index < 0 || guess_index >= pool->n)
-		return binary_search(pool->id, 0, pool->n, eid);
-	unsigned int *a = pool->id;
-	int lower = a[guess_index];
-	if (eid <= lower) {
-		if (eid == lower)
-			return guess_index;
-		return binary_search(a, 0, guess_index, eid);
-	}
-	if (guess_index + GUESS_RANGE*2 >= pool->n) {
-		return binary_search(a, guess_index + 1, pool->n, eid);
+	int *page = pool->sparse[p];
+	if (page == NULL)
+		return -1;
+	int index = page[eid & SPARSE_PAGE_MASK] - 1;
+	if (index < 0 || index >= pool->n || pool->id[index] != eid)
+		return -1;
+	return index;
+}
+
+static void
+sparse_index_set(lua_State *L, struct entity_world *w, struct component_pool *pool, unsigned int eid, int index) {
+	unsigned int p = eid >> SPARSE_PAGE_SHIFT;
+	if (p >= (unsigned int)pool->sparse_n) {
+		int n = pool->sparse_n * 2;
+		if (n <= p)
+			n = p + 1;
+		pool->sparse = (int **)world_alloc(L, w, pool->sparse, pool->sparse_n * sizeof(int *), n * sizeof(int *));
+		memset(pool->sparse + pool->sparse_n, 0, (n - pool->sparse_n) * sizeof(int *));
+		pool->sparse_n = n;
 	}
-	int higher = a[guess_index + GUESS_RANGE];
-	if (eid > higher) {
-		return binary_search(a, guess_index + GUESS_RANGE + 1, pool->n, eid);
+	int *page = pool->sparse[p];
+	if (page == NULL) {
+		page = (int *)world_alloc(L, w, NULL, 0, SPARSE_PAGE_SIZE * sizeof(int));
+		memset(page, 0, SPARSE_PAGE_SIZE * sizeof(int));
+		pool->sparse[p] = page;
 	}
-	return binary_search(a, guess_index + 1, guess_index + GUESS_RANGE + 1, eid);
+	page[eid & SPARSE_PAGE_MASK] = index + 1;
 }
 
+// id[index] moved into index, its page must exist
 static inline void
-replace_id(struct component_pool *c, int from, int to, unsigned int eid) {
-	int i;
-	for (i=from;i<to;i++) {
-		c->id[i] = eid;
+sparse_index_move(struct component_pool *pool, int index) {
+	if (pool->flags & POOL_SPARSE) {
+		unsigned int eid = pool->id[index];
+		unsigned int p = eid >> SPARSE_PAGE_SHIFT;
+		assert(p < (unsigned int)pool->sparse_n && pool->sparse[p]);
+		pool->sparse[p][eid & SPARSE_PAGE_MASK] = index + 1;
 	}
 }
 
-static void
-entity_disable_tag_(struct entity_world *w, int cid, int index, int tag_id) {
-	struct component_pool *c = &w->c[cid];
-	assert(index >=0 && index < c->n);
-	unsigned int eid = c->id[index];
-	if (cid != tag_id) {
-		c = &w->c[tag_id];
-		index = lookup_component(c, eid, c->last_lookup);
-		if (index < 0)
-			return;
-	}
-	int from,to;
-	// find next tag. You may disable subsquent tags in iteration.
-	// For example, The sequence is 1 3 5 7 9 . We are now on 5 , and disable 7 .
-	// We should change 7 to 9 ( 1 3 5 9 9 ) rather than 7 to 5 ( 1 3 5 5 9 )
-	//                   iterator ->   ^                                ^
-	for (to = index+1; to<c->n; to++) {
-		if (c->id[to] != eid) {
-			for (from = index-1; from>=0; from--) {
-				if (c->id[from] != eid)
-					break;
-			}
-			replace_id(c, from+1, to, c->id[to]);
-			return;
+static inline void
+sparse_index_range(struct component_pool *pool, int from, int to) {
+	if (pool->flags & POOL_SPARSE) {
+		int i;
+		for (i=from;i<to;i++) {
+			sparse_index_move(pool, i);
 		}
 	}
-	for (from = index-1; from>=0; from--) {
-		if (c->id[from] != eid)
-			break;
-	}
-	c->n = from + 1;
 }
 
 static void
-entity_remove_(struct entity_world *w, int cid, int index, void *L, int world_index) {
-	entity_enable_tag_(w, cid, index, ENTITY_REMOVED, L, world_index);
+sparse_index_free(struct entity_world *w, struct component_pool *pool) {
+	int i;
+	for (i=0;i<pool->sparse_n;i++) {
+		world_free(w, pool->sparse[i], SPARSE_PAGE_SIZE * sizeof(int));
+	}
+	world_free(w, pool->sparse, pool->sparse_n * sizeof(int *));
+	pool->sparse = NULL;
+	pool->sparse_n = 0;
 }
 
-struct rearrange_context {
-	struct entity_world *w;
-	unsigned int ptr[MAX_COMPONENT-1];
-};
+#if defined(_MSC_VER)
 
-static int
-find_min(struct rearrange_context *ctx) {
-	unsigned int m = ~0;
-	int i;
-	int r = -1;
-	struct entity_world *w = ctx->w;
-	for (i=1;i<MAX_COMPONENT;i++) {
-		int index = ctx->ptr[i-1];
-		if (index < w->c[i].n) {
-			if (w->c[i].id[index] <= m) {
-				m = w->c[i].id[index];
-				r = i;
-			}
-		}
-	}
-	return r;
+#include <intrin.h>
+
+static inline int
+ctz64(uint64_t v) {
+	unsigned long r;
+	_BitScanForward64(&r, v);
+	return (int)r;
 }
 
-static void
-rearrange(struct entity_world *w) {
-	struct rearrange_context ctx;
-	memset(&ctx, 0, sizeof(ctx));
-	ctx.w = w;
-	int cid;
-	unsigned int new_id = 1;
-	unsigned int last_id = 0;
-	while ((cid = find_min(&ctx)) >= 0) {
-		int index = ctx.ptr[cid-1];
-		unsigned int current_id = w->c[cid].id[index];
-//		printf("arrange %d <- %d\n", new_id, w->c[cid].id[index]);
-		w->c[cid].id[index] = new_id;
-		if (current_id != last_id) {
-			++new_id;
-			last_id = current_id;
-		}
-		++ctx.ptr[cid-1];
-	}
-	w->max_id = new_id;
+#else
+
+#define ctz64(v) __builtin_ctzll(v)
+
+#endif
+
+// Bitset pools keep the tags in bits. The id array is rebuilt from bits when an iteration starts,
+// so enable/disable are O(1) and the capacity of id is always enough for bits_count.
+
+static inline int
+bitset_test(struct component_pool *c, unsigned int eid) {
+	unsigned int i = eid / 64;
+	return i < (unsigned int)c->bits_n && (c->bits[i] >> (eid % 64) & 1);
 }
 
-static inline void
-move_tag(struct component_pool *pool, int from, int to) {
-	if (from != to) {
-		pool->id[to] = pool->id[from];
+// the first eid >= eid in bitset, or 0 if none
+static unsigned int
+bitset_next(struct component_pool *c, unsigned int eid) {
+	unsigned int i = eid / 64;
+	if (i >= (unsigned int)c->bits_n)
+		return 0;
+	uint64_t bits = c->bits[i] & (~(uint64_t)0 << (eid % 64));
+	for (;;) {
+		if (bits)
+			return i * 64 + ctz64(bits);
+		if (++i >= (unsigned int)c->bits_n)
+			return 0;
+		bits = c->bits[i];
 	}
 }
 
-static inline void
-move_item(struct component_pool *pool, int from, int to) {
-	if (from != to) {
-		pool->id[to] = pool->id[from];
-		int stride = pool->stride;
-		memcpy((char *)pool->buffer + to * stride, (char *)pool->buffer + from * stride, stride);
+static void
+bitset_enable(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid) {
+	struct component_pool *c = &w->c[cid];
+	unsigned int i = eid / 64;
+	if (i >= (unsigned int)c->bits_n) {
+		int n = c->bits_n * 3 / 2;
+		if (n <= i)
+			n = i + 1;
+		c->bits = (uint64_t *)world_alloc(L, w, c->bits, c->bits_n * sizeof(uint64_t), n * sizeof(uint64_t));
+		memset(c->bits + c->bits_n, 0, (n - c->bits_n) * sizeof(uint64_t));
+		c->bits_n = n;
+	}
+	if (c->id == NULL || c->bits_count >= c->cap) {
+		int newcap = c->cap;
+		if (c->bits_count >= newcap)
+			newcap = newcap * 3 / 2;
+		if (newcap <= c->bits_count)
+			newcap = c->bits_count + 1;
+		pool_resize(L, w, c, newcap);
+	}
+	uint64_t mask = (uint64_t)1 << (eid % 64);
+	if (c->bits[i] & mask)
+		return;
+	c->bits[i] |= mask;
+	++c->bits_count;
+	++c->version;
+	mask_mark(w, cid, eid);
+	if (!(c->flags & POOL_DIRTY) && (c->n == 0 || c->id[c->n-1] < eid)) {
+		// new entity, append
+		c->id[c->n++] = eid;
+	} else {
+		c->flags |= POOL_DIRTY;
 	}
 }
 
 static void
-move_object(lua_State *L, struct component_pool *pool, int from, int to) {
-	if (from != to) {
-		pool->id[to] = pool->id[from];
-		lua_rawgeti(L, -1, from+1);
-		lua_rawseti(L, -2, to+1);
+bitset_disable(struct component_pool *c, unsigned int eid) {
+	unsigned int i = eid / 64;
+	uint64_t mask = (uint64_t)1 << (eid % 64);
+	if (i < (unsigned int)c->bits_n && (c->bits[i] & mask)) {
+		c->bits[i] &= ~mask;
+		--c->bits_count;
+		c->flags |= POOL_DIRTY;
+		++c->version;
 	}
 }
 
 static void
-remove_all(lua_State *L, struct component_pool *pool, struct component_pool *removed, int cid) {
-	int index = 0;
-	int count = 0;
+bitset_materialize(struct component_pool *c) {
+	if (!(c->flags & POOL_DIRTY))
+		return;
+	int n = 0;
 	int i;
-	if (pool->stride != STRIDE_ORDER) {
-		unsigned int *id = removed->id;
-		unsigned int last_id = 0;
-		for (i=0;i<removed->n;i++) {
-			if (id[i] != last_id) {
-				// todo : order
-				int r = lookup_component(pool, id[i], index);
-				if (r >= 0) {
-					index = r;
-					pool->id[r] = 0;
-					++count;
-				}
-			}
-		}
-	} else {
-		unsigned int *id = pool->id;
-		for (i=0;i<pool->n;i++) {
-			int r = lookup_component(removed, id[i], 0);
-			if (r >= 0) {
-				id[i] = 0;
-				++count;
-			}
-		}
-	}
-	if (count > 0) {
-		index = 0;
-		switch (pool->stride) {
-		case STRIDE_LUA:
-			if (lua_getiuservalue(L, 1, cid * 2 + 2) != LUA_TTABLE) {
-				luaL_error(L, "Missing lua object table for type %d", cid);
-			}
-			for (i=0;i<pool->n;i++) {
-				if (pool->id[i] != 0) {
-					move_object(L, pool, i, index);
-					++index;
-				}
-			}
-			lua_pop(L, 1);	// pop lua object table
-			break;
-		case STRIDE_TAG:
-		case STRIDE_ORDER:
-			for (i=0;i<pool->n;i++) {
-				if (pool->id[i] != 0) {
-					move_tag(pool, i, index);
-					++index;
-				}
-			}
-			break;
-		default:
-			for (i=0;i<pool->n;i++) {
-				if (pool->id[i] != 0) {
-					move_item(pool, i, index);
-					++index;
-				}
-			}
-			break;
+	for (i=0;i<c->bits_n;i++) {
+		uint64_t bits = c->bits[i];
+		while (bits) {
+			c->id[n++] = i * 64 + ctz64(bits);
+			bits &= bits - 1;
 		}
-		pool->n -= count;
 	}
+	assert(n == c->bits_count);
+	c->n = n;
+	c->flags &= ~POOL_DIRTY;
+	++c->version;
 }
 
-static int
-lupdate(lua_State *L) {
-	struct entity_world *w = getW(L);
-	struct component_pool *removed = &w->c[ENTITY_REMOVED];
+// remove disabled tags from index, keep the iteration before index stable
+static void
+bitset_compact(struct component_pool *c, int index) {
 	int i;
-	if (removed->n > 0) {
-		// mark removed
-		assert(ENTITY_REMOVED == 0);
-		for (i=1;i<MAX_COMPONENT;i++) {
-			struct component_pool *pool = &w->c[i];
-			if (pool->n > 0)
-				remove_all(L, pool, removed, i);
+	int to = index;
+	for (i=index;i<c->n;i++) {
+		if (bitset_test(c, c->id[i])) {
+			c->id[to++] = c->id[i];
 		}
-		removed->n = 0;
 	}
+	c->n = to;
+	++c->version;
+}
 
-	if (w->max_id > REARRANGE_THRESHOLD) {
-		rearrange(w);
+static void
+bitset_rebuild(struct component_pool *c) {
+	memset(c->bits, 0, c->bits_n * sizeof(uint64_t));
+	int i;
+	for (i=0;i<c->n;i++) {
+		unsigned int eid = c->id[i];
+		assert(eid / 64 < (unsigned int)c->bits_n);
+		c->bits[eid / 64] |= (uint64_t)1 << (eid % 64);
 	}
+	c->bits_count = c->n;
+	c->flags &= ~POOL_DIRTY;
+}
 
-	return 0;
+static size_t
+sparse_index_memory(struct component_pool *pool) {
+	size_t sz = pool->sparse_n * sizeof(int *);
+	int i;
+	for (i=0;i<pool->sparse_n;i++) {
+		if (pool->sparse[i])
+			sz += SPARSE_PAGE_SIZE * sizeof(int);
+	}
+	return sz;
 }
 
+// Chunked pools never move the components, growing appends a new chunk to the chunk table.
+
 static void
-remove_dup(struct component_pool *c, int index) {
+chunk_grow(lua_State *L, struct entity_world *w, struct component_pool *pool, int n) {
 	int i;
-	unsigned int eid = c->id[index];
-	int to = index;
-	for (i=index+1;i<c->n;i++) {
-		if (c->id[i] != eid) {
-			eid = c->id[i];
-			c->id[to] = eid;
-			++to;
+	if (n > pool->chunk_n) {
+		pool->chunk = (void **)world_alloc(L, w, pool->chunk, pool->chunk_n * sizeof(void *), n * sizeof(void *));
+		for (i=pool->chunk_n;i<n;i++) {
+			pool->chunk[i] = NULL;
 		}
+		pool->chunk_n = n;
+	}
+	for (i=0;i<n;i++) {
+		if (pool->chunk[i] == NULL)
+			pool->chunk[i] = world_alloc(L, w, NULL, 0, (size_t)CHUNK_SIZE * pool->stride);
 	}
-	c->n = to;
 }
 
-static void *
-entity_iter_(struct entity_world *w, int cid, int index) {
-	struct component_pool *c = &w->c[cid];
-	assert(index >= 0);
-	if (index >= c->n)
-		return NULL;
-	if (c->stride == STRIDE_TAG) {
-		// it's a tag
-		unsigned int eid = c->id[index];
-		if (index < c->n - 1 && eid == c->id[index+1]) {
-			remove_dup(c, index+1);
-		}
-		return DUMMY_PTR;
+static void
+chunk_shrink(struct entity_world *w, struct component_pool *pool, int n) {
+	int i;
+	for (i=n;i<pool->chunk_n;i++) {
+		world_free(w, pool->chunk[i], (size_t)CHUNK_SIZE * pool->stride);
+		pool->chunk[i] = NULL;
+	}
+	if (n == 0) {
+		world_free(w, pool->chunk, pool->chunk_n * sizeof(void *));
+		pool->chunk = NULL;
+		pool->chunk_n = 0;
 	}
-	return get_ptr(c, index);
 }
 
-static void *
-entity_iter_lua_(struct entity_world *w, int cid, int index, void *L, int world_index) {
-	void * ret = entity_iter_(w, cid, index);
-	if (ret != DUMMY_PTR)
-		return ret;
-	if (lua_getiuservalue(L, world_index, cid * 2 + 2) != LUA_TTABLE) {
-		lua_pop(L, 1);
-		return NULL;
-	}
-	int t = lua_rawgeti(L, -1, index+1);
-	switch(t) {
-	case LUA_TSTRING:
-		ret = (void *)lua_tostring(L, -1);
-		break;
-	case LUA_TUSERDATA:
-	case LUA_TLIGHTUSERDATA:
-		ret = (void *)lua_touserdata(L, -1);
-		break;
-	default:
-		ret = NULL;
-		break;
+static inline size_t
+chunk_memory(struct component_pool *pool) {
+	size_t sz = pool->chunk_n * sizeof(void *);
+	int i;
+	for (i=0;i<pool->chunk_n;i++) {
+		if (pool->chunk[i])
+			sz += (size_t)CHUNK_SIZE * pool->stride;
 	}
-	lua_pop(L, 2);
-	return ret;
+	return sz;
 }
 
 static int
-entity_assign_lua_(struct entity_world *w, int cid, int index, void *L, int world_index) {
-	struct component_pool *c = &w->c[cid];
-	++index;
-	assert(lua_gettop(L) > 1);
-	if (c->stride != STRIDE_LUA || index <=0 || index > c->n) {
-		lua_pop(L, 1);
-		return 0;
-	}
-	if (lua_getiuservalue(L, world_index, cid * 2 + 2) != LUA_TTABLE) {
-		lua_pop(L, 2);
-		return 0;
+lcount_memory(lua_State *L) {
+	struct entity_world *w = getW(L);
+	// all the memory of components comes from world allocator
+	size_t sz = sizeof(*w) + w->memory;
+	int i;
+	size_t msz = sizeof(*w);
+	for (i=0;i<MAX_COMPONENT;i++) {
+		struct component_pool *c = &w->c[i];
+		if (c->id) {
+			msz += c->n * sizeof(unsigned int);
+		}
+		if (c->flags & POOL_CHUNK) {
+			msz += chunk_memory(c);
+		} else if (c->buffer != DUMMY_PTR) {
+			msz += buffer_size(c, c->cap);
+		}
+		if (c->sparse) {
+			msz += sparse_index_memory(c);
+		}
+		if (c->bits) {
+			msz += c->bits_n * sizeof(uint64_t);
+		}
 	}
-	lua_insert(L, -2);
-	// table value
-	lua_rawseti(L, -2, index);
-	lua_pop(L, 1);
-	return 1;
+	lua_pushinteger(L, sz);
+	lua_pushinteger(L, msz);
+	return 2;
 }
 
 static void
-entity_clear_type_(struct entity_world *w, int cid) {
-	struct component_pool *c = &w->c[cid];
-	c->n = 0;
+shrink_component_pool(lua_State *L, struct entity_world *w, struct component_pool *c, int id) {
+	if (c->id == NULL)
+		return;
+	if (c->flags & POOL_BITSET)
+		bitset_materialize(c);
+	if (c->n == 0) {
+		pool_free(w, c);
+		if (c->sparse)
+			sparse_index_free(w, c);
+		chunk_shrink(w, c, 0);
+		if (c->stride == STRIDE_LUA) {
+			lua_pushnil(L);
+			lua_setiuservalue(L, 1, id * 2 + 2);
+		}
+	} else {
+		if (c->flags & POOL_CHUNK)
+			chunk_shrink(w, c, (c->n + CHUNK_MASK) >> CHUNK_SHIFT);
+		if (c->n < c->cap)
+			pool_resize(L, w, c, c->n);
+	}
 }
 
 static int
-lclear_type(lua_State *L) {
+lcollect_memory(lua_State *L) {
 	struct entity_world *w = getW(L);
-	int cid = check_cid(L,w, 2);
-	entity_clear_type_(w, cid);
-	return 0;
-}
-
-static int
-entity_sibling_index_(struct entity_world *w, int cid, int index, int silbling_id) {
-	struct component_pool *c = &w->c[cid];
-	if (index < 0 || index >= c->n)
-		return 0;
-	unsigned int eid = c->id[index];
-	c = &w->c[silbling_id];
-	assert(c->stride != STRIDE_ORDER);
-	int result_index = lookup_component(c, eid, c->last_lookup);
-	if (result_index >= 0) {
-		c->last_lookup = result_index;
-		return result_index + 1;
+	int i;
+	for (i=0;i<MAX_COMPONENT;i++) {
+		shrink_component_pool(L, w, &w->c[i], i);
 	}
 	return 0;
 }
 
-static void *
-entity_add_sibling_(struct entity_world *w, int cid, int index, int silbling_id, const void *buffer, void *L, int world_index) {
-	struct component_pool *c = &w->c[cid];
-	assert(index >=0 && index < c->n);
-	unsigned int eid = c->id[index];
-	// todo: pcall add_component_
-	return add_component_((lua_State *)L, world_index, w, silbling_id, eid, buffer);
+// Grow the pool by one, the id of the new slot is not set
+static int
+append_slot(lua_State *L, int world_index, struct entity_world *w, int cid) {
+	struct component_pool *pool = &w->c[cid];
+	int cap = pool->cap;
+	int index = pool->n;
+	if (pool->n == 0) {
+		if (pool->id == NULL) {
+			pool_resize(L, w, pool, cap);
+		}
+		if (pool->stride == STRIDE_LUA) {
+			lua_newtable(L);
+			lua_setiuservalue(L, world_index, cid * 2 + 2);
+		}
+	} else if (pool->n >= pool->cap) {
+		// expand pool
+		pool_resize(L, w, pool, cap * 3 / 2 + 1);
+	}
+	if ((pool->flags & POOL_CHUNK) && ((index >> CHUNK_SHIFT) >= pool->chunk_n || pool->chunk[index >> CHUNK_SHIFT] == NULL)) {
+		chunk_grow(L, w, pool, (index >> CHUNK_SHIFT) + 1);
+	}
+	stamp_row(w, pool, index);
+	++pool->n;
+	++pool->version;
+	return index;
 }
 
 static int
-entity_new_(struct entity_world *w, int cid, const void *buffer, void *L, int world_index) {
-	unsigned int eid = ++w->max_id;
-	assert(eid != 0);
-	struct component_pool *c = &w->c[cid];
-	assert(c->cap > 0);
-	if (buffer == NULL) {
-		return add_component_id_(L, world_index, w, cid, eid);
-	} else {
-		assert(c->stride >= 0);
-		int index = add_component_id_(L, world_index, w, cid, eid);
-		void *ret = get_ptr(c, index);
-		memcpy(ret, buffer, c->stride);
-		return index;
+append_id(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid) {
+	struct component_pool *pool = &w->c[cid];
+	int index = append_slot(L, world_index, w, cid);
+	pool->id[index] = eid;
+	mask_mark(w, cid, eid);
+	if (pool->stride != STRIDE_ORDER && index > 0 && eid < pool->id[index-1]) {
+		luaL_error(L, "Add component %d fail", cid);
 	}
+	return index;
 }
 
 static int
-entity_add_sibling_index_(lua_State *L, int world_index, struct entity_world *w, int cid, int index, int slibling_id) {
-	struct component_pool *c = &w->c[cid];
-	assert(index >=0 && index < c->n);
-	unsigned int eid = c->id[index];
-	// todo: pcall add_component_
-	int ret = add_component_id_(L, world_index, w, slibling_id, eid);
-	return ret;
-}
+binary_search(unsigned int *a, int from, int to, unsigned int v);
 
 static int
-lcontext(lua_State *L) {
-	struct entity_world *w = getW(L);
-	luaL_checktype(L, 2, LUA_TTABLE);
-	lua_len(L, 2);
-	int n = lua_tointeger(L, -1);
-	lua_pop(L, 1);
-	if (n <= 0) {
-		return luaL_error(L, "Invalid length %d of table", n);
+add_component_id_(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid) {
+	struct component_pool *pool = &w->c[cid];
+	if (pool->flags & POOL_BITSET) {
+		bitset_enable(L, world_index, w, cid, eid);
+		bitset_materialize(pool);
+		return binary_search(pool->id, 0, pool->n, eid);
 	}
-	size_t sz = sizeof(struct ecs_context) + sizeof(int) * n;
-	struct ecs_context *ctx = (struct ecs_context *)lua_newuserdatauv(L, sz, 1);
-	ctx->L = (void *)lua_newthread(L);
-	lua_pushvalue(L, 1);
-	lua_xmove(L, ctx->L, 1);	// put world in the index 1 of newthread
-	lua_setiuservalue(L, -2, 1);
-	ctx->max_id = n;
-	ctx->world = w;
-	static struct ecs_capi c_api = {
-		entity_iter_,
-		entity_clear_type_,
-		entity_sibling_index_,
-		entity_add_sibling_,
-		entity_new_,
-		entity_remove_,
-		entity_enable_tag_,
-		entity_disable_tag_,
-		entity_iter_lua_,
-		entity_assign_lua_,
-	};
-	ctx->api = &c_api;
-	ctx->cid[0] = ENTITY_REMOVED;
-	int i;
-	for (i=1;i<=n;i++) {
-		if (lua_geti(L, 2, i) != LUA_TNUMBER) {
-			return luaL_error(L, "Invalid id at index %d", i);
-		}
-		ctx->cid[i] = lua_tointeger(L, -1);
-		lua_pop(L, 1);
-		int cid = ctx->cid[i];
-		if (cid == ENTITY_REMOVED || cid < 0 || cid >= MAX_COMPONENT)
-			return luaL_error(L, "Invalid id (%d) at index %d", cid, i);
+	int index = append_id(L, world_index, w, cid, eid);
+	if (pool->flags & POOL_SPARSE) {
+		sparse_index_set(L, w, pool, eid, index);
 	}
-	return 1;
+	return index;
 }
 
-static int
-lnew_world(lua_State *L) {
-	size_t sz = sizeof(struct entity_world);
-	struct entity_world *w = (struct entity_world *)lua_newuserdatauv(L, sz, MAX_COMPONENT * 2);
-	memset(w, 0, sz);
-	// removed set
-	entity_new_type(L, w, ENTITY_REMOVED, 0, 0);
-	luaL_getmetatable(L, "ENTITY_WORLD");
-	lua_setmetatable(L, -2);
-	return 1;
+static inline void *
+soa_column(struct component_pool *c, int field) {
+	return soa_base(c->buffer) + c->soa[field].pos;
 }
 
-#define TYPE_INT 0
-#define TYPE_FLOAT 1
-#define TYPE_BOOL 2
-#define TYPE_INT64 3
-#define TYPE_DWORD 4
-#define TYPE_WORD 5
-#define TYPE_BYTE 6
-#define TYPE_DOUBLE 7
-#define TYPE_USERDATA 8
-#define TYPE_COUNT 9
-
-struct field {
-	const char *key;
-	int offset;
-	int type;
-};
+// For soa pool, it's the address of the first field
+static inline void *
+get_ptr(struct component_pool *c, int index) {
+	if (c->stride > 0) {
+		if (c->flags & POOL_CHUNK)
+			return (void *)((char *)c->chunk[index >> CHUNK_SHIFT] + c->stride * (index & CHUNK_MASK));
+		if (c->flags & POOL_SOA)
+			return (void *)((char *)soa_column(c, 0) + c->soa[0].size * index);
+		return (void *)((char *)c->buffer + c->stride * index);
+	} else
+		return DUMMY_PTR;
+}
 
-static int
-check_type(lua_State *L) {
-	int type = lua_tointeger(L, -1);
-	if (type < 0 || type >= TYPE_COUNT) {
-		luaL_error(L, "Invalid field type(%d)", type);
+static void
+soa_gather(struct component_pool *c, int index, void *row) {
+	int i;
+	for (i=0;i<c->soa_n;i++) {
+		struct soa_column *col = &c->soa[i];
+		memcpy((char *)row + col->offset, (char *)soa_column(c, i) + (size_t)col->size * index, col->size);
 	}
-	lua_pop(L, 1);
-	return type;
 }
 
 static void
-get_field(lua_State *L, int i, struct field *f) {
-	if (lua_geti(L, -1, 1) != LUA_TNUMBER) {
-		luaL_error(L, "Invalid field %d [1] type", i);
+soa_scatter(struct component_pool *c, int index, const void *row) {
+	int i;
+	for (i=0;i<c->soa_n;i++) {
+		struct soa_column *col = &c->soa[i];
+		memcpy((char *)soa_column(c, i) + (size_t)col->size * index, (const char *)row + col->offset, col->size);
 	}
-	f->type = check_type(L);
+}
 
-	if (lua_geti(L, -1, 2) != LUA_TSTRING) {
-		luaL_error(L, "Invalid field %d [2] key", i);
+// The struct of component at index, it's a copy in the scratch row for soa pool.
+static inline void *
+get_row(struct component_pool *c, int index) {
+	if (c->flags & POOL_SOA) {
+		soa_gather(c, index, c->row);
+		return c->row;
 	}
-	f->key = lua_tostring(L, -1);
-	lua_pop(L, 1);
+	return get_ptr(c, index);
+}
 
-	if (lua_geti(L, -1, 3) != LUA_TNUMBER) {
-		luaL_error(L, "Invalid field %d [3] offset", i);
+// Write back the scratch row from get_row
+static inline void
+commit_row(struct component_pool *c, int index) {
+	if (c->flags & POOL_SOA)
+		soa_scatter(c, index, c->row);
+}
+
+static inline void
+write_row(struct component_pool *c, int index, const void *buffer) {
+	if (c->flags & POOL_SOA)
+		soa_scatter(c, index, buffer);
+	else
+		memcpy(get_ptr(c, index), buffer, c->stride);
+}
+
+// Lua writes back all the out components, so a stamped row is compared with the copy before writing.
+#define STAMP_COMPARE 256	// larger rows are stamped at each write
+
+struct row_write {
+	char *row;
+	int compare;
+	char old[STAMP_COMPARE];
+};
+
+static inline void *
+row_write_begin(struct component_pool *c, int index, struct row_write *rw) {
+	rw->row = (char *)get_row(c, index);
+	rw->compare = (c->stamp && c->stride <= STAMP_COMPARE);
+	if (rw->compare)
+		memcpy(rw->old, rw->row, c->stride);
+	return rw->row;
+}
+
+static inline void
+row_write_end(struct entity_world *w, struct component_pool *c, int index, struct row_write *rw) {
+	if (c->stamp && !(rw->compare && memcmp(rw->old, rw->row, c->stride) == 0))
+		stamp_row(w, c, index);
+	commit_row(c, index);
+}
+
+static void *
+add_component_(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid, const void *buffer) {
+	int index = add_component_id_(L, world_index, w, cid, eid);
+	struct component_pool *pool = &w->c[cid];
+	if (buffer) {
+		assert(pool->stride >= 0);
+		write_row(pool, index, buffer);
 	}
-	f->offset = lua_tointeger(L, -1);
-	lua_pop(L, 1);
+	return get_ptr(pool, index);
+}
 
-	lua_pop(L, 1);
+// Add cid to count new entities from eid, grow the pool once. Returns the index of the first one.
+static int
+add_component_batch_(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid, int count) {
+	struct component_pool *pool = &w->c[cid];
+	int n = (pool->flags & POOL_BITSET) ? pool->bits_count : pool->n;
+	if (pool->id == NULL || n + count > pool->cap) {
+		int newcap = pool->cap * 3 / 2 + 1;
+		if (newcap < n + count)
+			newcap = n + count;
+		pool_resize(L, w, pool, newcap);
+	}
+	int index = add_component_id_(L, world_index, w, cid, eid);
+	int i;
+	for (i=1;i<count;i++) {
+		add_component_id_(L, world_index, w, cid, eid + i);
+	}
+	return index;
 }
 
+// copy the component at index to the next count-1 components
 static void
-write_value(lua_State *L, struct field *f, char *buffer) {
-	int luat = lua_type(L, -1);
-	char *ptr = buffer + f->offset;
-	switch (f->type) {
-		case TYPE_INT:
-			if (!lua_isinteger(L, -1))
-				luaL_error(L, "Invalid .%s type %s (int)", f->key ? f->key : "*", lua_typename(L, luat));
-			*(int *)ptr = lua_tointeger(L, -1);
-			break;
-		case TYPE_FLOAT:
-			if (luat != LUA_TNUMBER)
-				luaL_error(L, "Invalid .%s type %s (float)", f->key ? f->key : "*", lua_typename(L, luat));
-			*(float *)ptr = lua_tonumber(L, -1);
-			break;
-		case TYPE_BOOL:
-			if (luat != LUA_TBOOLEAN)
-				luaL_error(L, "Invalid .%s type %s (bool)", f->key ? f->key : "*", lua_typename(L, luat));
-			*(unsigned char *)ptr = lua_toboolean(L, -1);
-			break;
-		case TYPE_INT64:
-			if (!lua_isinteger(L, -1))
-				luaL_error(L, "Invalid .%s type %s (int64)", f->key ? f->key : "*", lua_typename(L, luat));
-			*(int64_t *)ptr = lua_tointeger(L, -1);
-			break;
-		case TYPE_DWORD:
-			if (!lua_isinteger(L, -1))
-				luaL_error(L, "Invalid .%s type %s (uint32)", f->key ? f->key : "*", lua_typename(L, luat));
-			else {
-				int64_t v = lua_tointeger(L, -1);
-				if (v < 0 || v > 0xffffffff) {
-					luaL_error(L, "Invalid DWORD %d", (int)v);
-				}
-				*(uint32_t *)ptr = v;
-			}
-			break;
-		case TYPE_WORD:
-			if (!lua_isinteger(L, -1))
-				luaL_error(L, "Invalid .%s type %s (uint16)", f->key ? f->key : "*", lua_typename(L, luat));
-			else {
-				int v = lua_tointeger(L, -1);
-				if (v < 0 || v > 0xffff) {
-					luaL_error(L, "Invalid WORD %d", v);
-				}
-				*(uint16_t *)ptr = v;
-			}
-			break;
-		case TYPE_BYTE:
-			if (!lua_isinteger(L, -1))
-				luaL_error(L, "Invalid .%s type %s (uint8)", f->key ? f->key : "*", lua_typename(L, luat));
-			else {
-				int v = lua_tointeger(L, -1);
-				if (v < 0 || v > 255) {
-					luaL_error(L, "Invalid BYTE %d", v);
-				}
-				*(uint16_t *)ptr = v;
-			}
-			break;
-		case TYPE_DOUBLE:
-			if (luat != LUA_TNUMBER)
-				luaL_error(L, "Invalid .%s type %s (double)", f->key ? f->key : "*", lua_typename(L, luat));
-			*(double *)ptr = lua_tonumber(L, -1);
-			break;
-		case TYPE_USERDATA:
-			if (luat !=  LUA_TLIGHTUSERDATA)
-				luaL_error(L, "Invalid .%s type %s (pointer)", f->key ? f->key : "*", lua_typename(L, luat));
-			*(void **)ptr = lua_touserdata(L, -1);
-			break;
+replicate_component(struct component_pool *c, int index, int count) {
+	if (c->stride <= 0 || count <= 1)
+		return;
+	int i;
+	if (c->flags & (POOL_CHUNK | POOL_SOA)) {
+		void *row = get_row(c, index);
+		for (i=1;i<count;i++) {
+			write_row(c, index + i, row);
+		}
+	} else {
+		char *ptr = (char *)get_ptr(c, index);
+		size_t stride = c->stride;
+		// double the copied range each time
+		for (i=1;i<count;i*=2) {
+			int n = (count - i < i) ? count - i : i;
+			memcpy(ptr + i * stride, ptr, n * stride);
+		}
 	}
-	lua_pop(L, 1);
 }
 
-static inline void
-write_component(lua_State *L, int field_n, struct field *f, int index, char *buffer) {
-	int i;
-	for (i=0; i < field_n; i++) {
-		lua_getfield(L, index, f[i].key);
-		write_value(L, &f[i], buffer);
+static int
+handle_slot_new(lua_State *L, struct entity_world *w) {
+	int slot = w->slot_free;
+	if (slot >= 0) {
+		w->slot_free = w->slot[slot].next;
+		return slot;
+	}
+	if (w->slot_n >= w->slot_cap) {
+		int cap = w->slot_cap * 3 / 2 + 64;
+		w->slot = (struct handle_slot *)world_alloc(L, w, w->slot, w->slot_cap * sizeof(struct handle_slot), cap * sizeof(struct handle_slot));
+		w->slot_cap = cap;
 	}
+	slot = w->slot_n++;
+	w->slot[slot].gen = 1;
+	return slot;
 }
 
 static void
-read_value(lua_State *L, struct field *f, const char *buffer) {
-	const char * ptr = buffer + f->offset;
-	switch (f->type) {
-	case TYPE_INT:
-		lua_pushinteger(L, *(const int *)ptr);
-		break;
-	case TYPE_FLOAT:
-		lua_pushnumber(L, *(const float *)ptr);
-		break;
-	case TYPE_BOOL:
-		lua_pushboolean(L, *ptr);
-		break;
-	case TYPE_INT64:
-		lua_pushinteger(L, *(const int64_t *)ptr);
-		break;
-	case TYPE_DWORD:
-		lua_pushinteger(L, *(const uint32_t *)ptr);
-		break;
-	case TYPE_WORD:
-		lua_pushinteger(L, *(const uint16_t *)ptr);
-		break;
-	case TYPE_BYTE:
-		lua_pushinteger(L, *(const uint8_t *)ptr);
-		break;
-	case TYPE_DOUBLE:
-		lua_pushnumber(L, *(const double *)ptr);
-		break;
-	case TYPE_USERDATA:
-		lua_pushlightuserdata(L, *(void **)ptr);
-		break;
-	default:
-		// never here
-		luaL_error(L, "Invalid field type %d", f->type);
-		break;
-	}
+handle_slot_free(struct entity_world *w, int slot) {
+	struct handle_slot *s = &w->slot[slot];
+	s->eid = 0;
+	if (++s->gen == 0)
+		s->gen = 1;
+	s->next = w->slot_free;
+	w->slot_free = slot;
 }
 
-static void
-read_component(lua_State *L, int field_n, struct field *f, int index, const char * buffer) {
-	int i;
-	for (i=0; i < field_n; i++) {
-		read_value(L, &f[i], buffer);
-		lua_setfield(L, index, f[i].key);
+// New entities [eid, eid+count) , give each of them a handle slot if the world has handles.
+static unsigned int
+new_entity(lua_State *L, int world_index, struct entity_world *w, int count) {
+	unsigned int eid = new_entity_id(L, w, count);
+	int cid = w->handle_cid;
+	if (cid) {
+		struct component_pool *c = &w->c[cid];
+		int index = count == 1 ? add_component_id_(L, world_index, w, cid, eid) : add_component_batch_(L, world_index, w, cid, eid, count);
+		int i;
+		for (i=0;i<count;i++) {
+			int slot = handle_slot_new(L, w);
+			w->slot[slot].eid = eid + i;
+			*(int *)get_ptr(c, index + i) = slot;
+		}
 	}
+	return eid;
 }
 
 static int
-get_len(lua_State *L, int index) {
-	lua_len(L, index);
-	if (lua_type(L, -1) != LUA_TNUMBER) {
-		return luaL_error(L, "Invalid table length");
-	}
-	int n = lua_tointeger(L, -1);
-	if (n < 0) {
-		return luaL_error(L, "Invalid table length %d", n);
+entity_new_batch_(struct entity_world *w, int cid, const void *buffer, int count, int stride, void *L, int world_index) {
+	assert(!w->in_parallel);
+	struct component_pool *c = &w->c[cid];
+	if (count <= 0)
+		return c->n;
+	unsigned int eid = new_entity((lua_State *)L, world_index, w, count);
+	int index = add_component_batch_((lua_State *)L, world_index, w, cid, eid, count);
+	if (buffer && c->stride > 0) {
+		if (stride == 0) {
+			write_row(c, index, buffer);
+			replicate_component(c, index, count);
+		} else {
+			int i;
+			for (i=0;i<count;i++) {
+				write_row(c, index + i, (const char *)buffer + (size_t)stride * i);
+			}
+		}
 	}
-	lua_pop(L, 1);
-	return n;
+	return index;
 }
 
-#define COMPONENT_IN 1
-#define COMPONENT_OUT 2
-#define COMPONENT_OPTIONAL 4
-#define COMPONENT_OBJECT 8
-#define COMPONENT_EXIST 0x10
-#define COMPONENT_ABSENT 0x20
-#define COMPONENT_FILTER (COMPONENT_EXIST | COMPONENT_ABSENT)
-
-struct group_key {
-	const char *name;
-	int id;
-	int field_n;
-	int attrib;
-};
-
 static inline int
-is_temporary(int attrib) {
-	if (attrib & COMPONENT_FILTER)
-		return 0;
-	return (attrib & COMPONENT_IN) == 0 && (attrib & COMPONENT_OUT) == 0;
+check_cid(lua_State *L, struct entity_world *w, int index) {
+	int cid = luaL_checkinteger(L, index);
+	struct component_pool *c = &w->c[cid];
+	if (cid < 0 || 	cid >=MAX_COMPONENT || c->cap == 0) {
+		luaL_error(L, "Invalid type %d", cid);
+	}
+	return cid;
 }
 
-struct group_iter {
-	struct entity_world *world;
-	struct field *f;
-	int nkey;
-	int readonly;
-	struct group_key k[1];
-};
+static int
+ladd_component(lua_State *L) {
+	struct entity_world *w = getW(L);
+	unsigned int eid = luaL_checkinteger(L, 2);
+	int cid = check_cid(L, w, 3);
+	int count = luaL_optinteger(L, 4, 1);
+	int index;
+	if (count == 1)
+		index = add_component_id_(L, 1, w, cid, eid);
+	else if (count > 1)
+		index = add_component_batch_(L, 1, w, cid, eid, count);
+	else
+		return luaL_error(L, "Invalid count %d", count);
+	lua_pushinteger(L, index + 1);
+	return 1;
+}
 
 static int
-get_write_component(lua_State *L, int lua_index, const char *name, struct field *f, struct component_pool *c) {
-	switch (lua_getfield(L, lua_index, name)) {
-	case LUA_TNIL:
-		lua_pop(L, 1);
-		// restore cache (metatable can be absent during sync)
-		if (lua_getmetatable(L, lua_index)) {
-			lua_getfield(L, -1, name);
-			lua_setfield(L, lua_index, name);
-			lua_pop(L, 1);	// pop metatable
-		}
-		return 0;
-	case LUA_TTABLE:
-		return 1;
-	default:
-		if (c->stride == STRIDE_LUA) {
-			// lua object
-			return 1;
+lnew_entity(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int count = luaL_optinteger(L, 2, 1);
+	if (count <= 0)
+		return luaL_error(L, "Invalid count %d", count);
+	unsigned int eid = new_entity(L, 1, w, count);
+	assert(eid != 0);
+	lua_pushinteger(L, eid);
+	return 1;
+}
+
+static int
+lfill(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int cid = check_cid(L, w, 2);
+	int index = luaL_checkinteger(L, 3) - 1;
+	int count = luaL_checkinteger(L, 4);
+	struct component_pool *c = &w->c[cid];
+	if (index < 0 || count < 0 || index + count > c->n)
+		return luaL_error(L, "Invalid range of type %d", cid);
+	replicate_component(c, index, count);
+	return 0;
+}
+
+static void
+insert_id(lua_State *L, int world_index, struct entity_world *w, int cid, unsigned int eid) {
+	struct component_pool *c = &w->c[cid];
+	assert(c->stride == STRIDE_TAG);
+	if (c->flags & POOL_BITSET) {
+		bitset_enable(L, world_index, w, cid, eid);
+		return;
+	}
+	int from = 0;
+	int to = c->n;
+	while(from < to) {
+		int mid = (from + to)/2;
+		int aa = c->id[mid];
+		if (aa == eid)
+			return;
+		else if (aa < eid) {
+			from = mid + 1;
+		} else {
+			to = mid;
 		}
-		if (f->key == NULL) {
-			// value type
-			return 1;
+	}
+	// insert eid at [from]
+	if (from < c->n - 1) {
+		int i;
+		// Any dup id ?
+		for (i=from;i<c->n-1;i++) {
+			if (c->id[i] == c->id[i+1]) {
+				memmove(c->id + from + 1, c->id + from, sizeof(unsigned int) * (i - from));
+				c->id[from] = eid;
+				++c->version;
+				mask_mark(w, cid, eid);
+				if (c->flags & POOL_SPARSE) {
+					sparse_index_set(L, w, c, eid, from);
+					sparse_index_range(c, from + 1, i + 2);
+				}
+				return;
+			}
 		}
-		return luaL_error(L, "Invalid iterator type %s", lua_typename(L, lua_type(L, -1)));
+	}
+	append_slot(L, world_index, w, cid);
+	memmove(c->id + from + 1, c->id + from, sizeof(unsigned int) * (c->n - from - 1));
+	c->id[from] = eid;
+	mask_mark(w, cid, eid);
+	if (c->flags & POOL_SPARSE) {
+		sparse_index_set(L, w, c, eid, from);
+		sparse_index_range(c, from + 1, c->n);
 	}
 }
 
 static void
-write_component_object(lua_State *L, int n, struct field *f, void *buffer) {
-	if (f->key == NULL) {
-		write_value(L, f, buffer);
-	} else {
-		write_component(L, n, f, -1, (char *)buffer);
-		lua_pop(L, 1);
+entity_enable_tag_(struct entity_world *w, int cid, int index, int tag_id, void *L, int world_index) {
+	assert(!w->in_parallel);
+	struct component_pool *c = &w->c[cid];
+	assert(index >=0 && index < c->n);
+	unsigned int eid = c->id[index];
+	insert_id((lua_State *)L, world_index, w, tag_id, eid);
+}
+
+static int
+binary_search(unsigned int *a, int from, int to, unsigned int v) {
+	while(from < to) {
+		int mid = (from + to)/2;
+		int aa = a[mid];
+		if (aa == v)
+			return mid;
+		else if (aa < v) {
+			from = mid + 1;
+		} else {
+			to = mid;
+		}
+	}
+	return -1;
+}
+
+#define GUESS_RANGE 64
+
+static inline int
+lookup_component(struct component_pool *pool, unsigned int eid, int guess_index) {
+	int n = pool->n;
+	if (n == 0)
+		return -1;
+	if (pool->flags & POOL_SPARSE)
+		return sparse_index_lookup(pool, eid);
+	if (guess_index < 0 || guess_index >= pool->n)
+		return binary_search(pool->id, 0, pool->n, eid);
+	unsigned int *a = pool->id;
+	int lower = a[guess_index];
+	if (eid <= lower) {
+		if (eid == lower)
+			return guess_index;
+		return binary_search(a, 0, guess_index, eid);
+	}
+	if (guess_index + GUESS_RANGE*2 >= pool->n) {
+		return binary_search(a, guess_index + 1, pool->n, eid);
+	}
+	int higher = a[guess_index + GUESS_RANGE];
+	if (eid > higher) {
+		return binary_search(a, guess_index + GUESS_RANGE + 1, pool->n, eid);
 	}
+	return binary_search(a, guess_index + 1, guess_index + GUESS_RANGE + 1, eid);
 }
 
+// lower bound of eid in a[0, n), galloping from hint
 static int
-remove_tag(lua_State *L, int lua_index, const char *name) {
-	int r = 0;
-	switch (lua_getfield(L, lua_index, name)) {
-	case LUA_TNIL:
-		r = 1;
-		break;
-	case LUA_TBOOLEAN:
-		r = !lua_toboolean(L, -1);
-		break;
-	default:
-		return luaL_error(L, "Invalid tag type %s", lua_typename(L, lua_type(L, -1)));
+gallop_search(unsigned int *a, int n, int hint, unsigned int eid) {
+	int from, to, step;
+	if (n == 0)
+		return 0;
+	if (hint < 0 || hint >= n)
+		hint = 0;
+	if (a[hint] < eid) {
+		from = hint + 1;
+		to = n;
+		for (step = 1; hint + step < n; step *= 2) {
+			if (a[hint + step] >= eid) {
+				to = hint + step;
+				break;
+			}
+			from = hint + step + 1;
+		}
+	} else {
+		from = 0;
+		to = hint;
+		for (step = 1; hint - step >= 0; step *= 2) {
+			if (a[hint - step] < eid) {
+				from = hint - step + 1;
+				break;
+			}
+			to = hint - step;
+		}
 	}
-	lua_pop(L, 1);
-	return r;
+	while (from < to) {
+		int mid = (from + to)/2;
+		if (a[mid] < eid)
+			from = mid + 1;
+		else
+			to = mid;
+	}
+	return from;
 }
 
-static void
-update_iter(lua_State *L, int world_index, int lua_index, struct group_iter *iter, int idx, int mainkey, int skip) {
-	struct field *f = iter->f;
+// lower bound of eid in pool, use last_lookup as the cursor
+static inline int
+seek_component(struct component_pool *pool, unsigned int eid) {
+	int pos = gallop_search(pool->id, pool->n, pool->last_lookup, eid);
+	if (pos < pool->n)
+		pool->last_lookup = pos;
+	return pos;
+}
 
+static inline void
+replace_id(struct component_pool *c, int from, int to, unsigned int eid) {
 	int i;
-	for (i=0;i<skip;i++) {
-		f += iter->k[i].field_n;
+	for (i=from;i<to;i++) {
+		c->id[i] = eid;
 	}
-	for (i=skip;i<iter->nkey;i++) {
-		struct group_key *k = &iter->k[i];
-		if (!(k->attrib & COMPONENT_FILTER)) {
-			struct component_pool *c = &iter->world->c[k->id];
-			if (c->stride == STRIDE_TAG) {
-				// It's a tag
-				if ((k->attrib & COMPONENT_OUT)) {
-					switch (lua_getfield(L, lua_index, k->name)) {
-					case LUA_TNIL:
-						break;
-					case LUA_TBOOLEAN:
-						if (lua_toboolean(L, -1)) {
-							entity_enable_tag_(iter->world, mainkey, idx, k->id, L, world_index);
-						} else {
-							entity_disable_tag_(iter->world, mainkey, idx, k->id);
-						}
-						if (!(k->attrib & COMPONENT_IN)) {
-							// reset tag
-							lua_pushnil(L);
-							lua_setfield(L, lua_index, k->name);
-						}
-						break;
-					default:
-						luaL_error(L, ".%s is a tag , should be a boolean or nil. It's %s", k->name, lua_typename(L, lua_type(L, -1)));
-					}
-					lua_pop(L, 1);
-				}
-			} else if (c->stride == STRIDE_ORDER) {
-				assert(is_temporary(k->attrib));
-				if (lua_getfield(L, lua_index, k->name) != LUA_TNIL) {
-					if (!lua_isboolean(L, -1) || lua_toboolean(L, -1) == 0)
-						luaL_error(L, "Only support true for order key .%s", k->name);
-					lua_pop(L, 1);
-					entity_add_sibling_(iter->world, mainkey, idx, k->id, NULL, L, world_index);
-					lua_pushnil(L);
-					lua_setfield(L, lua_index, k->name);
-				}
-			} else if ((k->attrib & COMPONENT_OUT)
-				&& get_write_component(L, lua_index, k->name, f, c)) {
-				int index = entity_sibling_index_(iter->world, mainkey, idx, k->id);
-				if (index == 0) {
-					luaL_error(L, "Can't find sibling %s of %s", k->name, iter->k[0].name);
-				}
-				if (c->stride == STRIDE_LUA) {
-					if (lua_getiuservalue(L, world_index, k->id * 2 + 2) != LUA_TTABLE) {
-						luaL_error(L, "Missing lua table for %d", k->id);
-					}
-					lua_insert(L, -2);
-					lua_rawseti(L, -2, index);
-				} else {
-					void *buffer = get_ptr(c, index - 1);
-					write_component_object(L, k->field_n, f, buffer);
-				}
-			} else if (is_temporary(k->attrib)
-				&& get_write_component(L, lua_index, k->name, f, c)) {
-				if (c->stride == STRIDE_LUA) {
-					int index = entity_add_sibling_index_(L, world_index, iter->world, mainkey, idx, k->id);
-					if (lua_getiuservalue(L, world_index, k->id * 2 + 2) != LUA_TTABLE) {
-						luaL_error(L, "Missing lua table for %d", k->id);
-					}
-					lua_insert(L, -2);
-					lua_rawseti(L, -2, index + 1);
-				} else {
-					void *buffer = entity_add_sibling_(iter->world, mainkey, idx, k->id, NULL, L, world_index);
-					write_component_object(L, k->field_n, f, buffer);
-				}
+}
+
+static void
+entity_disable_tag_(struct entity_world *w, int cid, int index, int tag_id) {
+	assert(!w->in_parallel);
+	struct component_pool *c = &w->c[cid];
+	assert(index >=0 && index < c->n);
+	unsigned int eid = c->id[index];
+	if (w->c[tag_id].flags & POOL_BITSET) {
+		bitset_disable(&w->c[tag_id], eid);
+		return;
+	}
+	if (cid != tag_id) {
+		c = &w->c[tag_id];
+		index = lookup_component(c, eid, c->last_lookup);
+		if (index < 0)
+			return;
+	}
+	++c->version;
+	int from,to;
+	// find next tag. You may disable subsquent tags in iteration.
+	// For example, The sequence is 1 3 5 7 9 . We are now on 5 , and disable 7 .
+	// We should change 7 to 9 ( 1 3 5 9 9 ) rather than 7 to 5 ( 1 3 5 5 9 )
+	//                   iterator ->   ^                                ^
+	for (to = index+1; to<c->n; to++) {
+		if (c->id[to] != eid) {
+			for (from = index-1; from>=0; from--) {
+				if (c->id[from] != eid)
+					break;
 			}
+			replace_id(c, from+1, to, c->id[to]);
+			return;
 		}
-		f += k->field_n;
 	}
+	for (from = index-1; from>=0; from--) {
+		if (c->id[from] != eid)
+			break;
+	}
+	c->n = from + 1;
 }
 
 static void
-update_last_index(lua_State *L, int world_index, int lua_index, struct group_iter *iter, int idx) {
-	int mainkey = iter->k[0].id;
-	struct component_pool *c = &iter->world->c[mainkey];
-	int disable_mainkey = 0;
-	if (!(iter->k[0].attrib & COMPONENT_FILTER)) {
-		if (c->stride == STRIDE_TAG) {
-			// The mainkey is a tag, delay disable
-			disable_mainkey = ((iter->k[0].attrib & COMPONENT_OUT) && remove_tag(L, lua_index, iter->k[0].name));
-		} else if ((iter->k[0].attrib & COMPONENT_OUT)
-			&& get_write_component(L, lua_index, iter->k[0].name, iter->f, c)) {
-			struct component_pool *c = &iter->world->c[mainkey];
-			if (c->n <= idx) {
-				luaL_error(L, "Can't find component %s for index %d", iter->k[0].name, idx);
-			}
-			if (c->stride == STRIDE_LUA) {
-				if (lua_getiuservalue(L, world_index, mainkey * 2 + 2) != LUA_TTABLE) {
-					luaL_error(L, "Missing lua table for %d", mainkey);
-				}
-				lua_insert(L, -2);
-				lua_rawseti(L, -2, idx+1);
-			} else {
-				void * buffer = get_ptr(c, idx);
-				write_component_object(L, iter->k[0].field_n, iter->f, buffer);
-			}
+entity_remove_(struct entity_world *w, int cid, int index, void *L, int world_index) {
+	entity_enable_tag_(w, cid, index, ENTITY_REMOVED, L, world_index);
+}
+
+// The handles of removed entities are stale.
+static void
+handle_release(struct entity_world *w, struct component_pool *removed) {
+	struct component_pool *c = &w->c[w->handle_cid];
+	unsigned int last_id = 0;
+	int pos = 0;
+	int i;
+	for (i=0;i<removed->n;i++) {
+		unsigned int eid = removed->id[i];
+		if (eid == last_id)
+			continue;
+		last_id = eid;
+		pos = gallop_search(c->id, c->n, pos, eid);
+		if (pos >= c->n)
+			break;
+		if (c->id[pos] == eid) {
+			int slot = *(int *)get_ptr(c, pos);
+			assert(slot >= 0 && slot < w->slot_n && w->slot[slot].eid == eid);
+			handle_slot_free(w, slot);
 		}
 	}
+}
 
-	update_iter(L, world_index, lua_index, iter, idx, mainkey, 1);
+static uint64_t
+entity_handle_(struct entity_world *w, int cid, int index) {
+	struct component_pool *c = &w->c[cid];
+	if (w->handle_cid == 0 || index < 0 || index >= c->n)
+		return 0;
+	struct component_pool *hc = &w->c[w->handle_cid];
+	int pos = lookup_component(hc, c->id[index], hc->last_lookup);
+	if (pos < 0)
+		return 0;
+	if (!w->in_parallel)
+		hc->last_lookup = pos;
+	int slot = *(int *)get_ptr(hc, pos);
+	return (uint64_t)w->slot[slot].gen << 32 | (unsigned int)slot;
+}
 
-	if (disable_mainkey) {
-		entity_disable_tag_(iter->world, mainkey, idx, mainkey);
+// Returns the index of the entity in pool cid, or -1 if the handle is stale or the entity has no cid
+static int
+entity_handle_index_(struct entity_world *w, uint64_t handle, int cid) {
+	unsigned int slot = (unsigned int)handle;
+	unsigned int gen = (unsigned int)(handle >> 32);
+	if (slot >= (unsigned int)w->slot_n)
+		return -1;
+	struct handle_slot *s = &w->slot[slot];
+	if (s->gen != gen || s->eid == 0)
+		return -1;
+	struct component_pool *c = &w->c[cid];
+	if (c->flags & POOL_BITSET) {
+		if (!bitset_test(c, s->eid))
+			return -1;
+		bitset_materialize(c);
+		return binary_search(c->id, 0, c->n, s->eid);
 	}
+	int index = lookup_component(c, s->eid, c->last_lookup);
+	if (index >= 0 && !w->in_parallel)
+		c->last_lookup = index;
+	return index;
+}
+
+struct rearrange_source {
+	unsigned int *id;
+	int pos;
+	int n;
+};
+
+struct rearrange_context {
+	int n;
+	int heap[MAX_COMPONENT];	// min heap of the sources by id[pos]
+	struct rearrange_source src[MAX_COMPONENT];
+};
+
+static inline unsigned int
+heap_id(struct rearrange_context *ctx, int h) {
+	struct rearrange_source *s = &ctx->src[ctx->heap[h]];
+	return s->id[s->pos];
 }
 
 static void
-read_component_in_field(lua_State *L, int lua_index, const char *name, int n, struct field *f, void *buffer) {
-	if (n == 0) {
-		// It's tag
-		lua_pushboolean(L, buffer ? 1 : 0);
-		lua_setfield(L, lua_index, name);
-		return;
-	}
-	if (f->key == NULL) {
-		// value type
-		read_value(L, f, buffer);
-		lua_setfield(L, lua_index, name);
-		return;
+heap_down(struct rearrange_context *ctx, int h) {
+	int n = ctx->n;
+	for (;;) {
+		int child = h * 2 + 1;
+		if (child >= n)
+			break;
+		if (child + 1 < n && heap_id(ctx, child + 1) < heap_id(ctx, child))
+			++child;
+		if (heap_id(ctx, h) <= heap_id(ctx, child))
+			break;
+		int tmp = ctx->heap[h];
+		ctx->heap[h] = ctx->heap[child];
+		ctx->heap[child] = tmp;
+		h = child;
 	}
-	if (lua_getfield(L, lua_index, name) != LUA_TTABLE) {
-		lua_pop(L, 1);
-		lua_newtable(L);
-		lua_pushvalue(L, -1);
-		lua_setfield(L, lua_index, name);
+}
+
+static inline void
+heap_add(struct rearrange_context *ctx, int i, unsigned int *id, int n) {
+	struct rearrange_source *s = &ctx->src[i];
+	s->id = id;
+	s->pos = 0;
+	s->n = n;
+	ctx->heap[ctx->n++] = i;
+}
+
+// pop the smallest id from all the sources
+static unsigned int
+heap_next(struct rearrange_context *ctx) {
+	unsigned int eid = heap_id(ctx, 0);
+	while (ctx->n > 0 && heap_id(ctx, 0) == eid) {
+		struct rearrange_source *s = &ctx->src[ctx->heap[0]];
+		if (++s->pos >= s->n) {
+			ctx->heap[0] = ctx->heap[--ctx->n];
+		}
+		heap_down(ctx, 0);
 	}
-	read_component(L, n , f, lua_gettop(L), buffer);
-	lua_pop(L, 1);
+	return eid;
 }
 
-// -1 : end ; 0 : next ; 1 : succ
 static int
-query_index(struct group_iter *iter, int skip, int mainkey, int idx, unsigned int index[MAX_COMPONENT]) {
-	if (entity_iter_(iter->world, mainkey, idx) == NULL) {
-		return -1;
+compar_id(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+	return x < y ? -1 : (x > y);
+}
+
+// Renumber at most budget entities from w->rearrange_from, budget 0 means all.
+// The new ids are dense and keep the order, so the pools are still sorted during the pass.
+// Returns 1 when the pass is finished.
+static int
+rearrange_slice(lua_State *L, struct entity_world *w, int budget) {
+	unsigned int from = w->rearrange_from;
+	struct rearrange_context ctx;
+	ctx.n = 0;
+	int i, j;
+	int total = 0;
+	int order_n = 0;
+	for (i=0;i<MAX_COMPONENT;i++) {
+		struct component_pool *pool = &w->c[i];
+		if (pool->flags & POOL_BITSET)
+			bitset_materialize(pool);
+		if (pool->n == 0)
+			continue;
+		if (pool->stride == STRIDE_ORDER) {
+			order_n += pool->n;
+		} else {
+			int pos = gallop_search(pool->id, pool->n, 0, from);
+			if (pos < pool->n) {
+				heap_add(&ctx, i, pool->id + pos, pool->n - pos);
+				total += pool->n - pos;
+			}
+		}
 	}
-	int j;
-	for (j=skip;j<iter->nkey;j++) {
-		struct group_key *k = &iter->k[j];
-		if (k->attrib & COMPONENT_ABSENT) {
-			if (entity_sibling_index_(iter->world, mainkey, idx, k->id)) {
-				// exist. try next
-				return 0;
+	int top = lua_gettop(L);
+	if (order_n > 0) {
+		// the order pools are not sorted, merge the sorted copies of them
+		unsigned int *order = (unsigned int *)lua_newuserdatauv(L, order_n * sizeof(unsigned int), 0);
+		for (i=1;i<MAX_COMPONENT;i++) {
+			struct component_pool *pool = &w->c[i];
+			if (pool->stride != STRIDE_ORDER || pool->n == 0)
+				continue;
+			int n = 0;
+			for (j=0;j<pool->n;j++) {
+				if (pool->id[j] >= from)
+					order[n++] = pool->id[j];
 			}
-			index[j] = 0;
-		} else if (!is_temporary(k->attrib)) {
-			index[j] = entity_sibling_index_(iter->world, mainkey, idx, k->id);
-			if (index[j] == 0) {
-				if (!(k->attrib & COMPONENT_OPTIONAL)) {
-					// required. try next
-					return 0;
+			if (n > 0) {
+				qsort(order, n, sizeof(unsigned int), compar_id);
+				heap_add(&ctx, i, order, n);
+				total += n;
+				order += n;
+			}
+		}
+	}
+	if (budget <= 0 || budget > total)
+		budget = total;
+	unsigned int *old = (unsigned int *)lua_newuserdatauv(L, (budget > 0 ? budget : 1) * sizeof(unsigned int), 0);
+	for (i=ctx.n/2-1;i>=0;i--) {
+		heap_down(&ctx, i);
+	}
+	int k = 0;
+	while (k < budget && ctx.n > 0) {
+		old[k++] = heap_next(&ctx);
+	}
+	int finished = (ctx.n == 0);
+	if (k > 0) {
+		unsigned int base = w->rearrange_id;
+		unsigned int last = old[k-1];
+		for (i=0;i<MAX_COMPONENT;i++) {
+			struct component_pool *pool = &w->c[i];
+			if (pool->n == 0)
+				continue;
+			int touched = 0;
+			if (pool->stride == STRIDE_ORDER) {
+				for (j=0;j<pool->n;j++) {
+					unsigned int eid = pool->id[j];
+					if (eid >= from && eid <= last) {
+						int r = binary_search(old, 0, k, eid);
+						assert(r >= 0);
+						pool->id[j] = base + r;
+						mask_mark(w, i, base + r);
+						touched = 1;
+					}
+				}
+			} else {
+				int r = 0;
+				for (j=gallop_search(pool->id, pool->n, 0, from);j<pool->n && pool->id[j] <= last;j++) {
+					unsigned int eid = pool->id[j];
+					while (old[r] < eid)
+						++r;
+					assert(old[r] == eid);
+					unsigned int newid = base + r;
+					pool->id[j] = newid;
+					if (pool->flags & POOL_BITSET) {
+						pool->bits[eid / 64] &= ~((uint64_t)1 << (eid % 64));
+						pool->bits[newid / 64] |= (uint64_t)1 << (newid % 64);
+					}
+					if (pool->flags & POOL_SPARSE)
+						sparse_index_set(L, w, pool, newid, j);
+					if (w->handle_cid && i == w->handle_cid)
+						w->slot[*(int *)get_ptr(pool, j)].eid = newid;
+					mask_mark(w, i, newid);
+					touched = 1;
 				}
 			}
-		} else {
-			index[j] = 0;
+			if (touched)
+				++pool->version;
 		}
+		// count the new ids before releasing the old ones, they may share pages
+		mask_live(w, base, base + k);
+		for (j=0;j<k;j++) {
+			mask_kill(w, old[j]);
+		}
+		w->rearrange_id = base + k;
+		w->rearrange_from = last + 1;
+	}
+	lua_settop(L, top);
+	if (finished) {
+		w->max_id = w->rearrange_id - 1;
+		if (w->rearrange_holes) {
+			// fill the holes with another pass
+			w->rearrange_holes = 0;
+			w->rearrange_from = 1;
+			w->rearrange_id = 1;
+			return 0;
+		}
+		w->rearrange_from = 0;
+	}
+	return finished;
+}
+
+static inline void
+rearrange_begin(struct entity_world *w) {
+	if (w->rearrange_from == 0) {
+		w->rearrange_from = 1;
+		w->rearrange_id = 1;
+		w->rearrange_holes = 0;
 	}
-	return 1;
 }
 
+// move n components from [from] to [to], the ranges may overlap
 static void
-check_index(lua_State *L, struct group_iter *iter, int mainkey, int idx) {
+move_range(lua_State *L, struct component_pool *pool, int from, int to, int n) {
+	if (from == to || n <= 0)
+		return;
+	memmove(pool->id + to, pool->id + from, n * sizeof(unsigned int));
+	if (pool->stamp)
+		memmove(pool->stamp + to, pool->stamp + from, n * sizeof(unsigned int));
+	sparse_index_range(pool, to, to + n);
 	int i;
-	for (i=0;i<iter->nkey;i++) {
-		struct group_key *k = &iter->k[i];
-		if (k->attrib & COMPONENT_ABSENT) {
-			if (entity_sibling_index_(iter->world, mainkey, idx, k->id)) {
-				luaL_error(L, ".%s should be absent", k->name);
+	switch (pool->stride) {
+	case STRIDE_LUA:
+		// lua object table is on the top
+		if (to < from) {
+			for (i=0;i<n;i++) {
+				lua_rawgeti(L, -1, from+i+1);
+				lua_rawseti(L, -2, to+i+1);
 			}
-		} else if (!is_temporary(k->attrib)) {
-			if (entity_sibling_index_(iter->world, mainkey, idx, k->id) == 0) {
-				if (!(k->attrib & COMPONENT_OPTIONAL)) {
-					luaL_error(L, ".%s not found", k->name);
-				}
+		} else {
+			for (i=n-1;i>=0;i--) {
+				lua_rawgeti(L, -1, from+i+1);
+				lua_rawseti(L, -2, to+i+1);
+			}
+		}
+		break;
+	case STRIDE_TAG:
+	case STRIDE_ORDER:
+		break;
+	default:
+		if (pool->flags & POOL_SOA) {
+			for (i=0;i<pool->soa_n;i++) {
+				char *col = (char *)soa_column(pool, i);
+				size_t size = pool->soa[i].size;
+				memmove(col + size * to, col + size * from, size * n);
+			}
+		} else if (pool->flags & POOL_CHUNK) {
+			// split the range at the chunk boundaries
+			while (n > 0 && to < from) {
+				int seg = n;
+				int left = CHUNK_SIZE - (from & CHUNK_MASK);
+				if (left < seg)
+					seg = left;
+				left = CHUNK_SIZE - (to & CHUNK_MASK);
+				if (left < seg)
+					seg = left;
+				memmove(get_ptr(pool, to), get_ptr(pool, from), (size_t)pool->stride * seg);
+				from += seg;
+				to += seg;
+				n -= seg;
 			}
+			// move forward from the end
+			while (n > 0) {
+				int seg = n;
+				int left = ((from + n - 1) & CHUNK_MASK) + 1;
+				if (left < seg)
+					seg = left;
+				left = ((to + n - 1) & CHUNK_MASK) + 1;
+				if (left < seg)
+					seg = left;
+				n -= seg;
+				memmove(get_ptr(pool, to + n), get_ptr(pool, from + n), (size_t)pool->stride * seg);
+			}
+		} else {
+			char *buffer = (char *)pool->buffer;
+			size_t stride = pool->stride;
+			memmove(buffer + stride * to, buffer + stride * from, stride * n);
 		}
+		break;
 	}
 }
 
+// removed entities of an update
+struct removed_set {
+	struct component_pool *removed;
+	unsigned int min;
+	unsigned int max;
+	uint64_t *bits;	// eid - min, for the unsorted pools
+	int bits_n;
+};
+
 static void
-read_iter(lua_State *L, int world_index, int obj_index, struct group_iter *iter, unsigned int index[MAX_COMPONENT]) {
-	struct field *f = iter->f;
+removed_set_init(struct removed_set *rs, struct component_pool *removed) {
+	rs->removed = removed;
+	rs->min = removed->id[0];
+	rs->max = removed->id[removed->n - 1];
+	rs->bits = NULL;
+	rs->bits_n = 0;
+}
+
+// build the bitset of removed eids, if the range is not too sparse
+static void
+removed_set_bits(struct entity_world *w, struct removed_set *rs) {
+	if (rs->bits)
+		return;
+	size_t n = (size_t)(rs->max - rs->min) / 64 + 1;
+	if (n > (size_t)rs->removed->n * 4 + 1024)
+		return;
+	uint64_t *bits = (uint64_t *)world_realloc(w, NULL, 0, n * sizeof(uint64_t));
+	if (bits == NULL)
+		return;
+	memset(bits, 0, n * sizeof(uint64_t));
 	int i;
-	for (i=0;i<iter->nkey;i++) {
-		struct group_key *k = &iter->k[i];
-		if (!(k->attrib & COMPONENT_FILTER)) {
-			struct component_pool *c = &iter->world->c[k->id];
-			if (c->stride == STRIDE_LUA) {
-				// lua object component
-				if (index[i]) {
-					if (lua_getiuservalue(L, world_index, k->id * 2 + 2) != LUA_TTABLE) {
-						luaL_error(L, "Missing lua table for %d", k->id);
-					}
+	for (i=0;i<rs->removed->n;i++) {
+		unsigned int x = rs->removed->id[i] - rs->min;
+		bits[x / 64] |= (uint64_t)1 << (x % 64);
+	}
+	rs->bits = bits;
+	rs->bits_n = (int)n;
+}
 
-					lua_rawgeti(L, -1, index[i]);
-					lua_setfield(L, obj_index, k->name);
-					lua_pop(L, 1);
+static void
+removed_set_free(struct entity_world *w, struct removed_set *rs) {
+	world_free(w, rs->bits, rs->bits_n * sizeof(uint64_t));
+	rs->bits = NULL;
+	rs->bits_n = 0;
+}
+
+static inline int
+removed_set_has(struct removed_set *rs, unsigned int eid) {
+	if (eid < rs->min || eid > rs->max)
+		return 0;
+	if (rs->bits) {
+		unsigned int x = eid - rs->min;
+		return (rs->bits[x / 64] >> (x % 64)) & 1;
+	}
+	struct component_pool *removed = rs->removed;
+	return binary_search(removed->id, 0, removed->n, eid) >= 0;
+}
+
+// Mark and compact in one sweep, the surviving runs between removed components are moved at once.
+static void
+remove_all(lua_State *L, struct entity_world *w, struct component_pool *pool, struct removed_set *rs, int cid) {
+	int n = pool->n;
+	int to = -1;	// where to move the next surviving run, -1 before the first removed one
+	int from = 0;
+	int i;
+	if (pool->stride == STRIDE_LUA) {
+		if (lua_getiuservalue(L, 1, cid * 2 + 2) != LUA_TTABLE) {
+			luaL_error(L, "Missing lua object table for type %d", cid);
+		}
+	}
+	if (pool->stride != STRIDE_ORDER) {
+		// both pool->id and removed->id are sorted, merge them
+		struct component_pool *removed = rs->removed;
+		unsigned int last_id = 0;
+		int pos = 0;
+		for (i=0;i<removed->n;i++) {
+			unsigned int eid = removed->id[i];
+			if (eid == last_id)
+				continue;
+			last_id = eid;
+			pos = gallop_search(pool->id, n, pos, eid);
+			if (pos >= n)
+				break;
+			if (pool->id[pos] != eid)
+				continue;
+			// the tag pool may have duplicate ids
+			int next = pos + 1;
+			while (next < n && pool->id[next] == eid)
+				++next;
+			if (to < 0) {
+				to = pos;
+			} else {
+				move_range(L, pool, from, to, pos - from);
+				to += pos - from;
+			}
+			from = pos = next;
+		}
+	} else {
+		removed_set_bits(w, rs);
+		for (i=0;i<n;i++) {
+			if (removed_set_has(rs, pool->id[i])) {
+				if (to < 0) {
+					to = i;
 				} else {
-					lua_pushnil(L);
-					lua_setfield(L, obj_index, k->name);
+					move_range(L, pool, from, to, i - from);
+					to += i - from;
 				}
-			} else if (c->stride != STRIDE_ORDER) {
-				if (k->attrib & COMPONENT_IN) {
-					if (index[i]) {
-						void *ptr = get_ptr(c, index[i]-1);
-						read_component_in_field(L, obj_index, k->name, k->field_n, f, ptr);
-					} else {
-						lua_pushnil(L);
-						lua_setfield(L, obj_index, k->name);
-					}
-				} else if (index[i] == 0 && !is_temporary(k->attrib)) {
-					lua_pushnil(L);
-					lua_setfield(L, obj_index, k->name);
+				from = i + 1;
+			}
+		}
+	}
+	if (to >= 0) {
+		move_range(L, pool, from, to, n - from);
+		pool->n = to + n - from;
+		++pool->version;
+	}
+	if (pool->stride == STRIDE_LUA)
+		lua_pop(L, 1);	// pop lua object table
+}
+
+static void
+remove_from_pool(lua_State *L, struct entity_world *w, struct removed_set *rs, int cid) {
+	struct component_pool *pool = &w->c[cid];
+	if (pool->flags & POOL_BITSET)
+		bitset_materialize(pool);
+	if (pool->n > 0) {
+		unsigned int version = pool->version;
+		remove_all(L, w, pool, rs, cid);
+		if ((pool->flags & POOL_BITSET) && pool->version != version)
+			bitset_rebuild(pool);
+	}
+}
+
+// rebuild all the masks from the pools, after out of memory
+static void
+mask_rebuild(struct entity_world *w) {
+	mask_release(w);
+	w->mask_lost = 0;
+	int i, j;
+	for (i=1;i<MAX_COMPONENT && !w->mask_lost;i++) {
+		struct component_pool *pool = &w->c[i];
+		for (j=0;j<pool->n;j++) {
+			mask_mark(w, i, pool->id[j]);
+		}
+	}
+	// count every entity in the pages as alive, it's an upper bound.
+	for (i=0;i<w->mask_n;i++) {
+		struct mask_page *page = w->mask[i];
+		if (page) {
+			unsigned int from = (unsigned int)i << MASK_PAGE_SHIFT;
+			if (from <= w->max_id) {
+				unsigned int n = w->max_id - from + 1;
+				page->live = n < MASK_PAGE_SIZE ? n : MASK_PAGE_SIZE;
+			}
+		}
+	}
+}
+
+static void command_playback(lua_State *L, struct entity_world *w);
+
+static int
+lupdate(lua_State *L) {
+	struct entity_world *w = getW(L);
+	struct component_pool *removed = &w->c[ENTITY_REMOVED];
+	int i;
+	command_playback(L, w);
+	if (removed->n > 0) {
+		// mark removed
+		assert(ENTITY_REMOVED == 0);
+		if (removed->id[0] < w->rearrange_from)
+			w->rearrange_holes = 1;
+		if (w->handle_cid)
+			handle_release(w, removed);
+		uint64_t dirty[MASK_WORDS] = { 0 };
+		struct removed_set rs;
+		removed_set_init(&rs, removed);
+		if (mask_collect(w, removed, dirty)) {
+			for (i=0;i<MASK_WORDS;i++) {
+				uint64_t bits = dirty[i];
+				while (bits) {
+					int cid = i * 64 + ctz64(bits);
+					bits &= bits - 1;
+					if (cid != ENTITY_REMOVED)
+						remove_from_pool(L, w, &rs, cid);
 				}
 			}
+		} else {
+			for (i=1;i<MAX_COMPONENT;i++) {
+				remove_from_pool(L, w, &rs, i);
+			}
+			mask_rebuild(w);
+		}
+		removed_set_free(w, &rs);
+		removed->n = 0;
+		++removed->version;
+	}
+
+	if (w->rearrange_from == 0) {
+		if (w->max_id > REARRANGE_THRESHOLD || (w->rearrange_budget > 0 && w->max_id > REARRANGE_INCREMENTAL))
+			rearrange_begin(w);
+	}
+	if (w->rearrange_from) {
+		// finish the pass at once if the ids run out
+		int budget = w->max_id > REARRANGE_THRESHOLD ? 0 : w->rearrange_budget;
+		while (!rearrange_slice(L, w, budget) && budget == 0)
+			;
+	}
+
+	return 0;
+}
+
+static int
+lrearrange(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int budget = luaL_optinteger(L, 2, 0);
+	if (budget < 0)
+		return luaL_error(L, "Invalid budget %d", budget);
+	w->rearrange_budget = budget;
+	// the commands refer to current ids
+	command_playback(L, w);
+	rearrange_begin(w);
+	if (budget == 0) {
+		while (!rearrange_slice(L, w, 0))
+			;
+	}
+	return 0;
+}
+
+static int
+lhandle_type(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int cid = check_cid(L, w, 2);
+	if (w->c[cid].stride != sizeof(int) || w->c[cid].flags)
+		return luaL_error(L, "Handle type %d should be an int", cid);
+	if (w->max_id != 0)
+		return luaL_error(L, "Enable handles before creating entities");
+	w->handle_cid = cid;
+	return 0;
+}
+
+static int
+lhandle(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int cid = check_cid(L, w, 2);
+	int index = luaL_checkinteger(L, 3) - 1;
+	uint64_t handle = entity_handle_(w, cid, index);
+	if (handle == 0)
+		return 0;
+	lua_pushinteger(L, (lua_Integer)handle);
+	return 1;
+}
+
+static int
+lhandle_index(lua_State *L) {
+	struct entity_world *w = getW(L);
+	uint64_t handle = (uint64_t)luaL_checkinteger(L, 2);
+	int cid = check_cid(L, w, 3);
+	int index = entity_handle_index_(w, handle, cid);
+	if (index < 0)
+		return 0;
+	lua_pushinteger(L, index + 1);
+	return 1;
+}
+
+static void
+remove_dup(struct component_pool *c, int index) {
+	int i;
+	unsigned int eid = c->id[index];
+	int to = index;
+	for (i=index+1;i<c->n;i++) {
+		if (c->id[i] != eid) {
+			eid = c->id[i];
+			c->id[to] = eid;
+			sparse_index_move(c, to);
+			++to;
+		}
+	}
+	c->n = to;
+	++c->version;
+	// the entry of c->id[index-1] may point into the removed duplicates
+	sparse_index_range(c, index - 1, index);
+}
+
+static void *
+entity_iter_(struct entity_world *w, int cid, int index) {
+	struct component_pool *c = &w->c[cid];
+	assert(index >= 0);
+	if (c->flags & POOL_DIRTY) {
+		if (index == 0)
+			bitset_materialize(c);
+		else if (index < c->n && !bitset_test(c, c->id[index]))
+			bitset_compact(c, index);
+	}
+	if (index >= c->n)
+		return NULL;
+	if (c->flags & POOL_BITSET)
+		return DUMMY_PTR;
+	if (c->stride == STRIDE_TAG) {
+		// it's a tag
+		unsigned int eid = c->id[index];
+		if (index < c->n - 1 && eid == c->id[index+1] && !w->in_parallel) {
+			remove_dup(c, index+1);
+		}
+		return DUMMY_PTR;
+	}
+	return get_ptr(c, index);
+}
+
+static void *
+entity_iter_lua_(struct entity_world *w, int cid, int index, void *L, int world_index) {
+	assert(!w->in_parallel);
+	void * ret = entity_iter_(w, cid, index);
+	if (ret != DUMMY_PTR)
+		return ret;
+	if (lua_getiuservalue(L, world_index, cid * 2 + 2) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	int t = lua_rawgeti(L, -1, index+1);
+	switch(t) {
+	case LUA_TSTRING:
+		ret = (void *)lua_tostring(L, -1);
+		break;
+	case LUA_TUSERDATA:
+	case LUA_TLIGHTUSERDATA:
+		ret = (void *)lua_touserdata(L, -1);
+		break;
+	default:
+		ret = NULL;
+		break;
+	}
+	lua_pop(L, 2);
+	return ret;
+}
+
+static int
+entity_assign_lua_(struct entity_world *w, int cid, int index, void *L, int world_index) {
+	assert(!w->in_parallel);
+	struct component_pool *c = &w->c[cid];
+	++index;
+	assert(lua_gettop(L) > 1);
+	if (c->stride != STRIDE_LUA || index <=0 || index > c->n) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	if (lua_getiuservalue(L, world_index, cid * 2 + 2) != LUA_TTABLE) {
+		lua_pop(L, 2);
+		return 0;
+	}
+	lua_insert(L, -2);
+	// table value
+	lua_rawseti(L, -2, index);
+	lua_pop(L, 1);
+	return 1;
+}
+
+static void
+entity_clear_type_(struct entity_world *w, int cid) {
+	assert(!w->in_parallel);
+	struct component_pool *c = &w->c[cid];
+	c->n = 0;
+	++c->version;
+	if (c->bits) {
+		memset(c->bits, 0, c->bits_n * sizeof(uint64_t));
+		c->bits_count = 0;
+		c->flags &= ~POOL_DIRTY;
+	}
+}
+
+static int
+lclear_type(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int cid = check_cid(L,w, 2);
+	entity_clear_type_(w, cid);
+	return 0;
+}
+
+static int
+entity_sibling_index_(struct entity_world *w, int cid, int index, int silbling_id) {
+	struct component_pool *c = &w->c[cid];
+	if (index < 0 || index >= c->n)
+		return 0;
+	unsigned int eid = c->id[index];
+	c = &w->c[silbling_id];
+	assert(c->stride != STRIDE_ORDER);
+	if (c->flags & POOL_BITSET)
+		return bitset_test(c, eid);
+	int result_index = lookup_component(c, eid, c->last_lookup);
+	if (result_index >= 0) {
+		if (!w->in_parallel)
+			c->last_lookup = result_index;
+		return result_index + 1;
+	}
+	return 0;
+}
+
+static void *
+entity_add_sibling_(struct entity_world *w, int cid, int index, int silbling_id, const void *buffer, void *L, int world_index) {
+	assert(!w->in_parallel);
+	struct component_pool *c = &w->c[cid];
+	assert(index >=0 && index < c->n);
+	unsigned int eid = c->id[index];
+	// todo: pcall add_component_
+	return add_component_((lua_State *)L, world_index, w, silbling_id, eid, buffer);
+}
+
+static int
+entity_new_(struct entity_world *w, int cid, const void *buffer, void *L, int world_index) {
+	assert(!w->in_parallel);
+	unsigned int eid = new_entity((lua_State *)L, world_index, w, 1);
+	assert(eid != 0);
+	struct component_pool *c = &w->c[cid];
+	assert(c->cap > 0);
+	if (buffer == NULL) {
+		return add_component_id_(L, world_index, w, cid, eid);
+	} else {
+		assert(c->stride >= 0);
+		int index = add_component_id_(L, world_index, w, cid, eid);
+		write_row(c, index, buffer);
+		return index;
+	}
+}
+
+static void
+entity_changed_(struct entity_world *w, int cid, int index) {
+	struct component_pool *c = &w->c[cid];
+	assert(index >= 0 && index < c->n);
+	stamp_row(w, c, index);
+}
+
+static int
+entity_add_sibling_index_(lua_State *L, int world_index, struct entity_world *w, int cid, int index, int slibling_id) {
+	struct component_pool *c = &w->c[cid];
+	assert(index >=0 && index < c->n);
+	unsigned int eid = c->id[index];
+	// todo: pcall add_component_
+	int ret = add_component_id_(L, world_index, w, slibling_id, eid);
+	return ret;
+}
+
+// Set operations over sorted unique id arrays
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+
+#define SET_SIMD
+#include <immintrin.h>
+
+#endif
+
+static inline int
+set_emit(const unsigned int *a, int n, unsigned int mask, int diff, unsigned int *out, int count) {
+	int i;
+	for (i=0;i<n;i++) {
+		if ((int)(mask >> i & 1) != diff) {
+			if (out)
+				out[count] = a[i];
+			++count;
+		}
+	}
+	return count;
+}
+
+// intersect (diff = 0) or difference (diff = 1) of a and b.
+// The first elements of a marked in mask are already found in b.
+static int
+set_merge_tail(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out, int count, unsigned int mask, int diff) {
+	int i;
+	int j = 0;
+	for (i=0;i<na;i++) {
+		unsigned int v = a[i];
+		int found = (i < 32 && (mask >> i & 1));
+		if (!found) {
+			while (j < nb && b[j] < v)
+				++j;
+			found = (j < nb && b[j] == v);
+		}
+		if (found != diff) {
+			if (out)
+				out[count] = v;
+			++count;
+		} else if (j >= nb && !diff && i >= 32) {
+			// nothing more to intersect
+			break;
+		}
+	}
+	return count;
+}
+
+static int
+set_merge_scalar(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out, int diff) {
+	return set_merge_tail(a, na, b, nb, out, 0, 0, diff);
+}
+
+#ifdef SET_SIMD
+
+static int
+set_merge_sse2(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out, int diff) {
+	int i = 0, j = 0;
+	int count = 0;
+	unsigned int mask = 0;
+	while (i + 4 <= na && j + 4 <= nb) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+		__m128i m0 = _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+			_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0,3,2,1))));
+		__m128i m1 = _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1,0,3,2))),
+			_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2,1,0,3))));
+		mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(m0, m1)));
+		unsigned int amax = a[i+3];
+		unsigned int bmax = b[j+3];
+		if (amax <= bmax) {
+			count = set_emit(a + i, 4, mask, diff, out, count);
+			mask = 0;
+			i += 4;
+		}
+		if (bmax <= amax)
+			j += 4;
+	}
+	return set_merge_tail(a + i, na - i, b + j, nb - j, out, count, mask, diff);
+}
+
+__attribute__((target("avx2")))
+static int
+set_merge_avx2(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out, int diff) {
+	int i = 0, j = 0;
+	int count = 0;
+	unsigned int mask = 0;
+	const __m256i rot = _mm256_set_epi32(0,7,6,5,4,3,2,1);
+	while (i + 8 <= na && j + 8 <= nb) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + j));
+		__m256i m = _mm256_cmpeq_epi32(va, vb);
+		int k;
+		for (k=1;k<8;k++) {
+			vb = _mm256_permutevar8x32_epi32(vb, rot);
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi32(va, vb));
+		}
+		mask |= _mm256_movemask_ps(_mm256_castsi256_ps(m));
+		unsigned int amax = a[i+7];
+		unsigned int bmax = b[j+7];
+		if (amax <= bmax) {
+			count = set_emit(a + i, 8, mask, diff, out, count);
+			mask = 0;
+			i += 8;
+		}
+		if (bmax <= amax)
+			j += 8;
+	}
+	return set_merge_tail(a + i, na - i, b + j, nb - j, out, count, mask, diff);
+}
+
+#endif
+
+typedef int (*set_merge_func)(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out, int diff);
+
+static set_merge_func
+set_merge_select() {
+#ifdef SET_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return set_merge_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return set_merge_sse2;
+#endif
+	return set_merge_scalar;
+}
+
+static int
+set_union(const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out) {
+	int i = 0, j = 0;
+	int count = 0;
+	while (i < na && j < nb) {
+		unsigned int v;
+		if (a[i] < b[j]) {
+			v = a[i++];
+		} else if (a[i] > b[j]) {
+			v = b[j++];
+		} else {
+			v = a[i++];
+			++j;
+		}
+		if (out)
+			out[count] = v;
+		++count;
+	}
+	if (out) {
+		if (i < na)
+			memcpy(out + count, a + i, (na - i) * sizeof(unsigned int));
+		if (j < nb)
+			memcpy(out + count + na - i, b + j, (nb - j) * sizeof(unsigned int));
+	}
+	return count + (na - i) + (nb - j);
+}
+
+// out can be NULL, returns the size of result. out should be large enough (na + nb for union).
+static int
+entity_set_op_(int op, const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out) {
+	static set_merge_func merge = NULL;
+	if (merge == NULL)
+		merge = set_merge_select();
+	switch (op) {
+	case ECS_SET_INTERSECT:
+		if (na > nb)
+			return merge(b, nb, a, na, out, 0);
+		return merge(a, na, b, nb, out, 0);
+	case ECS_SET_UNION:
+		return set_union(a, na, b, nb, out);
+	case ECS_SET_DIFFERENCE:
+		return merge(a, na, b, nb, out, 1);
+	default:
+		return -1;
+	}
+}
+
+// Column of field in soa pool, n is the number of components
+static void *
+entity_column_(struct entity_world *w, int cid, int field, int *n) {
+	struct component_pool *c = &w->c[cid];
+	*n = 0;
+	if (!(c->flags & POOL_SOA) || field < 0 || field >= c->soa_n || c->n == 0)
+		return NULL;
+	*n = c->n;
+	return soa_column(c, field);
+}
+
+// Sorted unique ids of a pool, order key is not supported
+static const unsigned int *
+entity_ids_(struct entity_world *w, int cid, int *n) {
+	struct component_pool *c = &w->c[cid];
+	if (c->stride == STRIDE_ORDER) {
+		*n = 0;
+		return NULL;
+	}
+	if (c->flags & POOL_BITSET) {
+		// parallel_settle has done it before the parallel region
+		assert(!w->in_parallel || !(c->flags & POOL_DIRTY));
+		bitset_materialize(c);
+	} else if (c->stride == STRIDE_TAG) {
+		int i;
+		for (i=1;i<c->n;i++) {
+			if (c->id[i] == c->id[i-1]) {
+				assert(!w->in_parallel);
+				remove_dup(c, i);
+				break;
+			}
+		}
+	}
+	*n = c->n;
+	return c->id;
+}
+
+// The eid at index, it never settles the pool, so it's cheap in parallel_for.
+static unsigned int
+entity_eid_(struct entity_world *w, int cid, int index) {
+	struct component_pool *c = &w->c[cid];
+	assert(c->stride != STRIDE_ORDER);
+	assert(index >= 0 && index < c->n);
+	return c->id[index];
+}
+
+static int
+lset_op(lua_State *L) {
+	struct entity_world *w = getW(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int output = lua_toboolean(L, 3);
+	int n = lua_rawlen(L, 2);
+	if (n % 2 == 0)
+		return luaL_error(L, "Invalid set expression");
+	int i;
+	int total = 0;
+	for (i=1;i<=n;i+=2) {
+		lua_rawgeti(L, 2, i);
+		int cid = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (cid < 0 || cid >= MAX_COMPONENT)
+			return luaL_error(L, "Invalid type %d", cid);
+		if (w->c[cid].stride == STRIDE_ORDER)
+			return luaL_error(L, "Order key %d is not a set", cid);
+		int nb;
+		entity_ids_(w, cid, &nb);
+		total += nb;
+	}
+	lua_rawgeti(L, 2, 1);
+	int na;
+	const unsigned int *a = entity_ids_(w, lua_tointeger(L, -1), &na);
+	lua_pop(L, 1);
+	unsigned int *buffer[2] = { NULL, NULL };
+	if (n > 1) {
+		buffer[0] = (unsigned int *)lua_newuserdatauv(L, total * sizeof(unsigned int), 0);
+		buffer[1] = (unsigned int *)lua_newuserdatauv(L, total * sizeof(unsigned int), 0);
+	}
+	for (i=2;i<n;i+=2) {
+		lua_rawgeti(L, 2, i);
+		lua_rawgeti(L, 2, i+1);
+		int op = lua_tointeger(L, -2);
+		int cid = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+		int nb;
+		const unsigned int *b = entity_ids_(w, cid, &nb);
+		unsigned int *out = buffer[i/2 % 2];
+		if (i + 1 == n && !output)
+			out = NULL;
+		na = entity_set_op_(op, a, na, b, nb, out);
+		if (na < 0)
+			return luaL_error(L, "Invalid set operator %d", op);
+		a = out;
+	}
+	if (!output) {
+		lua_pushinteger(L, na);
+		return 1;
+	}
+	lua_createtable(L, na, 0);
+	for (i=0;i<na;i++) {
+		lua_pushinteger(L, a[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
+// Thread pool of entity_parallel_for. The chunks of a pool are split into one range per thread,
+// each thread takes chunks from the front of its range, and steals the back half of another range when it runs out.
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+typedef HANDLE parallel_thread;
+typedef CRITICAL_SECTION parallel_mutex;
+typedef CONDITION_VARIABLE parallel_cond;
+
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c) ((void)(c))
+#define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+
+static int
+cpu_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+#else
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t parallel_thread;
+typedef pthread_mutex_t parallel_mutex;
+typedef pthread_cond_t parallel_cond;
+
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+
+static int
+cpu_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+#endif
+
+// A range of chunks is (begin << 32 | end)
+
+#if defined(_MSC_VER)
+
+static inline uint64_t
+range_load(uint64_t *r) {
+	return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)r, 0, 0);
+}
+
+static inline void
+range_store(uint64_t *r, uint64_t v) {
+	InterlockedExchange64((volatile LONG64 *)r, (LONG64)v);
+}
+
+static inline int
+range_cas(uint64_t *r, uint64_t expect, uint64_t v) {
+	return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)r, (LONG64)v, (LONG64)expect) == expect;
+}
+
+#else
+
+static inline uint64_t
+range_load(uint64_t *r) {
+	return __atomic_load_n(r, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+range_store(uint64_t *r, uint64_t v) {
+	__atomic_store_n(r, v, __ATOMIC_RELEASE);
+}
+
+static inline int
+range_cas(uint64_t *r, uint64_t expect, uint64_t v) {
+	return __atomic_compare_exchange_n(r, &expect, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+#endif
+
+struct parallel_job {
+	ecs_parallel_func fn;
+	struct ecs_context *ctx;
+	void *ud;
+	int n;
+	int grain;
+	struct {
+		uint64_t range;
+		char padding[56];	// one cache line for each thread
+	} slot[PARALLEL_MAXTHREAD];
+};
+
+struct parallel_worker {
+	struct ecs_parallel *pool;
+	int id;
+	parallel_thread thread;
+};
+
+struct ecs_parallel {
+	int n;	// threads, including the caller of parallel_for
+	int quit;
+	unsigned int gen;	// increased for each job
+	int active;	// workers running the job
+	struct parallel_job *job;
+	parallel_mutex lock;
+	parallel_cond start;
+	parallel_cond done;
+	struct parallel_worker worker[PARALLEL_MAXTHREAD];
+};
+
+static int
+range_pop(uint64_t *r) {
+	uint64_t v = range_load(r);
+	for (;;) {
+		unsigned int begin = (unsigned int)(v >> 32);
+		unsigned int end = (unsigned int)v;
+		if (begin >= end)
+			return -1;
+		if (range_cas(r, v, (uint64_t)(begin + 1) << 32 | end))
+			return (int)begin;
+		v = range_load(r);
+	}
+}
+
+static int
+range_steal(struct parallel_job *job, int self, int n) {
+	int i;
+	for (i=1;i<n;i++) {
+		uint64_t *r = &job->slot[(self + i) % n].range;
+		uint64_t v = range_load(r);
+		for (;;) {
+			unsigned int begin = (unsigned int)(v >> 32);
+			unsigned int end = (unsigned int)v;
+			if (begin >= end)
+				break;
+			unsigned int mid = begin + (end - begin) / 2;
+			if (range_cas(r, v, (uint64_t)begin << 32 | mid)) {
+				range_store(&job->slot[self].range, (uint64_t)mid << 32 | end);
+				return 1;
+			}
+			v = range_load(r);
+		}
+	}
+	return 0;
+}
+
+static void
+parallel_run(struct parallel_job *job, int self, int n) {
+	do {
+		int chunk;
+		while ((chunk = range_pop(&job->slot[self].range)) >= 0) {
+			int from = chunk * job->grain;
+			int to = from + job->grain;
+			if (to > job->n)
+				to = job->n;
+			job->fn(job->ctx, from, to, self, job->ud);
+		}
+	} while (range_steal(job, self, n));
+}
+
+static void
+parallel_worker_main(struct parallel_worker *wk) {
+	struct ecs_parallel *p = wk->pool;
+	unsigned int gen = 0;
+	mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->quit && p->gen == gen)
+			cond_wait(&p->start, &p->lock);
+		if (p->quit)
+			break;
+		gen = p->gen;
+		struct parallel_job *job = p->job;
+		mutex_unlock(&p->lock);
+		parallel_run(job, wk->id, p->n);
+		mutex_lock(&p->lock);
+		if (--p->active == 0)
+			cond_broadcast(&p->done);
+	}
+	mutex_unlock(&p->lock);
+}
+
+#if defined(_WIN32)
+
+static DWORD WINAPI
+parallel_thread_main(LPVOID ud) {
+	parallel_worker_main((struct parallel_worker *)ud);
+	return 0;
+}
+
+static int
+thread_create(parallel_thread *t, struct parallel_worker *wk) {
+	*t = CreateThread(NULL, 0, parallel_thread_main, wk, 0, NULL);
+	return *t != NULL;
+}
+
+static void
+thread_join(parallel_thread t) {
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+#else
+
+static void *
+parallel_thread_main(void *ud) {
+	parallel_worker_main((struct parallel_worker *)ud);
+	return NULL;
+}
+
+static int
+thread_create(parallel_thread *t, struct parallel_worker *wk) {
+	return pthread_create(t, NULL, parallel_thread_main, wk) == 0;
+}
+
+static void
+thread_join(parallel_thread t) {
+	pthread_join(t, NULL);
+}
+
+#endif
+
+static struct ecs_parallel *
+parallel_pool(struct entity_world *w) {
+	if (w->parallel)
+		return w->parallel;
+	int n = cpu_count();
+	if (n > PARALLEL_MAXTHREAD)
+		n = PARALLEL_MAXTHREAD;
+	if (n <= 1)
+		return NULL;
+	struct ecs_parallel *p = (struct ecs_parallel *)world_realloc(w, NULL, 0, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	memset(p, 0, sizeof(*p));
+	mutex_init(&p->lock);
+	cond_init(&p->start);
+	cond_init(&p->done);
+	int i;
+	p->n = 1;
+	for (i=1;i<n;i++) {
+		struct parallel_worker *wk = &p->worker[i];
+		wk->pool = p;
+		wk->id = i;
+		if (!thread_create(&wk->thread, wk))
+			break;
+		p->n = i + 1;
+	}
+	w->parallel = p;
+	return p;
+}
+
+static void
+parallel_release(struct entity_world *w) {
+	struct ecs_parallel *p = w->parallel;
+	if (p == NULL)
+		return;
+	mutex_lock(&p->lock);
+	p->quit = 1;
+	cond_broadcast(&p->start);
+	mutex_unlock(&p->lock);
+	int i;
+	for (i=1;i<p->n;i++) {
+		thread_join(p->worker[i].thread);
+	}
+	mutex_destroy(&p->lock);
+	cond_destroy(&p->start);
+	cond_destroy(&p->done);
+	world_free(w, p, sizeof(*p));
+	w->parallel = NULL;
+}
+
+static int
+entity_parallel_threads_(struct entity_world *w) {
+	struct ecs_parallel *p = parallel_pool(w);
+	return p ? p->n : 1;
+}
+
+// Leave nothing lazy for the readers, so iter and sibling don't change the pools during parallel_for.
+static void
+parallel_settle(struct entity_world *w) {
+	int i;
+	for (i=0;i<MAX_COMPONENT;i++) {
+		if (w->c[i].flags & POOL_DIRTY)
+			bitset_materialize(&w->c[i]);
+	}
+}
+
+static void
+tag_settle(struct component_pool *c) {
+	if (c->stride != STRIDE_TAG)
+		return;
+	int i;
+	for (i=1;i<c->n;i++) {
+		if (c->id[i] == c->id[i-1]) {
+			remove_dup(c, i);
+			return;
+		}
+	}
+}
+
+// Runs fn on [0, n) in chunks of grain, the pools should be settled.
+static void
+parallel_dispatch(struct entity_world *w, int n, int grain, ecs_parallel_func fn, struct ecs_context *ctx, void *ud) {
+	int nchunk = (n - 1) / grain + 1;
+	struct ecs_parallel *p = nchunk > 1 ? parallel_pool(w) : NULL;
+	w->in_parallel = 1;
+	if (p == NULL) {
+		fn(ctx, 0, n, 0, ud);
+	} else {
+		struct parallel_job job;
+		job.fn = fn;
+		job.ctx = ctx;
+		job.ud = ud;
+		job.n = n;
+		job.grain = grain;
+		int i;
+		for (i=0;i<p->n;i++) {
+			uint64_t begin = (uint64_t)nchunk * i / p->n;
+			uint64_t end = (uint64_t)nchunk * (i + 1) / p->n;
+			job.slot[i].range = begin << 32 | end;
+		}
+		mutex_lock(&p->lock);
+		p->job = &job;
+		p->active = p->n - 1;
+		++p->gen;
+		cond_broadcast(&p->start);
+		mutex_unlock(&p->lock);
+		parallel_run(&job, 0, p->n);
+		mutex_lock(&p->lock);
+		while (p->active > 0)
+			cond_wait(&p->done, &p->lock);
+		p->job = NULL;
+		mutex_unlock(&p->lock);
+	}
+	w->in_parallel = 0;
+	// fn may stamp any tracked pool, see stamp_row
+	int i;
+	for (i=0;i<MAX_COMPONENT;i++) {
+		struct component_pool *c = &w->c[i];
+		if (c->flags & POOL_STAMP)
+			c->stamp_max = w->change_version;
+	}
+}
+
+static int
+entity_parallel_for_(struct entity_world *w, int cid, ecs_parallel_func fn, struct ecs_context *ctx, void *ud, int grain) {
+	assert(!w->in_parallel);
+	if (w->in_parallel)
+		return -1;
+	parallel_settle(w);
+	tag_settle(&w->c[cid]);
+	int n = w->c[cid].n;
+	if (n == 0)
+		return 0;
+	if (grain <= 0)
+		grain = 1;
+	parallel_dispatch(w, n, grain, fn, ctx, ud);
+	return 0;
+}
+
+struct system_call {
+	struct ecs_system *sys;
+	struct ecs_context *ctx;
+};
+
+static void
+system_run(struct ecs_context *ctx, int from, int to, int thread, void *ud) {
+	struct system_call *s = (struct system_call *)ud;
+	int i;
+	for (i=from;i<to;i++) {
+		s[i].sys->func(s[i].ctx, thread, s[i].sys->ud);
+	}
+}
+
+// world, { system1, context1, system2, context2, ... }
+// Runs a wave of C systems in the thread pool, the scheduler in ecs.lua makes sure they don't conflict.
+static int
+lsystems(lua_State *L) {
+	struct entity_world *w = getW(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (w->in_parallel)
+		return luaL_error(L, "Can't run systems in parallel region");
+	int n = lua_rawlen(L, 2) / 2;
+	if (n == 0)
+		return 0;
+	struct system_call *s = (struct system_call *)lua_newuserdatauv(L, n * sizeof(*s), 0);
+	parallel_settle(w);
+	int i, j;
+	for (i=0;i<n;i++) {
+		if (lua_rawgeti(L, 2, i * 2 + 1) != LUA_TLIGHTUSERDATA)
+			return luaL_error(L, "Invalid system at %d", i + 1);
+		s[i].sys = (struct ecs_system *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (lua_rawgeti(L, 2, i * 2 + 2) != LUA_TUSERDATA)
+			return luaL_error(L, "Invalid context at %d", i + 1);
+		struct ecs_context *ctx = (struct ecs_context *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (ctx->world != w)
+			return luaL_error(L, "Context of system %d is not for this world", i + 1);
+		s[i].ctx = ctx;
+		for (j=1;j<=ctx->max_id;j++) {
+			tag_settle(&w->c[ctx->cid[j]]);
+		}
+	}
+	parallel_dispatch(w, n, 1, system_run, NULL, s);
+	return 0;
+}
+
+// Deferred structural changes. Each thread records into its own buffer, and update plays them back
+// in the order of (key, thread, seq), so the result doesn't depend on how the work is split.
+
+static int
+command_reserve(struct entity_world *w, struct command_buffer *b, size_t sz) {
+	if (b->n < b->cap && b->size + sz <= b->data_cap)
+		return 1;
+	// the allocator of world is not thread safe
+	struct ecs_parallel *p = w->in_parallel ? w->parallel : NULL;
+	if (p)
+		mutex_lock(&p->lock);
+	int ok = 1;
+	if (b->n >= b->cap) {
+		int cap = b->cap * 3 / 2 + 64;
+		struct command *cmd = (struct command *)world_realloc(w, b->cmd, b->cap * sizeof(struct command), cap * sizeof(struct command));
+		if (cmd) {
+			b->cmd = cmd;
+			b->cap = cap;
+		} else {
+			ok = 0;
+		}
+	}
+	if (ok && b->size + sz > b->data_cap) {
+		size_t cap = b->data_cap * 3 / 2 + 1024;
+		if (cap < b->size + sz)
+			cap = b->size + sz;
+		char *data = (char *)world_realloc(w, b->data, b->data_cap, cap);
+		if (data) {
+			b->data = data;
+			b->data_cap = cap;
+		} else {
+			ok = 0;
+		}
+	}
+	if (p)
+		mutex_unlock(&p->lock);
+	return ok;
+}
+
+static uint64_t
+entity_command_(struct entity_world *w, int thread, int key, int op, uint64_t entity, int cid, const void *buffer) {
+	assert(thread >= 0 && thread < PARALLEL_MAXTHREAD);
+	struct command_buffer *b = &w->cmd[thread];
+	size_t sz = 0;
+	if (op != ECS_CMD_NEW) {
+		struct component_pool *c = &w->c[cid];
+		assert(c->stride >= 0);	// no lua object and order key
+		assert(op == ECS_CMD_ADD || c->stride == STRIDE_TAG);
+		assert(op == ECS_CMD_DEL || c->stride == STRIDE_TAG || buffer);
+		if (op == ECS_CMD_ADD && c->stride > 0)
+			sz = c->stride;
+	}
+	if (b->failed || !command_reserve(w, b, sz)) {
+		b->failed = 1;
+		return 0;
+	}
+	struct command *cmd = &b->cmd[b->n];
+	cmd->op = op;
+	cmd->cid = cid;
+	cmd->key = key;
+	cmd->thread = thread;
+	cmd->seq = b->n;
+	cmd->entity = entity;
+	cmd->payload = 0;
+	if (sz) {
+		memcpy(b->data + b->size, buffer, sz);
+		cmd->payload = b->size + 1;
+		b->size += sz;
+	}
+	++b->n;
+	if (op == ECS_CMD_NEW)
+		return (uint64_t)(cmd->seq + 1) << 32 | (unsigned int)thread;
+	return entity;
+}
+
+static void
+command_reset(struct entity_world *w) {
+	int i;
+	for (i=0;i<PARALLEL_MAXTHREAD;i++) {
+		struct command_buffer *b = &w->cmd[i];
+		b->n = 0;
+		b->size = 0;
+		b->failed = 0;
+	}
+}
+
+static void
+command_release(struct entity_world *w) {
+	int i;
+	for (i=0;i<PARALLEL_MAXTHREAD;i++) {
+		struct command_buffer *b = &w->cmd[i];
+		world_free(w, b->cmd, b->cap * sizeof(struct command));
+		world_free(w, b->data, b->data_cap);
+		memset(b, 0, sizeof(*b));
+	}
+}
+
+struct command_op {
+	int cid;
+	int op;
+	unsigned int eid;
+	int order;
+	const void *payload;
+};
+
+static int
+compar_command(const void *a, const void *b) {
+	const struct command *x = *(const struct command **)a;
+	const struct command *y = *(const struct command **)b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	if (x->thread != y->thread)
+		return x->thread < y->thread ? -1 : 1;
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static int
+compar_command_op(const void *a, const void *b) {
+	const struct command_op *x = (const struct command_op *)a;
+	const struct command_op *y = (const struct command_op *)b;
+	if (x->cid != y->cid)
+		return x->cid < y->cid ? -1 : 1;
+	if (x->eid != y->eid)
+		return x->eid < y->eid ? -1 : 1;
+	return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+// ops are sorted by eid, one op for each eid
+static void
+command_apply(lua_State *L, struct entity_world *w, int cid, struct command_op *ops, int n) {
+	struct component_pool *c = &w->c[cid];
+	int i, j;
+	if (c->flags & POOL_BITSET) {
+		for (i=0;i<n;i++) {
+			if (ops[i].op == ECS_CMD_ADD)
+				bitset_enable(L, 1, w, cid, ops[i].eid);
+			else
+				bitset_disable(c, ops[i].eid);
+		}
+		return;
+	}
+	if (c->stride == STRIDE_TAG) {
+		tag_settle(c);
+		// remove the disabled tags in one sweep
+		int k = 0;
+		int to = 0;
+		for (i=0;i<c->n;i++) {
+			unsigned int eid = c->id[i];
+			while (k < n && (ops[k].op != ECS_CMD_DEL || ops[k].eid < eid))
+				++k;
+			if (k < n && ops[k].eid == eid)
+				continue;
+			c->id[to++] = eid;
+		}
+		if (to != c->n) {
+			c->n = to;
+			++c->version;
+			sparse_index_range(c, 0, to);
+		}
+	}
+	// overwrite the existing components, and keep the new ones
+	int pos = 0;
+	for (i=0,j=0;i<n;i++) {
+		if (ops[i].op != ECS_CMD_ADD)
+			continue;
+		unsigned int eid = ops[i].eid;
+		pos = gallop_search(c->id, c->n, pos, eid);
+		if (pos < c->n && c->id[pos] == eid) {
+			if (ops[i].payload) {
+				write_row(c, pos, ops[i].payload);
+				stamp_row(w, c, pos);
+			}
+		} else {
+			ops[j++] = ops[i];
+		}
+	}
+	n = j;
+	if (n == 0)
+		return;
+	// merge the new ones from the end, the runs of existing components between them are moved at once
+	int last = c->n - 1;
+	for (i=0;i<n;i++) {
+		append_slot(L, 1, w, cid);
+	}
+	int dst = c->n - 1;
+	for (i=n-1;i>=0;i--) {
+		unsigned int eid = ops[i].eid;
+		int from = gallop_search(c->id, last + 1, last, eid);
+		int r = last + 1 - from;
+		move_range(L, c, from, dst - r + 1, r);
+		dst -= r;
+		last = from - 1;
+		c->id[dst] = eid;
+		if (ops[i].payload)
+			write_row(c, dst, ops[i].payload);
+		stamp_row(w, c, dst);
+		mask_mark(w, cid, eid);
+		if (c->flags & POOL_SPARSE)
+			sparse_index_set(L, w, c, eid, dst);
+		--dst;
+	}
+}
+
+static void
+command_playback(lua_State *L, struct entity_world *w) {
+	int i, j;
+	int n = 0;
+	int nnew = 0;
+	for (i=0;i<PARALLEL_MAXTHREAD;i++) {
+		struct command_buffer *b = &w->cmd[i];
+		if (b->failed) {
+			command_reset(w);
+			luaL_error(L, "Out of memory in command buffer of thread %d", i);
+		}
+		n += b->n;
+	}
+	if (n == 0)
+		return;
+	// in a userdata, so it's collected when an error raises
+	struct command **sorted = (struct command **)lua_newuserdatauv(L, n * (sizeof(struct command *) + sizeof(struct command_op)), 0);
+	struct command_op *ops = (struct command_op *)(sorted + n);
+	n = 0;
+	for (i=0;i<PARALLEL_MAXTHREAD;i++) {
+		struct command_buffer *b = &w->cmd[i];
+		for (j=0;j<b->n;j++) {
+			struct command *cmd = &b->cmd[j];
+			sorted[n++] = cmd;
+			if (cmd->op == ECS_CMD_NEW)
+				++nnew;
+		}
+	}
+	qsort(sorted, n, sizeof(struct command *), compar_command);
+	if (nnew > 0) {
+		unsigned int eid = new_entity(L, 1, w, nnew);
+		for (i=0;i<n;i++) {
+			if (sorted[i]->op == ECS_CMD_NEW)
+				sorted[i]->entity = eid++;
+		}
+	}
+	int nop = 0;
+	for (i=0;i<n;i++) {
+		struct command *cmd = sorted[i];
+		if (cmd->op == ECS_CMD_NEW)
+			continue;
+		uint64_t e = cmd->entity;
+		if (e >> 32) {
+			// (seq + 1) << 32 | thread of ECS_CMD_NEW
+			unsigned int thread = (unsigned int)e;
+			uint64_t seq = (e >> 32) - 1;
+			if (thread >= PARALLEL_MAXTHREAD || seq >= (uint64_t)w->cmd[thread].n || w->cmd[thread].cmd[seq].op != ECS_CMD_NEW) {
+				command_reset(w);
+				luaL_error(L, "Invalid entity %p in command", (void *)(uintptr_t)e);
+			}
+			e = w->cmd[thread].cmd[seq].entity;
+		}
+		struct command_op *op = &ops[nop++];
+		op->cid = cmd->cid;
+		op->op = cmd->op;
+		op->eid = (unsigned int)e;
+		op->order = i;
+		op->payload = cmd->payload ? w->cmd[cmd->thread].data + cmd->payload - 1 : NULL;
+	}
+	qsort(ops, nop, sizeof(struct command_op), compar_command_op);
+	// the last command of each component wins
+	for (i=0,j=0;i<nop;i++) {
+		if (i + 1 < nop && ops[i+1].cid == ops[i].cid && ops[i+1].eid == ops[i].eid)
+			continue;
+		ops[j++] = ops[i];
+	}
+	nop = j;
+	for (i=0;i<nop;i=j) {
+		for (j=i+1;j<nop && ops[j].cid == ops[i].cid;j++);
+		command_apply(L, w, ops[i].cid, ops + i, j - i);
+	}
+	command_reset(w);
+	lua_pop(L, 1);
+}
+
+// Enable the sorted unique eids in tag pool cid, the runs of ids between them are moved once from the end.
+static void
+tag_merge(lua_State *L, int world_index, struct entity_world *w, int cid, const unsigned int *eid, int n) {
+	struct component_pool *c = &w->c[cid];
+	int i;
+	int m = 0;
+	int pos = 0;
+	for (i=0;i<n;i++) {
+		pos = gallop_search(c->id, c->n, pos, eid[i]);
+		if (pos >= c->n || c->id[pos] != eid[i]) {
+			++m;
+			if (c->flags & POOL_SPARSE)
+				sparse_index_set(L, w, c, eid[i], 0);	// make sure the page exists
+		}
+	}
+	if (m == 0)
+		return;
+	int last = c->n - 1;
+	for (i=0;i<m;i++) {
+		append_slot(L, world_index, w, cid);
+	}
+	int dst = c->n - 1;
+	for (i=n-1;i>=0 && dst > last;i--) {
+		unsigned int e = eid[i];
+		int from = gallop_search(c->id, last + 1, last, e);
+		int present = from <= last && c->id[from] == e;
+		int r = last + 1 - from;
+		memmove(c->id + dst - r + 1, c->id + from, r * sizeof(unsigned int));
+		dst -= r;
+		last = from - 1;
+		if (!present) {
+			c->id[dst--] = e;
+			mask_mark(w, cid, e);
+		}
+	}
+	sparse_index_range(c, last + 1, c->n);
+}
+
+// Disable the sorted unique eids in tag pool, in one sweep
+static void
+tag_sweep(struct component_pool *c, const unsigned int *eid, int n) {
+	int k = 0;
+	int to = 0;
+	int i;
+	for (i=0;i<c->n;i++) {
+		unsigned int id = c->id[i];
+		while (k < n && eid[k] < id)
+			++k;
+		if (k < n && eid[k] == id)
+			continue;
+		c->id[to++] = id;
+	}
+	if (to != c->n) {
+		c->n = to;
+		++c->version;
+		sparse_index_range(c, 0, to);
+	}
+}
+
+// Enable or disable the tag cid of n entities, eid needn't be sorted.
+// It's one merge instead of n insert_id, but don't use it on the tag in iteration.
+static void
+entity_tag_batch_(struct entity_world *w, int cid, const unsigned int *eid, int n, int enable, void *L, int world_index) {
+	assert(!w->in_parallel);
+	struct component_pool *c = &w->c[cid];
+	assert(c->stride == STRIDE_TAG);
+	int i;
+	if (n <= 0)
+		return;
+	if (c->flags & POOL_BITSET) {
+		for (i=0;i<n;i++) {
+			if (enable)
+				bitset_enable((lua_State *)L, world_index, w, cid, eid[i]);
+			else
+				bitset_disable(c, eid[i]);
+		}
+		return;
+	}
+	for (i=1;i<n && eid[i-1] < eid[i];i++);
+	int copy = i < n;
+	if (copy) {
+		unsigned int *tmp = (unsigned int *)lua_newuserdatauv((lua_State *)L, n * sizeof(unsigned int), 0);
+		memcpy(tmp, eid, n * sizeof(unsigned int));
+		qsort(tmp, n, sizeof(unsigned int), compar_id);
+		int j = 1;
+		for (i=1;i<n;i++) {
+			if (tmp[i] != tmp[j-1])
+				tmp[j++] = tmp[i];
+		}
+		n = j;
+		eid = tmp;
+	}
+	tag_settle(c);
+	if (enable)
+		tag_merge((lua_State *)L, world_index, w, cid, eid, n);
+	else
+		tag_sweep(c, eid, n);
+	if (copy)
+		lua_pop((lua_State *)L, 1);
+}
+
+static int
+ltag_batch(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int cid = luaL_checkinteger(L, 2);
+	if (cid < 0 || cid >= MAX_COMPONENT || w->c[cid].cap == 0 || w->c[cid].stride != STRIDE_TAG)
+		return luaL_error(L, "Invalid tag %d", cid);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int enable = lua_isnoneornil(L, 4) || lua_toboolean(L, 4);
+	int n = lua_rawlen(L, 3);
+	if (n == 0)
+		return 0;
+	unsigned int *eid = (unsigned int *)lua_newuserdatauv(L, n * sizeof(unsigned int), 0);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_rawgeti(L, 3, i+1);
+		int isnum;
+		lua_Integer id = lua_tointegerx(L, -1, &isnum);
+		lua_pop(L, 1);
+		if (!isnum || id <= 0 || id > w->max_id)
+			return luaL_error(L, "Invalid entity id at %d", i+1);
+		eid[i] = (unsigned int)id;
+	}
+	entity_tag_batch_(w, cid, eid, n, enable, L, 1);
+	return 0;
+}
+
+static int
+lcontext(lua_State *L) {
+	struct entity_world *w = getW(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_len(L, 2);
+	int n = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (n <= 0) {
+		return luaL_error(L, "Invalid length %d of table", n);
+	}
+	size_t sz = sizeof(struct ecs_context) + sizeof(int) * n;
+	struct ecs_context *ctx = (struct ecs_context *)lua_newuserdatauv(L, sz, 1);
+	ctx->L = (void *)lua_newthread(L);
+	lua_pushvalue(L, 1);
+	lua_xmove(L, ctx->L, 1);	// put world in the index 1 of newthread
+	lua_setiuservalue(L, -2, 1);
+	ctx->max_id = n;
+	ctx->world = w;
+	static struct ecs_capi c_api = {
+		entity_iter_,
+		entity_clear_type_,
+		entity_sibling_index_,
+		entity_add_sibling_,
+		entity_new_,
+		entity_remove_,
+		entity_enable_tag_,
+		entity_disable_tag_,
+		entity_iter_lua_,
+		entity_assign_lua_,
+		entity_ids_,
+		entity_set_op_,
+		entity_column_,
+		entity_new_batch_,
+		entity_handle_,
+		entity_handle_index_,
+		entity_parallel_for_,
+		entity_parallel_threads_,
+		entity_command_,
+		entity_tag_batch_,
+		entity_changed_,
+		entity_eid_,
+	};
+	ctx->api = &c_api;
+	ctx->cid[0] = ENTITY_REMOVED;
+	int i;
+	for (i=1;i<=n;i++) {
+		if (lua_geti(L, 2, i) != LUA_TNUMBER) {
+			return luaL_error(L, "Invalid id at index %d", i);
+		}
+		ctx->cid[i] = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		int cid = ctx->cid[i];
+		if (cid == ENTITY_REMOVED || cid < 0 || cid >= MAX_COMPONENT)
+			return luaL_error(L, "Invalid id (%d) at index %d", cid, i);
+	}
+	return 1;
+}
+
+static int
+lnew_world(lua_State *L) {
+	size_t sz = sizeof(struct entity_world);
+	struct ecs_allocator *alloc = NULL;
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+		alloc = (struct ecs_allocator *)lua_touserdata(L, 1);
+	}
+	struct entity_world *w = (struct entity_world *)lua_newuserdatauv(L, sz, MAX_COMPONENT * 2);
+	memset(w, 0, sz);
+	w->slot_free = -1;
+	w->change_version = 1;
+	if (alloc) {
+		w->alloc = *alloc;
+	} else {
+		w->alloc.alloc = arena_alloc;
+		w->alloc.ud = &w->arena;
+	}
+	// removed set
+	entity_new_type(L, w, ENTITY_REMOVED, 0, 0, 0);
+	luaL_getmetatable(L, "ENTITY_WORLD");
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+#define TYPE_INT 0
+#define TYPE_FLOAT 1
+#define TYPE_BOOL 2
+#define TYPE_INT64 3
+#define TYPE_DWORD 4
+#define TYPE_WORD 5
+#define TYPE_BYTE 6
+#define TYPE_DOUBLE 7
+#define TYPE_USERDATA 8
+#define TYPE_COUNT 9
+
+struct field {
+	const char *key;
+	int offset;
+	int type;
+	int run;	// the number of fields of the same type from this one in the component
+};
+
+static int
+check_type(lua_State *L) {
+	int type = lua_tointeger(L, -1);
+	if (type < 0 || type >= TYPE_COUNT) {
+		luaL_error(L, "Invalid field type(%d)", type);
+	}
+	lua_pop(L, 1);
+	return type;
+}
+
+static void
+get_field(lua_State *L, int i, struct field *f) {
+	if (lua_geti(L, -1, 1) != LUA_TNUMBER) {
+		luaL_error(L, "Invalid field %d [1] type", i);
+	}
+	f->type = check_type(L);
+
+	if (lua_geti(L, -1, 2) != LUA_TSTRING) {
+		luaL_error(L, "Invalid field %d [2] key", i);
+	}
+	f->key = lua_tostring(L, -1);
+	lua_pop(L, 1);
+
+	if (lua_geti(L, -1, 3) != LUA_TNUMBER) {
+		luaL_error(L, "Invalid field %d [3] offset", i);
+	}
+	f->offset = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	lua_pop(L, 1);
+}
+
+// Group the fields of a component into runs of the same type, read_component and write_component
+// dispatch once for each run instead of each field.
+// There is no memcpy path here : a lua value never holds the bytes of a row, so each field is
+// converted anyway. Copies between rows (new_batch, snapshot, soa) use memcpy already.
+#define MAX_FIELDRUN 16
+
+static void
+compile_fields(struct field *f, int n) {
+	int i;
+	for (i=n-1;i>=0;i--) {
+		if (i < n-1 && f[i].type == f[i+1].type && f[i+1].run < MAX_FIELDRUN)
+			f[i].run = f[i+1].run + 1;
+		else
+			f[i].run = 1;
+	}
+}
+
+static void
+write_value(lua_State *L, struct field *f, char *buffer) {
+	int luat = lua_type(L, -1);
+	char *ptr = buffer + f->offset;
+	switch (f->type) {
+		case TYPE_INT:
+			if (!lua_isinteger(L, -1))
+				luaL_error(L, "Invalid .%s type %s (int)", f->key ? f->key : "*", lua_typename(L, luat));
+			*(int *)ptr = lua_tointeger(L, -1);
+			break;
+		case TYPE_FLOAT:
+			if (luat != LUA_TNUMBER)
+				luaL_error(L, "Invalid .%s type %s (float)", f->key ? f->key : "*", lua_typename(L, luat));
+			*(float *)ptr = lua_tonumber(L, -1);
+			break;
+		case TYPE_BOOL:
+			if (luat != LUA_TBOOLEAN)
+				luaL_error(L, "Invalid .%s type %s (bool)", f->key ? f->key : "*", lua_typename(L, luat));
+			*(unsigned char *)ptr = lua_toboolean(L, -1);
+			break;
+		case TYPE_INT64:
+			if (!lua_isinteger(L, -1))
+				luaL_error(L, "Invalid .%s type %s (int64)", f->key ? f->key : "*", lua_typename(L, luat));
+			*(int64_t *)ptr = lua_tointeger(L, -1);
+			break;
+		case TYPE_DWORD:
+			if (!lua_isinteger(L, -1))
+				luaL_error(L, "Invalid .%s type %s (uint32)", f->key ? f->key : "*", lua_typename(L, luat));
+			else {
+				int64_t v = lua_tointeger(L, -1);
+				if (v < 0 || v > 0xffffffff) {
+					luaL_error(L, "Invalid DWORD %d", (int)v);
+				}
+				*(uint32_t *)ptr = v;
+			}
+			break;
+		case TYPE_WORD:
+			if (!lua_isinteger(L, -1))
+				luaL_error(L, "Invalid .%s type %s (uint16)", f->key ? f->key : "*", lua_typename(L, luat));
+			else {
+				int v = lua_tointeger(L, -1);
+				if (v < 0 || v > 0xffff) {
+					luaL_error(L, "Invalid WORD %d", v);
+				}
+				*(uint16_t *)ptr = v;
+			}
+			break;
+		case TYPE_BYTE:
+			if (!lua_isinteger(L, -1))
+				luaL_error(L, "Invalid .%s type %s (uint8)", f->key ? f->key : "*", lua_typename(L, luat));
+			else {
+				int v = lua_tointeger(L, -1);
+				if (v < 0 || v > 255) {
+					luaL_error(L, "Invalid BYTE %d", v);
+				}
+				*(uint8_t *)ptr = v;
+			}
+			break;
+		case TYPE_DOUBLE:
+			if (luat != LUA_TNUMBER)
+				luaL_error(L, "Invalid .%s type %s (double)", f->key ? f->key : "*", lua_typename(L, luat));
+			*(double *)ptr = lua_tonumber(L, -1);
+			break;
+		case TYPE_USERDATA:
+			if (luat !=  LUA_TLIGHTUSERDATA)
+				luaL_error(L, "Invalid .%s type %s (pointer)", f->key ? f->key : "*", lua_typename(L, luat));
+			*(void **)ptr = lua_touserdata(L, -1);
+			break;
+	}
+	lua_pop(L, 1);
+}
+
+static void
+invalid_field(lua_State *L, struct field *f) {
+	static const char * typename[TYPE_COUNT] = {
+		"int", "float", "bool", "int64", "uint32", "uint16", "uint8", "double", "pointer",
+	};
+	luaL_error(L, "Invalid .%s type %s (%s)", f->key ? f->key : "*", luaL_typename(L, -1), typename[f->type]);
+}
+
+// Push all the fields of a run and check them, then convert and pop them together
+#define WRITE_RUN(ctype, check, get) \
+	for (j=0;j<n;j++) { \
+		if (!check(L, lua_getfield(L, index, f[j].key))) \
+			invalid_field(L, &f[j]); \
+	} \
+	for (j=0;j<n;j++) { \
+		*(ctype *)(buffer + f[j].offset) = (ctype)get(L, j - n); \
+	} \
+	lua_pop(L, n);
+
+static inline int
+check_integer(lua_State *L, int t) {
+	return t == LUA_TNUMBER && lua_isinteger(L, -1);
+}
+
+static inline int
+check_number(lua_State *L, int t) {
+	(void)L;
+	return t == LUA_TNUMBER;
+}
+
+static void
+write_component(lua_State *L, int field_n, struct field *f, int index, char *buffer) {
+	struct field *end = f + field_n;
+	index = lua_absindex(L, index);
+	luaL_checkstack(L, MAX_FIELDRUN, NULL);
+	while (f < end) {
+		int n = f->run;
+		int j;
+		switch (f->type) {
+		case TYPE_INT:
+			WRITE_RUN(int, check_integer, lua_tointeger)
+			break;
+		case TYPE_INT64:
+			WRITE_RUN(int64_t, check_integer, lua_tointeger)
+			break;
+		case TYPE_FLOAT:
+			WRITE_RUN(float, check_number, lua_tonumber)
+			break;
+		case TYPE_DOUBLE:
+			WRITE_RUN(double, check_number, lua_tonumber)
+			break;
+		default:
+			// range checked types
+			for (j=0;j<n;j++) {
+				lua_getfield(L, index, f[j].key);
+				write_value(L, &f[j], buffer);
+			}
+			break;
+		}
+		f += n;
+	}
+}
+
+static void
+read_value(lua_State *L, struct field *f, const char *buffer) {
+	const char * ptr = buffer + f->offset;
+	switch (f->type) {
+	case TYPE_INT:
+		lua_pushinteger(L, *(const int *)ptr);
+		break;
+	case TYPE_FLOAT:
+		lua_pushnumber(L, *(const float *)ptr);
+		break;
+	case TYPE_BOOL:
+		lua_pushboolean(L, *ptr);
+		break;
+	case TYPE_INT64:
+		lua_pushinteger(L, *(const int64_t *)ptr);
+		break;
+	case TYPE_DWORD:
+		lua_pushinteger(L, *(const uint32_t *)ptr);
+		break;
+	case TYPE_WORD:
+		lua_pushinteger(L, *(const uint16_t *)ptr);
+		break;
+	case TYPE_BYTE:
+		lua_pushinteger(L, *(const uint8_t *)ptr);
+		break;
+	case TYPE_DOUBLE:
+		lua_pushnumber(L, *(const double *)ptr);
+		break;
+	case TYPE_USERDATA:
+		lua_pushlightuserdata(L, *(void **)ptr);
+		break;
+	default:
+		// never here
+		luaL_error(L, "Invalid field type %d", f->type);
+		break;
+	}
+}
+
+#define READ_RUN(ctype, push) \
+	for (j=0;j<n;j++) { \
+		push(L, *(ctype const *)(buffer + f[j].offset)); \
+		lua_setfield(L, index, f[j].key); \
+	}
+
+static void
+read_component(lua_State *L, int field_n, struct field *f, int index, const char * buffer) {
+	struct field *end = f + field_n;
+	while (f < end) {
+		int n = f->run;
+		int j;
+		switch (f->type) {
+		case TYPE_INT:
+			READ_RUN(int, lua_pushinteger)
+			break;
+		case TYPE_FLOAT:
+			READ_RUN(float, lua_pushnumber)
+			break;
+		case TYPE_BOOL:
+			READ_RUN(unsigned char, lua_pushboolean)
+			break;
+		case TYPE_INT64:
+			READ_RUN(int64_t, lua_pushinteger)
+			break;
+		case TYPE_DWORD:
+			READ_RUN(uint32_t, lua_pushinteger)
+			break;
+		case TYPE_WORD:
+			READ_RUN(uint16_t, lua_pushinteger)
+			break;
+		case TYPE_BYTE:
+			READ_RUN(uint8_t, lua_pushinteger)
+			break;
+		case TYPE_DOUBLE:
+			READ_RUN(double, lua_pushnumber)
+			break;
+		case TYPE_USERDATA:
+			READ_RUN(void *, lua_pushlightuserdata)
+			break;
+		default:
+			// never here
+			luaL_error(L, "Invalid field type %d", f->type);
+			break;
+		}
+		f += n;
+	}
+}
+
+static int
+get_len(lua_State *L, int index) {
+	lua_len(L, index);
+	if (lua_type(L, -1) != LUA_TNUMBER) {
+		return luaL_error(L, "Invalid table length");
+	}
+	int n = lua_tointeger(L, -1);
+	if (n < 0) {
+		return luaL_error(L, "Invalid table length %d", n);
+	}
+	lua_pop(L, 1);
+	return n;
+}
+
+#define COMPONENT_IN 1
+#define COMPONENT_OUT 2
+#define COMPONENT_OPTIONAL 4
+#define COMPONENT_OBJECT 8
+#define COMPONENT_EXIST 0x10
+#define COMPONENT_ABSENT 0x20
+#define COMPONENT_FILTER (COMPONENT_EXIST | COMPONENT_ABSENT)
+#define COMPONENT_CHANGED 0x40
+
+struct group_key {
+	const char *name;
+	int id;
+	int field_n;
+	int attrib;
+};
+
+static inline int
+is_temporary(int attrib) {
+	if (attrib & COMPONENT_FILTER)
+		return 0;
+	return (attrib & COMPONENT_IN) == 0 && (attrib & COMPONENT_OUT) == 0;
+}
+
+struct group_iter {
+	struct entity_world *world;
+	struct field *f;
+	int nkey;
+	int readonly;
+	int driver;	// the smallest required key, chosen at the beginning of iteration
+	// matched rows (main index and sibling indices) of the last complete pass,
+	// valid while the versions of the pools in pattern are unchanged.
+	unsigned int stamp;
+	int cache_valid;
+	int cache_n;
+	int cache_cap;
+	int cursor;
+	int record_n;	// -1 : not recording
+	const void *record_owner;
+	unsigned int *cache;
+	int changed;	// keys of name:changed, a row is matched only if all of them are changed since the last run
+	unsigned int since;	// change version of the last run
+	unsigned int last_run;
+	struct group_key k[1];
+};
+
+static int
+get_write_component(lua_State *L, int lua_index, const char *name, struct field *f, struct component_pool *c) {
+	switch (lua_getfield(L, lua_index, name)) {
+	case LUA_TNIL:
+		lua_pop(L, 1);
+		// restore cache (metatable can be absent during sync)
+		if (lua_getmetatable(L, lua_index)) {
+			lua_getfield(L, -1, name);
+			lua_setfield(L, lua_index, name);
+			lua_pop(L, 1);	// pop metatable
+		}
+		return 0;
+	case LUA_TTABLE:
+		return 1;
+	default:
+		if (c->stride == STRIDE_LUA) {
+			// lua object
+			return 1;
+		}
+		if (f->key == NULL) {
+			// value type
+			return 1;
+		}
+		return luaL_error(L, "Invalid iterator type %s", lua_typename(L, lua_type(L, -1)));
+	}
+}
+
+static void
+write_component_object(lua_State *L, int n, struct field *f, void *buffer) {
+	if (f->key == NULL) {
+		write_value(L, f, buffer);
+	} else {
+		write_component(L, n, f, -1, (char *)buffer);
+		lua_pop(L, 1);
+	}
+}
+
+static int
+remove_tag(lua_State *L, int lua_index, const char *name) {
+	int r = 0;
+	switch (lua_getfield(L, lua_index, name)) {
+	case LUA_TNIL:
+		r = 1;
+		break;
+	case LUA_TBOOLEAN:
+		r = !lua_toboolean(L, -1);
+		break;
+	default:
+		return luaL_error(L, "Invalid tag type %s", lua_typename(L, lua_type(L, -1)));
+	}
+	lua_pop(L, 1);
+	return r;
+}
+
+static void
+update_iter(lua_State *L, int world_index, int lua_index, struct group_iter *iter, int idx, int mainkey, int skip) {
+	struct field *f = iter->f;
+
+	int i;
+	for (i=0;i<skip;i++) {
+		f += iter->k[i].field_n;
+	}
+	for (i=skip;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		if (!(k->attrib & COMPONENT_FILTER)) {
+			struct component_pool *c = &iter->world->c[k->id];
+			if (c->stride == STRIDE_TAG) {
+				// It's a tag
+				if ((k->attrib & COMPONENT_OUT)) {
+					switch (lua_getfield(L, lua_index, k->name)) {
+					case LUA_TNIL:
+						break;
+					case LUA_TBOOLEAN:
+						if (lua_toboolean(L, -1)) {
+							entity_enable_tag_(iter->world, mainkey, idx, k->id, L, world_index);
+						} else {
+							entity_disable_tag_(iter->world, mainkey, idx, k->id);
+						}
+						if (!(k->attrib & COMPONENT_IN)) {
+							// reset tag
+							lua_pushnil(L);
+							lua_setfield(L, lua_index, k->name);
+						}
+						break;
+					default:
+						luaL_error(L, ".%s is a tag , should be a boolean or nil. It's %s", k->name, lua_typename(L, lua_type(L, -1)));
+					}
+					lua_pop(L, 1);
+				}
+			} else if (c->stride == STRIDE_ORDER) {
+				assert(is_temporary(k->attrib));
+				if (lua_getfield(L, lua_index, k->name) != LUA_TNIL) {
+					if (!lua_isboolean(L, -1) || lua_toboolean(L, -1) == 0)
+						luaL_error(L, "Only support true for order key .%s", k->name);
+					lua_pop(L, 1);
+					entity_add_sibling_(iter->world, mainkey, idx, k->id, NULL, L, world_index);
+					lua_pushnil(L);
+					lua_setfield(L, lua_index, k->name);
+				}
+			} else if ((k->attrib & COMPONENT_OUT)
+				&& get_write_component(L, lua_index, k->name, f, c)) {
+				int index = entity_sibling_index_(iter->world, mainkey, idx, k->id);
+				if (index == 0) {
+					luaL_error(L, "Can't find sibling %s of %s", k->name, iter->k[0].name);
+				}
+				if (c->stride == STRIDE_LUA) {
+					if (lua_getiuservalue(L, world_index, k->id * 2 + 2) != LUA_TTABLE) {
+						luaL_error(L, "Missing lua table for %d", k->id);
+					}
+					lua_insert(L, -2);
+					lua_rawseti(L, -2, index);
+				} else {
+					struct row_write rw;
+					write_component_object(L, k->field_n, f, row_write_begin(c, index - 1, &rw));
+					row_write_end(iter->world, c, index - 1, &rw);
+				}
+			} else if (is_temporary(k->attrib)
+				&& get_write_component(L, lua_index, k->name, f, c)) {
+				if (c->stride == STRIDE_LUA) {
+					int index = entity_add_sibling_index_(L, world_index, iter->world, mainkey, idx, k->id);
+					if (lua_getiuservalue(L, world_index, k->id * 2 + 2) != LUA_TTABLE) {
+						luaL_error(L, "Missing lua table for %d", k->id);
+					}
+					lua_insert(L, -2);
+					lua_rawseti(L, -2, index + 1);
+				} else {
+					int index = entity_add_sibling_index_(L, world_index, iter->world, mainkey, idx, k->id);
+					void *buffer = get_row(c, index);
+					write_component_object(L, k->field_n, f, buffer);
+					commit_row(c, index);
+				}
+			}
+		}
+		f += k->field_n;
+	}
+}
+
+static void
+update_last_index(lua_State *L, int world_index, int lua_index, struct group_iter *iter, int idx) {
+	int mainkey = iter->k[0].id;
+	struct component_pool *c = &iter->world->c[mainkey];
+	int disable_mainkey = 0;
+	if (!(iter->k[0].attrib & COMPONENT_FILTER)) {
+		if (c->stride == STRIDE_TAG) {
+			// The mainkey is a tag, delay disable
+			disable_mainkey = ((iter->k[0].attrib & COMPONENT_OUT) && remove_tag(L, lua_index, iter->k[0].name));
+		} else if ((iter->k[0].attrib & COMPONENT_OUT)
+			&& get_write_component(L, lua_index, iter->k[0].name, iter->f, c)) {
+			struct component_pool *c = &iter->world->c[mainkey];
+			if (c->n <= idx) {
+				luaL_error(L, "Can't find component %s for index %d", iter->k[0].name, idx);
+			}
+			if (c->stride == STRIDE_LUA) {
+				if (lua_getiuservalue(L, world_index, mainkey * 2 + 2) != LUA_TTABLE) {
+					luaL_error(L, "Missing lua table for %d", mainkey);
+				}
+				lua_insert(L, -2);
+				lua_rawseti(L, -2, idx+1);
+			} else {
+				struct row_write rw;
+				write_component_object(L, iter->k[0].field_n, iter->f, row_write_begin(c, idx, &rw));
+				row_write_end(iter->world, c, idx, &rw);
+			}
+		}
+	}
+
+	update_iter(L, world_index, lua_index, iter, idx, mainkey, 1);
+
+	if (disable_mainkey) {
+		entity_disable_tag_(iter->world, mainkey, idx, mainkey);
+	}
+}
+
+static void
+read_component_in_field(lua_State *L, int lua_index, const char *name, int n, struct field *f, void *buffer) {
+	if (n == 0) {
+		// It's tag
+		lua_pushboolean(L, buffer ? 1 : 0);
+		lua_setfield(L, lua_index, name);
+		return;
+	}
+	if (f->key == NULL) {
+		// value type
+		read_value(L, f, buffer);
+		lua_setfield(L, lua_index, name);
+		return;
+	}
+	if (lua_getfield(L, lua_index, name) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, lua_index, name);
+	}
+	read_component(L, n , f, lua_gettop(L), buffer);
+	lua_pop(L, 1);
+}
+
+// -1 : end ; 0 : next ; 1 : succ
+static int
+query_index(struct group_iter *iter, int skip, int mainkey, int idx, unsigned int index[MAX_COMPONENT]) {
+	if (entity_iter_(iter->world, mainkey, idx) == NULL) {
+		return -1;
+	}
+	int j;
+	for (j=skip;j<iter->nkey;j++) {
+		struct group_key *k = &iter->k[j];
+		if (k->attrib & COMPONENT_ABSENT) {
+			if (entity_sibling_index_(iter->world, mainkey, idx, k->id)) {
+				// exist. try next
+				return 0;
+			}
+			index[j] = 0;
+		} else if (!is_temporary(k->attrib)) {
+			index[j] = entity_sibling_index_(iter->world, mainkey, idx, k->id);
+			if (index[j] == 0) {
+				if (!(k->attrib & COMPONENT_OPTIONAL)) {
+					// required. try next
+					return 0;
+				}
+			}
+		} else {
+			index[j] = 0;
+		}
+	}
+	return 1;
+}
+
+// Find the first matched entity from idx of mainkey, or -1 at the end.
+// All the pools are sorted by eid, so the cursors of them move forward together,
+// and the main key leaps to the next candidate eid when a required sibling misses.
+static int
+query_join(struct group_iter *iter, int mainkey, int idx, unsigned int index[MAX_COMPONENT]) {
+	struct entity_world *w = iter->world;
+	struct component_pool *mpool = &w->c[mainkey];
+	int sorted = (mpool->stride != STRIDE_ORDER);
+	struct component_pool *driver = NULL;
+	if (sorted && iter->driver > 0)
+		driver = &w->c[iter->k[iter->driver].id];
+	for (;;) {
+		if (entity_iter_(w, mainkey, idx) == NULL)
+			return -1;
+		unsigned int eid = mpool->id[idx];
+		if (driver) {
+			// the driver is much smaller than main key, follow it
+			int pos = seek_component(driver, eid);
+			if (pos >= driver->n)
+				return -1;
+			if (driver->id[pos] != eid) {
+				idx = gallop_search(mpool->id, mpool->n, idx + 1, driver->id[pos]);
+				continue;
+			}
+		}
+		unsigned int next = eid;
+		int j;
+		for (j=1;j<iter->nkey;j++) {
+			struct group_key *k = &iter->k[j];
+			if (is_temporary(k->attrib)) {
+				index[j] = 0;
+				continue;
+			}
+			struct component_pool *c = &w->c[k->id];
+			int required = !(k->attrib & (COMPONENT_ABSENT | COMPONENT_OPTIONAL));
+			int pos;
+			if (c->flags & POOL_BITSET) {
+				// tags in bitset have no index, test bit only
+				pos = bitset_test(c, eid) - 1;
+				if (pos < 0 && required) {
+					unsigned int nid = bitset_next(c, eid);
+					if (nid == 0) {
+						if (sorted)
+							return -1;
+					} else if (nid > next) {
+						next = nid;
+					}
+				}
+			} else if ((c->flags & POOL_SPARSE) && (pos = sparse_index_lookup(c, eid)) >= 0) {
+				// found
+			} else if (c->flags & POOL_SPARSE && !required) {
+				pos = -1;
+			} else {
+				pos = seek_component(c, eid);
+				if (pos >= c->n || c->id[pos] != eid) {
+					if (required) {
+						if (pos >= c->n) {
+							if (sorted)
+								return -1;
+						} else if (c->id[pos] > next) {
+							next = c->id[pos];
+						}
+					}
+					pos = -1;
+				}
+			}
+			if (k->attrib & COMPONENT_ABSENT) {
+				if (pos >= 0)
+					break;
+				index[j] = 0;
+			} else if (pos >= 0) {
+				index[j] = pos + 1;
+			} else if (required) {
+				break;
+			} else {
+				index[j] = 0;
+			}
+		}
+		if (j == iter->nkey)
+			return idx;
+		if (sorted && next > eid) {
+			idx = gallop_search(mpool->id, mpool->n, idx + 1, next);
+		} else {
+			++idx;
+		}
+	}
+}
+
+// A new run of iterator with changed keys, the changes after the last run are matched
+static inline void
+changed_begin(struct group_iter *iter) {
+	if (iter->changed) {
+		iter->since = iter->last_run;
+		iter->last_run = iter->world->change_version++;
+	}
+}
+
+// No row of a changed key is changed since the last run
+static int
+changed_none(struct group_iter *iter) {
+	int i;
+	for (i=0;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		if ((k->attrib & COMPONENT_CHANGED) && iter->world->c[k->id].stamp_max <= iter->since)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+changed_row(struct group_iter *iter, int idx, unsigned int index[MAX_COMPONENT]) {
+	int i;
+	for (i=0;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		if (k->attrib & COMPONENT_CHANGED) {
+			int row = (i == 0) ? idx : (int)index[i] - 1;
+			if (iter->world->c[k->id].stamp[row] <= iter->since)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// query_join, and skip the rows unchanged
+static int
+query_changed(struct group_iter *iter, int mainkey, int idx, unsigned int index[MAX_COMPONENT]) {
+	if (!iter->changed)
+		return query_join(iter, mainkey, idx, index);
+	if (changed_none(iter))
+		return -1;
+	while ((idx = query_join(iter, mainkey, idx, index)) >= 0 && !changed_row(iter, idx, index))
+		++idx;
+	return idx;
+}
+
+static void
+check_index(lua_State *L, struct group_iter *iter, int mainkey, int idx) {
+	int i;
+	for (i=0;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		if (k->attrib & COMPONENT_ABSENT) {
+			if (entity_sibling_index_(iter->world, mainkey, idx, k->id)) {
+				luaL_error(L, ".%s should be absent", k->name);
+			}
+		} else if (!is_temporary(k->attrib)) {
+			if (entity_sibling_index_(iter->world, mainkey, idx, k->id) == 0) {
+				if (!(k->attrib & COMPONENT_OPTIONAL)) {
+					luaL_error(L, ".%s not found", k->name);
+				}
+			}
+		}
+	}
+}
+
+// A struct component can be a view in select_view, instead of a copy in table
+static inline int
+is_view(struct group_iter *iter, struct group_key *k, struct field *f) {
+	return !(k->attrib & COMPONENT_FILTER) && (k->attrib & (COMPONENT_IN | COMPONENT_OUT))
+		&& iter->world->c[k->id].stride > 0 && k->field_n > 0 && f->key != NULL;
+}
+
+static void
+read_iter(lua_State *L, int world_index, int obj_index, struct group_iter *iter, unsigned int index[MAX_COMPONENT], int view) {
+	struct field *f = iter->f;
+	int i;
+	for (i=0;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		if (view && is_view(iter, k, f)) {
+			// set by view_group
+		} else if (!(k->attrib & COMPONENT_FILTER)) {
+			struct component_pool *c = &iter->world->c[k->id];
+			if (c->stride == STRIDE_LUA) {
+				// lua object component
+				if (index[i]) {
+					if (lua_getiuservalue(L, world_index, k->id * 2 + 2) != LUA_TTABLE) {
+						luaL_error(L, "Missing lua table for %d", k->id);
+					}
+
+					lua_rawgeti(L, -1, index[i]);
+					lua_setfield(L, obj_index, k->name);
+					lua_pop(L, 1);
+				} else {
+					lua_pushnil(L);
+					lua_setfield(L, obj_index, k->name);
+				}
+			} else if (c->stride != STRIDE_ORDER) {
+				if (k->attrib & COMPONENT_IN) {
+					if (index[i]) {
+						void *ptr = get_row(c, index[i]-1);
+						read_component_in_field(L, obj_index, k->name, k->field_n, f, ptr);
+					} else {
+						lua_pushnil(L);
+						lua_setfield(L, obj_index, k->name);
+					}
+				} else if (index[i] == 0 && !is_temporary(k->attrib)) {
+					lua_pushnil(L);
+					lua_setfield(L, obj_index, k->name);
+				}
+			}
+		}
+		f += k->field_n;
+	}
+}
+
+static int
+get_integer(lua_State *L, int index, int i, const char *key) {
+	if (lua_rawgeti(L, index, i) != LUA_TNUMBER) {
+		return luaL_error(L, "Can't find %s in iterator", key);
+	}
+	int r = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (r <= 0)
+		return luaL_error(L, "Invalid %s (%d)", key, r);
+	return r;
+}
+
+static int
+lsync(lua_State *L) {
+	struct group_iter *iter = luaL_checkudata(L, 2, "ENTITY_GROUPITER");
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int idx = get_integer(L, 3, 1, "index") - 1;
+	int mainkey = get_integer(L, 3, 2, "mainkey");
+	unsigned int index[MAX_COMPONENT];
+	int r = query_index(iter, 0, mainkey, idx, index);
+	if (r <= 0) {
+		if (r < 0) {
+			return luaL_error(L, "Invalid iterator of mainkey (%d)", mainkey);
+		} else {
+			check_index(L, iter, mainkey, idx);	// raise error
+			return 0;
+		}
+	}
+
+	if (!iter->readonly) {
+		update_iter(L, 1, 3, iter, idx, mainkey, 0);
+	}
+	read_iter(L, 1, 3, iter, index, 0);
+	return 0;
+}
+
+static int
+lread(lua_State *L) {
+	struct group_iter *iter = luaL_checkudata(L, 2, "ENTITY_GROUPITER");
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int idx = get_integer(L, 3, 1, "index") - 1;
+	int mainkey = get_integer(L, 3, 2, "mainkey");
+	unsigned int index[MAX_COMPONENT];
+	int r = query_index(iter, 0, mainkey, idx, index);
+	if (r <= 0) {
+		return 0;
+	}
+
+	if (!iter->readonly) {
+		return luaL_error(L, "Pattern is not readonly");
+	}
+	read_iter(L, 1, 3, iter, index, 0);
+	return 1;
+}
+
+static int
+postpone(lua_State *L, struct group_iter *iter, struct component_pool *c) {
+	int ret = 0;
+	if (c->stride == STRIDE_ORDER) {
+		if (lua_getfield(L, 2, iter->k[0].name) == LUA_TBOOLEAN) {
+			ret = (lua_toboolean(L, -1) == 0);
+			lua_pushnil(L);
+			lua_setfield(L, 2, iter->k[0].name);
+		}
+		lua_pop(L, 1);
+	}
+	return ret;
+}
+
+static unsigned int
+iter_stamp(struct group_iter *iter) {
+	unsigned int stamp = 0;
+	int i;
+	for (i=0;i<iter->nkey;i++) {
+		stamp += iter->world->c[iter->k[i].id].version;
+	}
+	return stamp;
+}
+
+// Find the first cached row from main index idx
+static int
+cache_query(struct group_iter *iter, int idx, unsigned int index[MAX_COMPONENT]) {
+	int nkey = iter->nkey;
+	unsigned int *cache = iter->cache;
+	int r = iter->cursor;
+	if (r > iter->cache_n || (r < iter->cache_n && cache[r * nkey] < idx) || (r > 0 && cache[(r-1) * nkey] >= idx)) {
+		int from = 0;
+		int to = iter->cache_n;
+		while (from < to) {
+			int mid = (from + to) / 2;
+			if (cache[mid * nkey] < idx)
+				from = mid + 1;
+			else
+				to = mid;
+		}
+		r = from;
+	}
+	if (r >= iter->cache_n)
+		return -1;
+	iter->cursor = r + 1;
+	unsigned int *row = &cache[r * nkey];
+	int i;
+	for (i=1;i<nkey;i++) {
+		index[i] = row[i];
+	}
+	return row[0];
+}
+
+// Record the rows of a live pass, it becomes the cache when the pass completes without structural change.
+// Only the pass after an unchanged one is recorded, so the patterns of changing pools don't pay for it.
+static void
+cache_record(lua_State *L, struct group_iter *iter, int i, int idx, unsigned int index[MAX_COMPONENT]) {
+	if (iter->world->c[iter->k[0].id].stride == STRIDE_ORDER)
+		return;
+	unsigned int stamp = iter_stamp(iter);
+	const void *owner = lua_topointer(L, 2);
+	if (i == 0) {
+		iter->cache_valid = 0;
+		if (stamp != iter->stamp) {
+			iter->stamp = stamp;
+			iter->record_n = -1;
+			return;
+		}
+		iter->record_n = 0;
+		iter->record_owner = owner;
+	}
+	if (stamp != iter->stamp || owner != iter->record_owner) {
+		iter->record_n = -1;
+		return;
+	}
+	if (idx < 0) {
+		iter->cache_valid = 1;
+		iter->cache_n = iter->record_n;
+		iter->cursor = 0;
+		iter->record_n = -1;
+		return;
+	}
+	int nkey = iter->nkey;
+	if (iter->record_n >= iter->cache_cap) {
+		int cap = iter->cache_cap * 2;
+		if (cap < 64)
+			cap = 64;
+		unsigned int *cache = (unsigned int *)lua_newuserdatauv(L, (size_t)cap * nkey * sizeof(unsigned int), 0);
+		if (iter->cache)
+			memcpy(cache, iter->cache, (size_t)iter->record_n * nkey * sizeof(unsigned int));
+		lua_setiuservalue(L, 1, 2);
+		iter->cache = cache;
+		iter->cache_cap = cap;
+	}
+	unsigned int *row = &iter->cache[iter->record_n * nkey];
+	row[0] = idx;
+	int j;
+	for (j=1;j<nkey;j++) {
+		row[j] = index[j];
+	}
+	++iter->record_n;
+}
+
+static int
+leach_group(lua_State *L) {
+	struct group_iter *iter = lua_touserdata(L, 1); 
+	if (lua_rawgeti(L, 2, 1) != LUA_TNUMBER) {
+		return luaL_error(L, "Invalid group iterator");
+	}
+	int i = lua_tointeger(L, -1);
+	if (i < 0)
+		return luaL_error(L, "Invalid iterator index %d", i);
+	lua_pop(L, 1);
+
+	if (lua_getiuservalue(L, 1, 1) != LUA_TUSERDATA) {
+		return luaL_error(L, "Missing world object for iterator");
+	}
+
+	int world_index = lua_gettop(L);
+
+	unsigned int index[MAX_COMPONENT];
+	int mainkey = iter->k[0].id;
+
+	struct component_pool *c = &iter->world->c[mainkey];
+	if (i>0) {
+		if (postpone(L, iter, c)) {
+			--i;
+			unsigned int tmp = c->id[i];
+			memmove(&c->id[i], &c->id[i+1], (c->n-i-1) * sizeof(c->id[0]));
+			c->id[c->n-1] = tmp;
+			++c->version;
+		} else if (!iter->readonly) {
+			update_last_index(L, world_index, 2, iter, i-1);
+		}
+	}
+	if (iter->changed && changed_none(iter))
+		return 0;
+	int idx;
+	for (;;) {
+		if (iter->cache_valid && iter->stamp == iter_stamp(iter)) {
+			idx = cache_query(iter, i, index);
+		} else {
+			idx = query_join(iter, mainkey, i, index);
+			if (i == 0 || iter->record_n >= 0)
+				cache_record(L, iter, i, idx, index);
+		}
+		if (idx < 0)
+			return 0;
+		if (!iter->changed || changed_row(iter, idx, index))
+			break;
+		i = idx + 1;
+	}
+	i = idx + 1;
+	index[0] = i;
+
+	lua_pushinteger(L, i);
+	lua_rawseti(L, 2, 1);
+
+	read_iter(L, world_index, 2, iter, index, 0);
+
+	lua_settop(L, 2);
+	return 1;
+}
+
+static void
+create_key_cache(lua_State *L, struct group_key *k, struct field *f) {
+	if (k->field_n == 0 // is tag or object?
+		|| (k->attrib & COMPONENT_FILTER)) {	// existence or ref
+		return;
+	}
+	if (k->field_n == 1 && f[0].key == NULL) {
+		// value type
+		switch (f[0].type) {
+		case TYPE_INT:
+		case TYPE_INT64:
+		case TYPE_DWORD:
+		case TYPE_WORD:
+		case TYPE_BYTE:
+			lua_pushinteger(L, 0);
+			break;
+		case TYPE_FLOAT:
+		case TYPE_DOUBLE:
+			lua_pushnumber(L, 0);
+			break;
+		case TYPE_BOOL:
+			lua_pushboolean(L, 0);
+			break;
+		case TYPE_USERDATA:
+			lua_pushlightuserdata(L, NULL);
+			break;
+		default:
+			lua_pushnil(L);
+			break;
+		}
+	} else {
+		lua_createtable(L, 0, k->field_n);
+	}
+	lua_setfield(L, -2, k->name);
+}
+
+// choose the smallest required pool to drive the join
+static int
+select_driver(struct group_iter *iter) {
+	struct entity_world *w = iter->world;
+	struct component_pool *c = &w->c[iter->k[0].id];
+	if (c->stride == STRIDE_ORDER)
+		return 0;
+	int driver = 0;
+	int n = c->n;
+	int i;
+	for (i=1;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		if (is_temporary(k->attrib) || (k->attrib & (COMPONENT_ABSENT | COMPONENT_OPTIONAL)))
+			continue;
+		c = &w->c[k->id];
+		if (c->flags & POOL_BITSET)
+			continue;
+		if (c->n < n) {
+			n = c->n;
+			driver = i;
+		}
+	}
+	return driver;
+}
+
+static int
+lpairs_group(lua_State *L) {
+	struct group_iter *iter = lua_touserdata(L, 1); 
+	iter->driver = select_driver(iter);
+	changed_begin(iter);
+	lua_pushcfunction(L, leach_group);
+	lua_pushvalue(L, 1);
+	lua_createtable(L, 2, iter->nkey);
+	int i;
+	int opt = 0;
+	struct field *f = iter->f;
+	for (i=0;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		create_key_cache(L, k, f);
+		f += k->field_n;
+		if (k->attrib & COMPONENT_OPTIONAL)
+			++opt;
+	}
+	if (opt) {
+		// create backup table in metatable
+		lua_createtable(L, 0, opt);
+		for (i=0;i<iter->nkey;i++) {
+			struct group_key *k = &iter->k[i];
+			if (k->attrib & COMPONENT_OPTIONAL) {
+				lua_getfield(L, -2, k->name);
+				lua_setfield(L, -2, k->name);
+			}
+		}
+		lua_setmetatable(L, -2);
+	}
+	lua_pushinteger(L, 0);
+	lua_rawseti(L, -2, 1);
+	lua_pushinteger(L, iter->k[0].id);	// mainkey
+	lua_rawseti(L, -2, 2);
+	return 3;		
+}
+
+static int
+check_boolean(lua_State *L, const char * key) {
+	int r = 0;
+	switch (lua_getfield(L, -1, key)) {
+	case LUA_TNIL:
+		break;
+	case LUA_TBOOLEAN:
+		r = lua_toboolean(L, -1);
+		break;
+	default:
+		return luaL_error(L, "Invalid boolean type %s", lua_typename(L, lua_type(L, -1)));
+	}
+	lua_pop(L, 1);
+	return r;
+}
+
+static int
+is_value(lua_State *L, struct field *f) {
+	switch (lua_getfield(L, -1, "type")) {
+	case LUA_TNIL:
+		lua_pop(L, 1);
+		return 0;
+	case LUA_TNUMBER:
+		f->key = NULL;
+		f->offset = 0;
+		f->type = check_type(L);
+		f->run = 1;
+		return 1;
+	default:
+		return luaL_error(L, "Invalid value type %s", lua_typename(L, lua_type(L, -1)));
+	}
+}
+
+static int
+get_key(struct entity_world *w, lua_State *L, struct group_key *key, struct field *f) {
+	if (lua_getfield(L, -1, "id") != LUA_TNUMBER) {
+		return luaL_error(L, "Invalid id");
+	}
+	key->id = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (key->id < 0 || key->id >= MAX_COMPONENT || w->c[key->id].cap == 0) {
+		return luaL_error(L, "Invalid id %d", key->id);
+	}
+	if (lua_getfield(L, -1, "name") != LUA_TSTRING) {
+		return luaL_error(L, "Invalid component name");
+	}
+	key->name = lua_tostring(L, -1);
+	lua_pop(L, 1);
+	int attrib = 0;
+	if (check_boolean(L, "r")) {
+		attrib |= COMPONENT_IN;
+	}
+	if (check_boolean(L, "w")) {
+		attrib |= COMPONENT_OUT;
+	}
+	if (check_boolean(L, "opt")) {
+		attrib |= COMPONENT_OPTIONAL;
+	}
+	if (check_boolean(L, "exist")) {
+		attrib |= COMPONENT_EXIST;
+	}
+	if (check_boolean(L, "absent")) {
+		attrib |= COMPONENT_ABSENT;
+	}
+	if (check_boolean(L, "changed")) {
+		attrib |= COMPONENT_CHANGED;
+	}
+	key->attrib = attrib;
+	if (is_value(L, f)) {
+		key->field_n = 1;
+		return 1;
+	} else {
+		int i = 0;
+		int ttype;
+		while ((ttype = lua_geti(L, -1, i+1)) != LUA_TNIL) {
+			if (ttype != LUA_TTABLE) {
+				return luaL_error(L, "Invalid field %d", i+1);
+			}
+			get_field(L, i+1, &f[i]);
+			++i;
+		}
+		compile_fields(f, i);
+		key->field_n = i;
+		lua_pop(L, 1);
+		return i;
+	}
+}
+
+static int
+lgroupiter(lua_State *L) {
+	struct entity_world *w = getW(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int nkey = get_len(L, 2);
+	int field_n = 0;
+	int i;
+	if (nkey == 0) {
+		return luaL_error(L, "At least one key");
+	}
+	if (nkey > MAX_COMPONENT) {
+		return luaL_error(L, "Too many keys");
+	}
+	for (i=0;i<nkey;i++) {
+		if (lua_geti(L, 2, i+1) != LUA_TTABLE) {
+			return luaL_error(L, "index %d is not a table", i);
+		}
+		int n = get_len(L, -1);
+		if (n == 0) {
+			struct field f;
+			if (is_value(L, &f)) {
+				n = 1;
+			}
+		}
+		field_n += n;
+		lua_pop(L, 1);
+	}
+	size_t header_size = sizeof(struct group_iter) + sizeof(struct group_key) * (nkey-1);
+	const int align_size = sizeof(void *);
+	// align
+	header_size = (header_size + align_size - 1) & ~(align_size - 1);
+	size_t size = header_size + field_n * sizeof(struct field);
+	struct group_iter *iter = (struct group_iter *)lua_newuserdatauv(L, size, 2);
+	// refer world
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, -2, 1);
+	iter->nkey = nkey;
+	iter->world = w;
+	iter->readonly = 1;
+	iter->driver = 0;
+	iter->stamp = 0;
+	iter->cache_valid = 0;
+	iter->cache_n = 0;
+	iter->cache_cap = 0;
+	iter->cursor = 0;
+	iter->record_n = -1;
+	iter->record_owner = NULL;
+	iter->cache = NULL;
+	iter->changed = 0;
+	iter->since = 0;
+	iter->last_run = 0;
+	struct field *f = (struct field *)((char *)iter + header_size);
+	iter->f = f;
+	for (i=0; i< nkey; i++) {
+		lua_geti(L, 2, i+1);
+		int n = get_key(w, L, &iter->k[i], f);
+		struct component_pool *c = &w->c[iter->k[i].id];
+		if (c->stride == STRIDE_TAG && is_temporary(iter->k[i].attrib)) {
+			return luaL_error(L, "%s is a tag, use %s?out instead", iter->k[i].name, iter->k[i].name);
+		}
+		f += n;
+		lua_pop(L, 1);
+		if (c->stride == STRIDE_LUA) {
+			if (n != 0)
+				return luaL_error(L, ".%s is object component, no fields needed", iter->k[i].name);
+			iter->k[i].attrib |= COMPONENT_OBJECT;
+		} else if (c->stride == STRIDE_ORDER) {
+			if (i != 0) {
+				if (!is_temporary(iter->k[i].attrib)) {
+					return luaL_error(L, ".%s is an order key, must be main key or temporary", iter->k[i].name);
+				}
+			} else if (!(iter->k[0].attrib & COMPONENT_EXIST)) {
+				return luaL_error(L, ".%s is an order key, it can only be exist", iter->k[0].name);
+			}
+		}
+		int attrib = iter->k[i].attrib;
+		if (attrib & COMPONENT_CHANGED) {
+			if (c->stride <= 0)
+				return luaL_error(L, ".%s isn't a value component, it can't be changed", iter->k[i].name);
+			stamp_track(L, w, c);
+			++iter->changed;
+		}
+		if (!(attrib & COMPONENT_FILTER)) {
+			int readonly = (attrib & COMPONENT_IN) && !(attrib & COMPONENT_OUT);
+			if (!readonly)
+				iter->readonly = 0;
+		}
+	}
+	int mainkey_attrib = iter->k[0].attrib;
+	if (mainkey_attrib & COMPONENT_ABSENT) {
+		return luaL_error(L, "The main key can't be absent");
+	}
+	if (luaL_newmetatable(L, "ENTITY_GROUPITER")) {
+		lua_pushcfunction(L, lpairs_group);
+		lua_setfield(L, -2, "__call");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+// Chunk iteration, up to n entities at a time and each field is an array in the chunk table.
+// chunk[1] : main index to continue, chunk[2] : max count, chunk[3] : matched rows, chunk[4] : stamp of rows, chunk.n : count
+
+// Push the arrays of key k, one for each field, or one for the value, object or tag. Returns the number of arrays.
+static int
+chunk_arrays(lua_State *L, int chunk_index, struct group_key *k, struct field *f) {
+	luaL_checkstack(L, k->field_n + 2, NULL);
+	if (lua_getfield(L, chunk_index, k->name) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, chunk_index, k->name);
+	}
+	if (k->field_n == 0 || f->key == NULL)
+		return 1;
+	int t = lua_gettop(L);
+	int i;
+	for (i=0;i<k->field_n;i++) {
+		if (lua_getfield(L, t, f[i].key) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, t, f[i].key);
+		}
+	}
+	lua_remove(L, t);
+	return k->field_n;
+}
+
+static void
+chunk_read(lua_State *L, int world_index, int chunk_index, struct group_iter *iter, unsigned int *rows, int n, int last_n) {
+	int nkey = iter->nkey;
+	struct field *f = iter->f;
+	int i, j, x;
+	for (j=0;j<nkey;j++) {
+		struct group_key *k = &iter->k[j];
+		if (k->attrib & COMPONENT_FILTER) {
+			f += k->field_n;
+			continue;
+		}
+		struct component_pool *c = &iter->world->c[k->id];
+		int na = chunk_arrays(L, chunk_index, k, f);
+		int base = lua_gettop(L) - na + 1;
+		if (!(k->attrib & COMPONENT_IN)) {
+			// out only, the entries left nil are not written back
+			for (x=0;x<na;x++) {
+				for (i=0;i<last_n;i++) {
+					lua_pushnil(L);
+					lua_rawseti(L, base + x, i + 1);
+				}
+			}
+		} else if (c->stride == STRIDE_LUA) {
+			if (lua_getiuservalue(L, world_index, k->id * 2 + 2) != LUA_TTABLE) {
+				luaL_error(L, "Missing lua table for %d", k->id);
+			}
+			for (i=0;i<n;i++) {
+				unsigned int index = rows[i * nkey + j];
+				if (index)
+					lua_rawgeti(L, -1, index);
+				else
+					lua_pushnil(L);
+				lua_rawseti(L, base, i + 1);
+			}
+			lua_pop(L, 1);
+		} else if (c->stride == STRIDE_TAG) {
+			for (i=0;i<n;i++) {
+				lua_pushboolean(L, rows[i * nkey + j] != 0);
+				lua_rawseti(L, base, i + 1);
+			}
+		} else {
+			for (i=0;i<n;i++) {
+				unsigned int index = rows[i * nkey + j];
+				if (index) {
+					const char *ptr = (const char *)get_row(c, index - 1);
+					for (x=0;x<na;x++) {
+						read_value(L, &f[x], ptr);
+						lua_rawseti(L, base + x, i + 1);
+					}
+				} else {
+					for (x=0;x<na;x++) {
+						lua_pushnil(L);
+						lua_rawseti(L, base + x, i + 1);
+					}
+				}
+			}
+		}
+		// clear the rest of last chunk
+		for (x=0;x<na;x++) {
+			for (i=n;i<last_n;i++) {
+				lua_pushnil(L);
+				lua_rawseti(L, base + x, i + 1);
+			}
+		}
+		lua_settop(L, base - 1);
+		f += k->field_n;
+	}
+}
+
+static void
+chunk_write(lua_State *L, int world_index, int chunk_index, struct group_iter *iter, unsigned int *rows, int n) {
+	int nkey = iter->nkey;
+	struct field *f = iter->f;
+	int i, j, x;
+	for (j=0;j<nkey;j++) {
+		struct group_key *k = &iter->k[j];
+		if ((k->attrib & COMPONENT_FILTER) || !(k->attrib & COMPONENT_OUT)) {
+			f += k->field_n;
+			continue;
+		}
+		struct component_pool *c = &iter->world->c[k->id];
+		int na = chunk_arrays(L, chunk_index, k, f);
+		int base = lua_gettop(L) - na + 1;
+		if (c->stride == STRIDE_LUA) {
+			if (lua_getiuservalue(L, world_index, k->id * 2 + 2) != LUA_TTABLE) {
+				luaL_error(L, "Missing lua table for %d", k->id);
+			}
+			for (i=0;i<n;i++) {
+				unsigned int index = rows[i * nkey + j];
+				if (index && lua_rawgeti(L, base, i + 1) != LUA_TNIL) {
+					lua_rawseti(L, -2, index);
+				} else {
+					lua_pop(L, 1);
+				}
+			}
+		} else {
+			for (i=0;i<n;i++) {
+				unsigned int index = rows[i * nkey + j];
+				if (index == 0)
+					continue;
+				struct row_write rw;
+				char *ptr = (char *)row_write_begin(c, index - 1, &rw);
+				for (x=0;x<na;x++) {
+					if (lua_rawgeti(L, base + x, i + 1) == LUA_TNIL)
+						lua_pop(L, 1);
+					else
+						write_value(L, &f[x], ptr);
+				}
+				row_write_end(iter->world, c, index - 1, &rw);
+			}
+		}
+		lua_settop(L, base - 1);
+		f += k->field_n;
+	}
+}
+
+static int
+lchunk_group(lua_State *L) {
+	struct group_iter *iter = lua_touserdata(L, 1);
+	int start = get_integer(L, 2, 1, "index") - 1;
+	int cap = get_integer(L, 2, 2, "size");
+	if (lua_rawgeti(L, 2, 3) != LUA_TUSERDATA)
+		return luaL_error(L, "Invalid chunk");
+	unsigned int *rows = (unsigned int *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (lua_getfield(L, 2, "n") != LUA_TNUMBER)
+		return luaL_error(L, "Invalid chunk");
+	int last_n = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (lua_getiuservalue(L, 1, 1) != LUA_TUSERDATA)
+		return luaL_error(L, "Missing world object for iterator");
+	int world_index = lua_gettop(L);
+	if (last_n > 0 && !iter->readonly) {
+		lua_rawgeti(L, 2, 4);
+		unsigned int stamp = (unsigned int)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (stamp != iter_stamp(iter))
+			return luaL_error(L, "The pools of %s are changed during select_chunk", iter->k[0].name);
+		chunk_write(L, world_index, 2, iter, rows, last_n);
+	}
+	int nkey = iter->nkey;
+	int mainkey = iter->k[0].id;
+	unsigned int index[MAX_COMPONENT];
+	int n = 0;
+	int idx = start;
+	while (n < cap && (idx = query_changed(iter, mainkey, idx, index)) >= 0) {
+		unsigned int *row = &rows[n * nkey];
+		row[0] = idx + 1;
+		int j;
+		for (j=1;j<nkey;j++) {
+			row[j] = index[j];
+		}
+		++n;
+		++idx;
+		start = idx;
+	}
+	chunk_read(L, world_index, 2, iter, rows, n, last_n);
+	lua_pushinteger(L, n);
+	lua_setfield(L, 2, "n");
+	if (n == 0)
+		return 0;
+	lua_pushinteger(L, start + 1);
+	lua_rawseti(L, 2, 1);
+	lua_pushinteger(L, (lua_Integer)iter_stamp(iter));
+	lua_rawseti(L, 2, 4);
+	lua_settop(L, 2);
+	return 1;
+}
+
+// world, iter, n
+static int
+lchunk_iter(lua_State *L) {
+	struct group_iter *iter = luaL_checkudata(L, 2, "ENTITY_GROUPITER");
+	int cap = luaL_checkinteger(L, 3);
+	if (cap <= 0)
+		return luaL_error(L, "Invalid chunk size %d", cap);
+	int i;
+	for (i=0;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		struct component_pool *c = &iter->world->c[k->id];
+		if (k->attrib & COMPONENT_FILTER)
+			continue;
+		if (is_temporary(k->attrib))
+			return luaL_error(L, "Can't create .%s in select_chunk", k->name);
+		if ((c->stride == STRIDE_TAG || c->stride == STRIDE_ORDER) && (k->attrib & COMPONENT_OUT))
+			return luaL_error(L, "Can't write tag .%s in select_chunk", k->name);
+	}
+	if (iter->world->c[iter->k[0].id].stride == STRIDE_ORDER)
+		return luaL_error(L, "Order key .%s can't be the main key of select_chunk", iter->k[0].name);
+	iter->driver = select_driver(iter);
+	changed_begin(iter);
+	lua_pushcfunction(L, lchunk_group);
+	lua_pushvalue(L, 2);
+	lua_createtable(L, 4, iter->nkey + 1);
+	lua_pushinteger(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_pushinteger(L, cap);
+	lua_rawseti(L, -2, 2);
+	lua_newuserdatauv(L, (size_t)cap * iter->nkey * sizeof(unsigned int), 0);
+	lua_rawseti(L, -2, 3);
+	lua_pushinteger(L, 0);
+	lua_rawseti(L, -2, 4);
+	lua_pushinteger(L, 0);
+	lua_setfield(L, -2, "n");
+	return 3;
+}
+
+// Views of struct components point into the pool, v.field reads or writes the component directly.
+// There is one view for each key of iterator, it moves to the row of each step, so it's only valid in the
+// current step. It's invalid after the structural change of its pool, or the end of iteration.
+struct component_view {
+	struct entity_world *world;
+	struct field *f;
+	int cid;
+	int index;
+	int field_n;
+	int writable;
+	unsigned int version;
+};
+
+static struct component_view *
+check_view(lua_State *L, struct field **f) {
+	struct component_view *v = (struct component_view *)lua_touserdata(L, 1);
+	struct component_pool *c = &v->world->c[v->cid];
+	if (v->index < 0)
+		luaL_error(L, "The view of pool %d is used out of iteration", v->cid);
+	if (v->version != c->version || v->index >= c->n)
+		luaL_error(L, "The view is invalid after the change of pool %d", v->cid);
+	const char *key = lua_tostring(L, 2);
+	if (key == NULL)
+		luaL_error(L, "Invalid field of view");
+	int i;
+	for (i=0;i<v->field_n;i++) {
+		// short strings are interned
+		if (v->f[i].key == key || strcmp(v->f[i].key, key) == 0) {
+			*f = &v->f[i];
+			return v;
+		}
+	}
+	luaL_error(L, "Invalid field .%s", key);
+	return NULL;
+}
+
+// The base address, so base + f->offset is the field
+static inline char *
+view_base(struct component_view *v, struct field *f) {
+	struct component_pool *c = &v->world->c[v->cid];
+	if (c->flags & POOL_SOA) {
+		int i = (int)(f - v->f);
+		return (char *)soa_column(c, i) + (size_t)c->soa[i].size * v->index - f->offset;
+	}
+	return (char *)get_ptr(c, v->index);
+}
+
+static int
+lview_index(lua_State *L) {
+	struct field *f;
+	struct component_view *v = check_view(L, &f);
+	read_value(L, f, view_base(v, f));
+	return 1;
+}
+
+static int
+lview_newindex(lua_State *L) {
+	struct field *f;
+	struct component_view *v = check_view(L, &f);
+	if (!v->writable)
+		return luaL_error(L, "The view of pool %d is readonly", v->cid);
+	lua_settop(L, 3);
+	write_value(L, f, view_base(v, f));
+	stamp_row(v->world, &v->world->c[v->cid], v->index);
+	return 0;
+}
+
+// The end of iteration, the views kept after the loop can't be used
+static void
+view_invalidate(lua_State *L, struct group_iter *iter) {
+	int slot = 3;
+	struct field *f = iter->f;
+	int j;
+	for (j=0;j<iter->nkey;j++) {
+		struct group_key *k = &iter->k[j];
+		if (is_view(iter, k, f)) {
+			if (lua_rawgeti(L, 2, slot++) == LUA_TUSERDATA) {
+				struct component_view *v = (struct component_view *)lua_touserdata(L, -1);
+				v->index = -1;
+			}
+			lua_pop(L, 1);
+		}
+		f += k->field_n;
+	}
+}
+
+static int
+lview_group(lua_State *L) {
+	struct group_iter *iter = lua_touserdata(L, 1);
+	// [1] : index + 1 of the last one, [2] : mainkey, the same as select
+	if (lua_rawgeti(L, 2, 1) != LUA_TNUMBER)
+		return luaL_error(L, "Invalid group iterator");
+	int i = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (lua_getiuservalue(L, 1, 1) != LUA_TUSERDATA)
+		return luaL_error(L, "Missing world object for iterator");
+	int world_index = lua_gettop(L);
+	unsigned int index[MAX_COMPONENT];
+	int mainkey = iter->k[0].id;
+	int idx = query_changed(iter, mainkey, i, index);
+	if (idx < 0) {
+		view_invalidate(L, iter);
+		return 0;
+	}
+	index[0] = idx + 1;
+	lua_pushinteger(L, idx + 1);
+	lua_rawseti(L, 2, 1);
+	read_iter(L, world_index, 2, iter, index, 1);
+	struct field *f = iter->f;
+	int j;
+	int slot = 3;
+	for (j=0;j<iter->nkey;j++) {
+		struct group_key *k = &iter->k[j];
+		if (is_view(iter, k, f)) {
+			if (index[j]) {
+				lua_rawgeti(L, 2, slot);
+				struct component_view *v = (struct component_view *)lua_touserdata(L, -1);
+				v->index = index[j] - 1;
+				v->version = iter->world->c[k->id].version;
+			} else {
+				lua_pushnil(L);
+			}
+			lua_setfield(L, 2, k->name);
+			++slot;
+		}
+		f += k->field_n;
+	}
+	lua_settop(L, 2);
+	return 1;
+}
+
+// world, iter
+static int
+lview_iter(lua_State *L) {
+	struct group_iter *iter = luaL_checkudata(L, 2, "ENTITY_GROUPITER");
+	if (iter->world->c[iter->k[0].id].stride == STRIDE_ORDER)
+		return luaL_error(L, "Order key .%s can't be the main key of select_view", iter->k[0].name);
+	struct field *f = iter->f;
+	int i;
+	for (i=0;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		if (!is_view(iter, k, f) && !(k->attrib & COMPONENT_FILTER)
+			&& ((k->attrib & COMPONENT_OUT) || is_temporary(k->attrib)))
+			return luaL_error(L, "Only struct .%s can be written in select_view", k->name);
+		f += k->field_n;
+	}
+	iter->driver = select_driver(iter);
+	changed_begin(iter);
+	lua_pushcfunction(L, lview_group);
+	lua_pushvalue(L, 2);
+	lua_createtable(L, 2 + iter->nkey, iter->nkey);
+	lua_pushinteger(L, 0);
+	lua_rawseti(L, -2, 1);
+	lua_pushinteger(L, iter->k[0].id);
+	lua_rawseti(L, -2, 2);
+	f = iter->f;
+	int slot = 3;
+	for (i=0;i<iter->nkey;i++) {
+		struct group_key *k = &iter->k[i];
+		if (is_view(iter, k, f)) {
+			struct component_view *v = (struct component_view *)lua_newuserdatauv(L, sizeof(*v), 1);
+			v->world = iter->world;
+			v->f = f;
+			v->cid = k->id;
+			v->index = -1;
+			v->field_n = k->field_n;
+			v->writable = (k->attrib & COMPONENT_OUT) != 0;
+			v->version = 0;
+			// keep the fields alive
+			lua_pushvalue(L, 2);
+			lua_setiuservalue(L, -2, 1);
+			if (luaL_newmetatable(L, "ENTITY_VIEW")) {
+				lua_pushcfunction(L, lview_index);
+				lua_setfield(L, -2, "__index");
+				lua_pushcfunction(L, lview_newindex);
+				lua_setfield(L, -2, "__newindex");
+			}
+			lua_setmetatable(L, -2);
+			lua_rawseti(L, -2, slot++);
+		}
+		f += k->field_n;
+	}
+	return 3;
+}
+
+static int
+lremove(lua_State *L) {
+	struct entity_world *w = getW(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int iter = get_integer(L, 2, 1, "index") - 1;
+	int mainkey = get_integer(L, 2, 2, "mainkey");
+	entity_remove_(w, mainkey, iter, L, 1);
+	return 0;
+}
+
+static int
+lobject(lua_State *L) {
+	struct group_iter *iter = luaL_checkudata(L, 1, "ENTITY_GROUPITER");
+	int index = luaL_checkinteger(L, 3) - 1;
+	int cid = iter->k[0].id;
+	struct entity_world * w = iter->world;
+	if (cid < 0 || cid >=MAX_COMPONENT) {
+		return luaL_error(L, "Invalid object %d", cid);
+	}
+	lua_settop(L, 2);
+	struct component_pool *c = &w->c[cid];
+	if (c->n <= index) {
+		return luaL_error(L, "No object %d", cid);
+	}
+	if (c->stride == STRIDE_LUA) {
+		// lua object
+		if (lua_getiuservalue(L, 1, 1) != LUA_TUSERDATA) {
+			return luaL_error(L, "No world");
+		}
+		if (lua_getiuservalue(L, -1, cid * 2 + 2) != LUA_TTABLE) {
+			return luaL_error(L, "Missing lua table for %d", cid);
+		}
+		if (lua_isnil(L, 2)) {
+			lua_rawgeti(L, -1, index + 1);
+		} else {
+			lua_pushvalue(L, 2);
+			lua_rawseti(L, -2, index + 1);
+			lua_settop(L, 2);
+		}
+		return 1;
+	} else if (c->stride == 0) {
+		if (lua_type(L, 2) != LUA_TBOOLEAN)
+			return luaL_error(L, "%s is a tag, need boolean", iter->k[0].name);
+		if (!lua_toboolean(L, 2)) {
+			entity_disable_tag_(w, cid, index, cid);
+		}
+		return 1;
+	} else if (c->stride < 0) {
+		return luaL_error(L, "Invalid object %d", cid);
+	}
+	struct field *f = iter->f;
+	if (lua_isnoneornil(L, 2)) {
+		// read object
+		void * buffer = get_row(c, index);
+		if (f->key == NULL) {
+			// value type
+			read_value(L, f, buffer);
+		} else {
+			lua_createtable(L, 0, iter->k[0].field_n);
+			int lua_index = lua_gettop(L);
+			read_component(L, iter->k[0].field_n, f, lua_index, buffer);
+		}
+	} else {
+		// write object
+		struct row_write rw;
+		lua_pushvalue(L, 2);
+		write_component_object(L, iter->k[0].field_n, f, row_write_begin(c, index, &rw));
+		row_write_end(w, c, index, &rw);
+	}
+	return 1;
+}
+
+// iter, values, index, count : values[i] is the object at index + i - 1, the new rows of new_batch
+static int
+lobjects(lua_State *L) {
+	struct group_iter *iter = luaL_checkudata(L, 1, "ENTITY_GROUPITER");
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int index = luaL_checkinteger(L, 3) - 1;
+	int count = luaL_checkinteger(L, 4);
+	int cid = iter->k[0].id;
+	struct entity_world * w = iter->world;
+	struct component_pool *c = &w->c[cid];
+	if (index < 0 || count < 0 || index + count > c->n)
+		return luaL_error(L, "Invalid range of type %d", cid);
+	lua_settop(L, 2);
+	int i;
+	if (c->stride == STRIDE_LUA) {
+		if (lua_getiuservalue(L, 1, 1) != LUA_TUSERDATA) {
+			return luaL_error(L, "No world");
+		}
+		if (lua_getiuservalue(L, -1, cid * 2 + 2) != LUA_TTABLE) {
+			return luaL_error(L, "Missing lua table for %d", cid);
+		}
+		for (i=0;i<count;i++) {
+			lua_rawgeti(L, 2, i + 1);
+			lua_rawseti(L, -2, index + i + 1);
+		}
+		return 0;
+	} else if (c->stride <= 0) {
+		return luaL_error(L, "Invalid object %d", cid);
+	}
+	struct field *f = iter->f;
+	for (i=0;i<count;i++) {
+		if (lua_rawgeti(L, 2, i + 1) != LUA_TNIL) {
+			// the new rows are stamped already
+			write_component_object(L, iter->k[0].field_n, f, get_row(c, index + i));
+			commit_row(c, index + i);
+		}
+		lua_settop(L, 2);
+	}
+	return 0;
+}
+
+static int
+lrelease(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int cid = check_cid(L, w, 2);
+	int refid = luaL_checkinteger(L, 3) - 1;
+	int dead_tag = cid + 1;
+	entity_enable_tag_(w, cid, refid, dead_tag, L, 1);
+	return 0;
+}
+
+static int
+lreuse(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int cid = check_cid(L, w, 2);
+	int dead_tagid = cid + 1;
+	struct component_pool *c = &w->c[dead_tagid];
+	if (c->stride != STRIDE_TAG) {
+		return luaL_error(L, "%d is not a tag", dead_tagid);
+	}
+	if (entity_iter_(w, dead_tagid, 0) == NULL)
+		return 0;
+	int id = entity_sibling_index_(w, dead_tagid, 0, cid);
+	if (id == 0)
+		return luaL_error(L, "Invalid ref component %d", cid);
+	entity_disable_tag_(w, dead_tagid, 0, dead_tagid);
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+static int
+find_boundary(int from, int to, unsigned int *a, unsigned int eid) {
+	while(from < to) {
+		int mid = (from + to)/2;
+		unsigned int aa = a[mid];
+		if (aa == eid)
+			return mid;
+		else if (aa < eid) {
+			from = mid + 1;
+		} else {
+			to = mid;
+		}
+	}
+	return to;
+}
+
+static inline int
+next_removed_index(int removed_index, struct component_pool *removed, unsigned int *removed_eid) {
+	for (;;) {
+		++removed_index;
+		if (removed_index >= removed->n) {
+			*removed_eid = 0;
+			break;
+		}
+		unsigned int last_eid = *removed_eid;
+		*removed_eid = removed->id[removed_index];
+		if (*removed_eid != last_eid)
+			break;
+	}
+	return removed_index;
+}
+
+// remove reference object where id == 0
+static void
+remove_unused_reference(lua_State *L, struct component_pool *c, int from) {
+	int i;
+	int to = from;
+	for (i=from; i < c->n; i++) {
+		if (c->id[i]) {
+			c->id[to] = c->id[i];
+			sparse_index_move(c, to);
+			lua_geti(L, -1, i+1);
+			lua_seti(L, -2, to+1);
+			++to;
+		}
+	}
+	for (i=to;i<=c->n;i++) {
+		lua_pushnil(L);
+		lua_seti(L, -2, i+1);
+	}
+	c->n = to;
+	++c->version;
+}
+
+static int
+lupdate_reference(lua_State *L) {
+	struct entity_world *w = getW(L);
+	struct component_pool *removed = &w->c[ENTITY_REMOVED];
+	if (removed->n == 0)	// no removed entity
+		return 0;
+	int cid = check_cid(L, w, 2);
+	struct component_pool *reference = &w->c[cid];
+	if (reference->n == 0)
+		return 0;	// no reference
+	if (lua_getiuservalue(L, 1, cid * 2 + 2) != LUA_TTABLE) {
+		return luaL_error(L, "Invalid reference component %d", cid);
+	}
+	int i;
+	int removed_index = 0;
+	unsigned int removed_eid = removed->id[removed_index];
+	int index = find_boundary(0, reference->n, reference->id, removed_eid);
+	int reference_index = index + 1;
+	int removed_reference = 0;
+	for (i=index; i< reference->n; i++) {
+		int rtype = lua_geti(L, -1, i+1);
+		if (rtype != LUA_TBOOLEAN && rtype != LUA_TTABLE) {
+			// false means removed reference
+			return luaL_error(L, "Invalid reference object");
+		}
+		if (removed_eid) {
+			while (removed_eid < reference->id[i]) {
+				removed_index = next_removed_index(removed_index, removed, &removed_eid);
+			}
 		}
-		f += k->field_n;
+		if (removed_eid == reference->id[i]) {
+			// removed reference, clear reference id
+			lua_pushnil(L);
+			removed_index = next_removed_index(removed_index, removed, &removed_eid);
+		} else {
+			// update reference id
+			lua_pushinteger(L, reference_index);
+			++reference_index;
+		}
+		if (rtype == LUA_TBOOLEAN) {
+			// set id = 0, so removed_reference() can remove them
+			--reference_index;
+			reference->id[i] = 0;
+			++reference->version;
+			if (removed_reference == 0) {
+				removed_reference = i + 1;
+			}
+			lua_pop(L, 2);
+		} else {
+			lua_seti(L, -2, 1);
+			lua_pop(L, 1);
+		}
+	}
+	if (removed_reference) {
+		remove_unused_reference(L, reference, removed_reference - 1);
 	}
+	return 0;
 }
 
-static int
-get_integer(lua_State *L, int index, int i, const char *key) {
-	if (lua_rawgeti(L, index, i) != LUA_TNUMBER) {
-		return luaL_error(L, "Can't find %s in iterator", key);
-	}
-	int r = lua_tointeger(L, -1);
-	lua_pop(L, 1);
-	if (r <= 0)
-		return luaL_error(L, "Invalid %s (%d)", key, r);
-	return r;
+// Snapshot of world : header, schema, then each non-empty pool as { snapshot_pool, id[n], data }, then handle slots.
+// All the sections are in native byte order and padded to SNAPSHOT_ALIGN. The data of a soa pool starts at
+// an offset aligned to SOA_ALIGN, and its columns are padded to SOA_ALIGN, so the columns of a mapped image
+// are aligned as the ones in memory.
+
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN 8
+#define SNAPSHOT_ORDER 0x01020304
+
+static const char snapshot_magic[8] = "LUAECS";
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;	// SNAPSHOT_ORDER in the byte order of writer
+	uint32_t max_id;
+	int32_t handle_cid;
+	uint32_t rearrange_from;
+	uint32_t rearrange_id;
+	int32_t rearrange_budget;
+	int32_t pool_n;
+	int32_t slot_n;
+	int32_t slot_free;
+	uint64_t schema_size;	// the schema string follows the header
+};
+
+struct snapshot_pool {
+	int32_t cid;
+	int32_t n;
+	int32_t stride;
+	int32_t flags;
+	uint64_t size;	// bytes of data after id[n], the columns of soa pool are padded each
+};
+
+struct snapshot_writer {
+	int index;	// the writer function
+	size_t pos;
+};
+
+static inline size_t
+snapshot_align(size_t sz) {
+	return (sz + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
 }
 
-static int
-lsync(lua_State *L) {
-	struct group_iter *iter = luaL_checkudata(L, 2, "ENTITY_GROUPITER");
-	luaL_checktype(L, 3, LUA_TTABLE);
-	int idx = get_integer(L, 3, 1, "index") - 1;
-	int mainkey = get_integer(L, 3, 2, "mainkey");
-	unsigned int index[MAX_COMPONENT];
-	int r = query_index(iter, 0, mainkey, idx, index);
-	if (r <= 0) {
-		if (r < 0) {
-			return luaL_error(L, "Invalid iterator of mainkey (%d)", mainkey);
-		} else {
-			check_index(L, iter, mainkey, idx);	// raise error
-			return 0;
-		}
+static void
+snapshot_write(lua_State *L, struct snapshot_writer *sw, const void *data, size_t sz) {
+	static const char zero[SNAPSHOT_ALIGN] = { 0 };
+	if (sz > 0) {
+		lua_pushvalue(L, sw->index);
+		lua_pushlstring(L, (const char *)data, sz);
+		lua_call(L, 1, 0);
 	}
-
-	if (!iter->readonly) {
-		update_iter(L, 1, 3, iter, idx, mainkey, 0);
+	size_t pad = snapshot_align(sz) - sz;
+	if (pad > 0) {
+		lua_pushvalue(L, sw->index);
+		lua_pushlstring(L, zero, pad);
+		lua_call(L, 1, 0);
 	}
-	read_iter(L, 1, 3, iter, index);
-	return 0;
+	sw->pos += sz + pad;
 }
 
-static int
-lread(lua_State *L) {
-	struct group_iter *iter = luaL_checkudata(L, 2, "ENTITY_GROUPITER");
-	luaL_checktype(L, 3, LUA_TTABLE);
-	int idx = get_integer(L, 3, 1, "index") - 1;
-	int mainkey = get_integer(L, 3, 2, "mainkey");
-	unsigned int index[MAX_COMPONENT];
-	int r = query_index(iter, 0, mainkey, idx, index);
-	if (r <= 0) {
+// Pad the stream to SOA_ALIGN
+static void
+snapshot_write_soa_pad(lua_State *L, struct snapshot_writer *sw) {
+	static const char zero[SOA_ALIGN] = { 0 };
+	size_t pad = (SOA_ALIGN - sw->pos % SOA_ALIGN) % SOA_ALIGN;
+	if (pad > 0)
+		snapshot_write(L, sw, zero, pad);
+}
+
+static uint64_t
+snapshot_data_size(struct component_pool *c) {
+	if (c->stride <= 0)
 		return 0;
+	if (c->flags & POOL_SOA) {
+		uint64_t sz = 0;
+		int i;
+		for (i=0;i<c->soa_n;i++) {
+			sz += soa_column_size(c->n, c->soa[i].size);
+		}
+		return sz;
 	}
+	return (uint64_t)c->n * c->stride;
+}
 
-	if (!iter->readonly) {
-		return luaL_error(L, "Pattern is not readonly");
+// Each lua object is encode(cid, object) as { uint32 size, bytes }
+static void
+snapshot_write_lua(lua_State *L, int world_index, struct snapshot_writer *writer, int encode, int cid) {
+	struct component_pool *c = &((struct entity_world *)lua_touserdata(L, world_index))->c[cid];
+	if (lua_getiuservalue(L, world_index, cid * 2 + 2) != LUA_TTABLE)
+		luaL_error(L, "Missing lua table for %d", cid);
+	int objs = lua_gettop(L);
+	lua_pushnil(L);
+	int tmp = lua_gettop(L);	// keep the encoded string
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	int i;
+	for (i=0;i<c->n;i++) {
+		lua_pushvalue(L, encode);
+		lua_pushinteger(L, cid);
+		lua_rawgeti(L, objs, i+1);
+		lua_call(L, 2, 1);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "Encode lua component %d should return a string", cid);
+		lua_replace(L, tmp);
+		size_t sz;
+		const char *s = lua_tolstring(L, tmp, &sz);
+		if (sz > 0xffffffff)
+			luaL_error(L, "Lua component %d is too large", cid);
+		uint32_t size = (uint32_t)sz;
+		luaL_addlstring(&b, (const char *)&size, sizeof(size));
+		luaL_addlstring(&b, s, sz);
 	}
-	read_iter(L, 1, 3, iter, index);
-	return 1;
+	luaL_pushresult(&b);
+	size_t sz;
+	const char *data = lua_tolstring(L, -1, &sz);
+	struct snapshot_pool p = { cid, c->n, c->stride, c->flags & ~POOL_STAMP, sz };
+	snapshot_write(L, writer, &p, sizeof(p));
+	snapshot_write(L, writer, c->id, (size_t)c->n * sizeof(unsigned int));
+	snapshot_write(L, writer, data, sz);
+	lua_settop(L, objs - 1);
 }
 
-static int
-postpone(lua_State *L, struct group_iter *iter, struct component_pool *c) {
-	int ret = 0;
-	if (c->stride == STRIDE_ORDER) {
-		if (lua_getfield(L, 2, iter->k[0].name) == LUA_TBOOLEAN) {
-			ret = (lua_toboolean(L, -1) == 0);
-			lua_pushnil(L);
-			lua_setfield(L, 2, iter->k[0].name);
+static void
+snapshot_write_pool(lua_State *L, struct snapshot_writer *writer, struct component_pool *c, int cid) {
+	struct snapshot_pool p = { cid, c->n, c->stride, c->flags & ~POOL_STAMP, snapshot_data_size(c) };
+	snapshot_write(L, writer, &p, sizeof(p));
+	snapshot_write(L, writer, c->id, (size_t)c->n * sizeof(unsigned int));
+	if (c->stride <= 0)
+		return;
+	if (c->flags & POOL_SOA) {
+		snapshot_write_soa_pad(L, writer);
+		int i;
+		for (i=0;i<c->soa_n;i++) {
+			snapshot_write(L, writer, soa_column(c, i), (size_t)c->n * c->soa[i].size);
+			snapshot_write_soa_pad(L, writer);
+		}
+	} else if (c->flags & POOL_CHUNK) {
+		// write the chunks as one section
+		luaL_Buffer b;
+		luaL_buffinit(L, &b);
+		int i;
+		for (i=0;i<c->n;i+=CHUNK_SIZE) {
+			int n = c->n - i < CHUNK_SIZE ? c->n - i : CHUNK_SIZE;
+			luaL_addlstring(&b, (const char *)c->chunk[i >> CHUNK_SHIFT], (size_t)n * c->stride);
 		}
+		luaL_pushresult(&b);
+		size_t sz;
+		const char *data = lua_tolstring(L, -1, &sz);
+		snapshot_write(L, writer, data, sz);
 		lua_pop(L, 1);
+	} else {
+		snapshot_write(L, writer, c->buffer, (size_t)c->n * c->stride);
 	}
-	return ret;
 }
 
+// world, writer, encode, schema
 static int
-leach_group(lua_State *L) {
-	struct group_iter *iter = lua_touserdata(L, 1); 
-	if (lua_rawgeti(L, 2, 1) != LUA_TNUMBER) {
-		return luaL_error(L, "Invalid group iterator");
+lsave(lua_State *L) {
+	struct entity_world *w = getW(L);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	size_t schema_size;
+	const char *schema = luaL_checklstring(L, 4, &schema_size);
+	// save a settled world, nothing is lazy in the pools
+	command_playback(L, w);
+	int pool_n = 0;
+	int i;
+	for (i=0;i<MAX_COMPONENT;i++) {
+		struct component_pool *c = &w->c[i];
+		if (c->flags & POOL_DIRTY)
+			bitset_materialize(c);
+		tag_settle(c);
+		if (c->n > 0)
+			++pool_n;
 	}
-	int i = lua_tointeger(L, -1);
-	if (i < 0)
-		return luaL_error(L, "Invalid iterator index %d", i);
-	lua_pop(L, 1);
-
-	if (lua_getiuservalue(L, 1, 1) != LUA_TUSERDATA) {
-		return luaL_error(L, "Missing world object for iterator");
+	struct snapshot_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.order = SNAPSHOT_ORDER;
+	h.max_id = w->max_id;
+	h.handle_cid = w->handle_cid;
+	h.rearrange_from = w->rearrange_from;
+	h.rearrange_id = w->rearrange_id;
+	h.rearrange_budget = w->rearrange_budget;
+	h.pool_n = pool_n;
+	h.slot_n = w->slot_n;
+	h.slot_free = w->slot_free;
+	h.schema_size = schema_size;
+	struct snapshot_writer sw = { 2, 0 };
+	snapshot_write(L, &sw, &h, sizeof(h));
+	snapshot_write(L, &sw, schema, schema_size);
+	for (i=0;i<MAX_COMPONENT;i++) {
+		struct component_pool *c = &w->c[i];
+		if (c->n == 0)
+			continue;
+		if (c->stride == STRIDE_LUA)
+			snapshot_write_lua(L, 1, &sw, 3, i);
+		else
+			snapshot_write_pool(L, &sw, c, i);
 	}
+	snapshot_write(L, &sw, w->slot, (size_t)w->slot_n * sizeof(struct handle_slot));
+	return 0;
+}
 
-	int world_index = lua_gettop(L);
-
-	unsigned int index[MAX_COMPONENT];
-	int mainkey = iter->k[0].id;
+#if defined(_WIN32)
 
-	struct component_pool *c = &iter->world->c[mainkey];
-	if (i>0) {
-		if (postpone(L, iter, c)) {
-			--i;
-			unsigned int tmp = c->id[i];
-			memmove(&c->id[i], &c->id[i+1], (c->n-i-1) * sizeof(c->id[0]));
-			c->id[c->n-1] = tmp;
-		} else if (!iter->readonly) {
-			update_last_index(L, world_index, 2, iter, i-1);
+static int
+image_map(struct ecs_image *img, const char *filename) {
+	HANDLE f = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+		return 0;
+	LARGE_INTEGER sz;
+	void *base = NULL;
+	if (GetFileSizeEx(f, &sz) && sz.QuadPart > 0) {
+		HANDLE m = CreateFileMappingA(f, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (m) {
+			// the view keeps the mapping
+			base = MapViewOfFile(m, FILE_MAP_COPY, 0, 0, 0);
+			CloseHandle(m);
 		}
 	}
-	for (;;) {
-		int idx = i++;
-		index[0] = idx + 1;
-		int ret = query_index(iter, 1, mainkey, idx, index);
-		if (ret < 0)
-			return 0;
-		if (ret > 0)
-			break;
-	}
+	CloseHandle(f);
+	if (base == NULL)
+		return 0;
+	img->base = (char *)base;
+	img->size = (size_t)sz.QuadPart;
+	return 1;
+}
 
-	lua_pushinteger(L, i);
-	lua_rawseti(L, 2, 1);
+static void
+image_unmap(struct ecs_image *img) {
+	if (img->base)
+		UnmapViewOfFile(img->base);
+	img->base = NULL;
+	img->size = 0;
+}
 
-	read_iter(L, world_index, 2, iter, index);
+#else
 
-	lua_settop(L, 2);
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int
+image_map(struct ecs_image *img, const char *filename) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return 0;
+	img->base = (char *)base;
+	img->size = st.st_size;
 	return 1;
 }
 
 static void
-create_key_cache(lua_State *L, struct group_key *k, struct field *f) {
-	if (k->field_n == 0 // is tag or object?
-		|| (k->attrib & COMPONENT_FILTER)) {	// existence or ref
-		return;
-	}
-	if (k->field_n == 1 && f[0].key == NULL) {
-		// value type
-		switch (f[0].type) {
-		case TYPE_INT:
-		case TYPE_INT64:
-		case TYPE_DWORD:
-		case TYPE_WORD:
-		case TYPE_BYTE:
-			lua_pushinteger(L, 0);
-			break;
-		case TYPE_FLOAT:
-		case TYPE_DOUBLE:
-			lua_pushnumber(L, 0);
-			break;
-		case TYPE_BOOL:
-			lua_pushboolean(L, 0);
-			break;
-		case TYPE_USERDATA:
-			lua_pushlightuserdata(L, NULL);
-			break;
-		default:
-			lua_pushnil(L);
-			break;
-		}
-	} else {
-		lua_createtable(L, 0, k->field_n);
-	}
-	lua_setfield(L, -2, k->name);
+image_unmap(struct ecs_image *img) {
+	if (img->base)
+		munmap(img->base, img->size);
+	img->base = NULL;
+	img->size = 0;
 }
 
+#endif
+
 static int
-lpairs_group(lua_State *L) {
-	struct group_iter *iter = lua_touserdata(L, 1); 
-	lua_pushcfunction(L, leach_group);
-	lua_pushvalue(L, 1);
-	lua_createtable(L, 2, iter->nkey);
-	int i;
-	int opt = 0;
-	struct field *f = iter->f;
-	for (i=0;i<iter->nkey;i++) {
-		struct group_key *k = &iter->k[i];
-		create_key_cache(L, k, f);
-		f += k->field_n;
-		if (k->attrib & COMPONENT_OPTIONAL)
-			++opt;
-	}
-	if (opt) {
-		// create backup table in metatable
-		lua_createtable(L, 0, opt);
-		for (i=0;i<iter->nkey;i++) {
-			struct group_key *k = &iter->k[i];
-			if (k->attrib & COMPONENT_OPTIONAL) {
-				lua_getfield(L, -2, k->name);
-				lua_setfield(L, -2, k->name);
-			}
-		}
-		lua_setmetatable(L, -2);
-	}
-	lua_pushinteger(L, 0);
-	lua_rawseti(L, -2, 1);
-	lua_pushinteger(L, iter->k[0].id);	// mainkey
-	lua_rawseti(L, -2, 2);
-	return 3;		
+limage_gc(lua_State *L) {
+	image_unmap((struct ecs_image *)lua_touserdata(L, 1));
+	return 0;
 }
 
+// filename -> image, the pages are shared until they are written (copy-on-write)
 static int
-check_boolean(lua_State *L, const char * key) {
-	int r = 0;
-	switch (lua_getfield(L, -1, key)) {
-	case LUA_TNIL:
-		break;
-	case LUA_TBOOLEAN:
-		r = lua_toboolean(L, -1);
-		break;
-	default:
-		return luaL_error(L, "Invalid boolean type %s", lua_typename(L, lua_type(L, -1)));
+lmap(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	struct ecs_image *img = (struct ecs_image *)lua_newuserdatauv(L, sizeof(*img), 0);
+	img->base = NULL;
+	img->size = 0;
+	if (luaL_newmetatable(L, "ENTITY_IMAGE")) {
+		lua_pushcfunction(L, limage_gc);
+		lua_setfield(L, -2, "__gc");
 	}
-	lua_pop(L, 1);
-	return r;
+	lua_setmetatable(L, -2);
+	if (!image_map(img, filename))
+		return luaL_error(L, "Can't map %s", filename);
+	return 1;
 }
 
-static int
-is_value(lua_State *L, struct field *f) {
-	switch (lua_getfield(L, -1, "type")) {
-	case LUA_TNIL:
-		lua_pop(L, 1);
-		return 0;
-	case LUA_TNUMBER:
-		f->key = NULL;
-		f->offset = 0;
-		f->type = check_type(L);
-		return 1;
-	default:
-		return luaL_error(L, "Invalid value type %s", lua_typename(L, lua_type(L, -1)));
+struct snapshot_reader {
+	const char *ptr;
+	size_t size;
+	size_t pos;
+};
+
+// Returns sz bytes at the cursor, and skip the padding
+static const void *
+snapshot_read(lua_State *L, struct snapshot_reader *r, size_t sz) {
+	if (sz > r->size - r->pos)
+		luaL_error(L, "Invalid snapshot (truncated)");
+	const void *p = r->ptr + r->pos;
+	r->pos += sz;
+	size_t pad = snapshot_align(sz) - sz;
+	r->pos = pad > r->size - r->pos ? r->size : r->pos + pad;
+	return p;
+}
+
+// Skip the padding to SOA_ALIGN, the same as snapshot_write_soa_pad
+static void
+snapshot_read_soa_pad(struct snapshot_reader *r) {
+	size_t pos = (r->pos + SOA_ALIGN - 1) & ~(size_t)(SOA_ALIGN - 1);
+	r->pos = pos > r->size ? r->size : pos;
+}
+
+static const struct snapshot_header *
+snapshot_check(lua_State *L, struct snapshot_reader *r) {
+	const struct snapshot_header *h = (const struct snapshot_header *)snapshot_read(L, r, sizeof(*h));
+	if (memcmp(h->magic, snapshot_magic, sizeof(h->magic)) != 0)
+		luaL_error(L, "Invalid snapshot");
+	if (h->order != SNAPSHOT_ORDER)
+		luaL_error(L, "Invalid byte order of snapshot");
+	if (h->version != SNAPSHOT_VERSION)
+		luaL_error(L, "Unsupported snapshot version %d", (int)h->version);
+	return h;
+}
+
+// The snapshot is a string or an image from ecs._map
+static void
+snapshot_source(lua_State *L, int index, struct snapshot_reader *r) {
+	if (lua_type(L, index) == LUA_TSTRING) {
+		r->ptr = lua_tolstring(L, index, &r->size);
+	} else {
+		struct ecs_image *img = (struct ecs_image *)luaL_checkudata(L, index, "ENTITY_IMAGE");
+		if (img->base == NULL)
+			luaL_error(L, "The image is used");
+		r->ptr = img->base;
+		r->size = img->size;
 	}
+	r->pos = 0;
 }
 
+// snapshot -> schema, has_handle
 static int
-get_key(struct entity_world *w, lua_State *L, struct group_key *key, struct field *f) {
-	if (lua_getfield(L, -1, "id") != LUA_TNUMBER) {
-		return luaL_error(L, "Invalid id");
-	}
-	key->id = lua_tointeger(L, -1);
-	lua_pop(L, 1);
-	if (key->id < 0 || key->id >= MAX_COMPONENT || w->c[key->id].cap == 0) {
-		return luaL_error(L, "Invalid id %d", key->id);
-	}
-	if (lua_getfield(L, -1, "name") != LUA_TSTRING) {
-		return luaL_error(L, "Invalid component name");
-	}
-	key->name = lua_tostring(L, -1);
-	lua_pop(L, 1);
-	int attrib = 0;
-	if (check_boolean(L, "r")) {
-		attrib |= COMPONENT_IN;
-	}
-	if (check_boolean(L, "w")) {
-		attrib |= COMPONENT_OUT;
+lsnapshot_schema(lua_State *L) {
+	struct snapshot_reader r;
+	snapshot_source(L, 1, &r);
+	const struct snapshot_header *h = snapshot_check(L, &r);
+	if (h->schema_size > r.size - r.pos)
+		return luaL_error(L, "Invalid snapshot (truncated)");
+	lua_pushlstring(L, (const char *)snapshot_read(L, &r, h->schema_size), h->schema_size);
+	lua_pushboolean(L, h->handle_cid != 0);
+	return 2;
+}
+
+// The ids in a mapped image are trusted, they are not touched until used.
+static void
+snapshot_load_id(lua_State *L, struct entity_world *w, struct component_pool *c, int cid, const unsigned int *id, int n) {
+	int i;
+	if (image_owns(w, id)) {
+		c->id = (unsigned int *)id;
+		c->cap = n;
+	} else {
+		for (i=0;i<n;i++) {
+			unsigned int eid = id[i];
+			if (eid == 0 || eid > w->max_id
+				|| (i > 0 && c->stride != STRIDE_ORDER && eid <= id[i-1]))
+				luaL_error(L, "Invalid id %u of pool %d in snapshot", eid, cid);
+		}
+		pool_resize(L, w, c, n);
+		memcpy(c->id, id, (size_t)n * sizeof(unsigned int));
 	}
-	if (check_boolean(L, "opt")) {
-		attrib |= COMPONENT_OPTIONAL;
+	c->n = n;
+	++c->version;
+	if (c->flags & POOL_SPARSE) {
+		for (i=0;i<n;i++) {
+			sparse_index_set(L, w, c, id[i], i);
+		}
 	}
-	if (check_boolean(L, "exist")) {
-		attrib |= COMPONENT_EXIST;
+	if (c->flags & POOL_BITSET) {
+		int bits_n = (int)(w->max_id / 64) + 1;
+		c->bits = (uint64_t *)world_alloc(L, w, NULL, 0, bits_n * sizeof(uint64_t));
+		c->bits_n = bits_n;
+		bitset_rebuild(c);
 	}
-	if (check_boolean(L, "absent")) {
-		attrib |= COMPONENT_ABSENT;
+}
+
+static void
+snapshot_load_lua(lua_State *L, int world_index, int decode, struct component_pool *c, int cid, const char *data, size_t sz) {
+	lua_createtable(L, c->n, 0);
+	size_t pos = 0;
+	int i;
+	for (i=0;i<c->n;i++) {
+		uint32_t size;
+		if (sizeof(size) > sz - pos)
+			luaL_error(L, "Invalid lua component %d in snapshot", cid);
+		memcpy(&size, data + pos, sizeof(size));
+		pos += sizeof(size);
+		if (size > sz - pos)
+			luaL_error(L, "Invalid lua component %d in snapshot", cid);
+		lua_pushvalue(L, decode);
+		lua_pushinteger(L, cid);
+		lua_pushlstring(L, data + pos, size);
+		lua_call(L, 2, 1);
+		lua_rawseti(L, -2, i+1);
+		pos += size;
 	}
-	key->attrib = attrib;
-	if (is_value(L, f)) {
-		key->field_n = 1;
-		return 1;
+	lua_setiuservalue(L, world_index, cid * 2 + 2);
+}
+
+// Point the pool into the image, only the last chunk of chunked pool is copied, because it's not full.
+static void
+snapshot_map_data(lua_State *L, struct entity_world *w, struct component_pool *c, const char *data) {
+	if (c->flags & POOL_SOA) {
+		// soa_base(image) is the image itself, it's aligned to page
+		c->buffer = w->image.base;
+		int i;
+		for (i=0;i<c->soa_n;i++) {
+			assert(((data - w->image.base) & (SOA_ALIGN - 1)) == 0);
+			c->soa[i].pos = data - w->image.base;
+			data += soa_column_size(c->n, c->soa[i].size);
+		}
+	} else if (c->flags & POOL_CHUNK) {
+		int n = (c->n + CHUNK_MASK) >> CHUNK_SHIFT;
+		c->chunk = (void **)world_alloc(L, w, NULL, 0, n * sizeof(void *));
+		c->chunk_n = n;
+		int i;
+		for (i=0;i<n;i++) {
+			c->chunk[i] = (void *)(data + (size_t)i * CHUNK_SIZE * c->stride);
+		}
+		int last = c->n & CHUNK_MASK;
+		if (last) {
+			void *chunk = world_alloc(L, w, NULL, 0, (size_t)CHUNK_SIZE * c->stride);
+			memcpy(chunk, c->chunk[n-1], (size_t)last * c->stride);
+			c->chunk[n-1] = chunk;
+		}
 	} else {
-		int i = 0;
-		int ttype;
-		while ((ttype = lua_geti(L, -1, i+1)) != LUA_TNIL) {
-			if (ttype != LUA_TTABLE) {
-				return luaL_error(L, "Invalid field %d", i+1);
-			}
-			get_field(L, i+1, &f[i]);
-			++i;
+		c->buffer = (void *)data;
+	}
+}
+
+static void
+snapshot_load_data(lua_State *L, struct entity_world *w, struct component_pool *c, int cid, const char *data, uint64_t sz) {
+	if (sz != snapshot_data_size(c))
+		luaL_error(L, "Invalid size of pool %d in snapshot", cid);
+	if (image_owns(w, data)) {
+		snapshot_map_data(L, w, c, data);
+	} else if (c->flags & POOL_SOA) {
+		int i;
+		for (i=0;i<c->soa_n;i++) {
+			size_t n = (size_t)c->n * c->soa[i].size;
+			memcpy(soa_column(c, i), data, n);
+			data += soa_column_size(c->n, c->soa[i].size);
 		}
-		key->field_n = i;
-		lua_pop(L, 1);
-		return i;
+	} else if (c->flags & POOL_CHUNK) {
+		chunk_grow(L, w, c, (c->n + CHUNK_MASK) >> CHUNK_SHIFT);
+		int i;
+		for (i=0;i<c->n;i+=CHUNK_SIZE) {
+			int n = c->n - i < CHUNK_SIZE ? c->n - i : CHUNK_SIZE;
+			memcpy(c->chunk[i >> CHUNK_SHIFT], data + (size_t)i * c->stride, (size_t)n * c->stride);
+		}
+	} else {
+		memcpy(c->buffer, data, (size_t)c->n * c->stride);
 	}
 }
 
+// world, snapshot or image, decode
 static int
-lgroupiter(lua_State *L) {
+lload(lua_State *L) {
 	struct entity_world *w = getW(L);
-	luaL_checktype(L, 2, LUA_TTABLE);
-	int nkey = get_len(L, 2);
-	int field_n = 0;
+	struct snapshot_reader r;
+	snapshot_source(L, 2, &r);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	const struct snapshot_header *h = snapshot_check(L, &r);
 	int i;
-	if (nkey == 0) {
-		return luaL_error(L, "At least one key");
+	for (i=0;i<MAX_COMPONENT;i++) {
+		if (w->c[i].n > 0)
+			return luaL_error(L, "Load snapshot into a world not empty");
 	}
-	if (nkey > MAX_COMPONENT) {
-		return luaL_error(L, "Too many keys");
+	if (w->max_id != 0 || w->slot_n != 0)
+		return luaL_error(L, "Load snapshot into a world not empty");
+	if (h->handle_cid != w->handle_cid)
+		return luaL_error(L, "Handle type %d mismatch", (int)h->handle_cid);
+	if (lua_type(L, 2) != LUA_TSTRING) {
+		// the world owns the image now
+		struct ecs_image *img = (struct ecs_image *)lua_touserdata(L, 2);
+		if (w->image.base)
+			return luaL_error(L, "The world has an image");
+		w->image = *img;
+		img->base = NULL;
+		img->size = 0;
 	}
-	for (i=0;i<nkey;i++) {
-		if (lua_geti(L, 2, i+1) != LUA_TTABLE) {
-			return luaL_error(L, "index %d is not a table", i);
-		}
-		int n = get_len(L, -1);
-		if (n == 0) {
-			struct field f;
-			if (is_value(L, &f)) {
-				n = 1;
-			}
-		}
-		field_n += n;
-		lua_pop(L, 1);
+	snapshot_read(L, &r, h->schema_size);
+	w->max_id = h->max_id;
+	for (i=0;i<h->pool_n;i++) {
+		const struct snapshot_pool *p = (const struct snapshot_pool *)snapshot_read(L, &r, sizeof(*p));
+		int cid = p->cid;
+		if (cid < 0 || cid >= MAX_COMPONENT || w->c[cid].cap == 0)
+			return luaL_error(L, "Invalid type %d in snapshot", cid);
+		struct component_pool *c = &w->c[cid];
+		if (c->n > 0 || p->n <= 0 || p->stride != c->stride || p->flags != c->flags)
+			return luaL_error(L, "Pool %d mismatch in snapshot", cid);
+		const unsigned int *id = (const unsigned int *)snapshot_read(L, &r, (size_t)p->n * sizeof(unsigned int));
+		if (c->flags & POOL_SOA)
+			snapshot_read_soa_pad(&r);
+		uint64_t sz = p->size;
+		if (sz > r.size - r.pos)
+			return luaL_error(L, "Invalid snapshot (truncated)");
+		const char *data = (const char *)snapshot_read(L, &r, sz);
+		snapshot_load_id(L, w, c, cid, id, p->n);
+		if (c->stride == STRIDE_LUA)
+			snapshot_load_lua(L, 1, 3, c, cid, data, sz);
+		else if (c->stride > 0)
+			snapshot_load_data(L, w, c, cid, data, sz);
 	}
-	size_t header_size = sizeof(struct group_iter) + sizeof(struct group_key) * (nkey-1);
-	const int align_size = sizeof(void *);
-	// align
-	header_size = (header_size + align_size - 1) & ~(align_size - 1);
-	size_t size = header_size + field_n * sizeof(struct field);
-	struct group_iter *iter = (struct group_iter *)lua_newuserdatauv(L, size, 1);
-	// refer world
-	lua_pushvalue(L, 1);
-	lua_setiuservalue(L, -2, 1);
-	iter->nkey = nkey;
-	iter->world = w;
-	iter->readonly = 1;
-	struct field *f = (struct field *)((char *)iter + header_size);
-	iter->f = f;
-	for (i=0; i< nkey; i++) {
-		lua_geti(L, 2, i+1);
-		int n = get_key(w, L, &iter->k[i], f);
-		struct component_pool *c = &w->c[iter->k[i].id];
-		if (c->stride == STRIDE_TAG && is_temporary(iter->k[i].attrib)) {
-			return luaL_error(L, "%s is a tag, use %s?out instead", iter->k[i].name, iter->k[i].name);
-		}
-		f += n;
-		lua_pop(L, 1);
-		if (c->stride == STRIDE_LUA) {
-			if (n != 0)
-				return luaL_error(L, ".%s is object component, no fields needed", iter->k[i].name);
-			iter->k[i].attrib |= COMPONENT_OBJECT;
-		} else if (c->stride == STRIDE_ORDER) {
-			if (i != 0) {
-				if (!is_temporary(iter->k[i].attrib)) {
-					return luaL_error(L, ".%s is an order key, must be main key or temporary", iter->k[i].name);
-				}
-			} else if (!(iter->k[0].attrib & COMPONENT_EXIST)) {
-				return luaL_error(L, ".%s is an order key, it can only be exist", iter->k[0].name);
-			}
-		}
-		int attrib = iter->k[i].attrib;
-		if (!(attrib & COMPONENT_FILTER)) {
-			int readonly = (attrib & COMPONENT_IN) && !(attrib & COMPONENT_OUT);
-			if (!readonly)
-				iter->readonly = 0;
+	int slot_n = h->slot_n;
+	if (slot_n < 0 || h->slot_free < -1 || h->slot_free >= slot_n)
+		return luaL_error(L, "Invalid handle slots in snapshot");
+	if (slot_n > 0) {
+		const void *slot = snapshot_read(L, &r, (size_t)slot_n * sizeof(struct handle_slot));
+		if (image_owns(w, slot)) {
+			w->slot = (struct handle_slot *)slot;
+		} else {
+			w->slot = (struct handle_slot *)world_alloc(L, w, NULL, 0, slot_n * sizeof(struct handle_slot));
+			memcpy(w->slot, slot, slot_n * sizeof(struct handle_slot));
 		}
+		w->slot_n = w->slot_cap = slot_n;
 	}
-	int mainkey_attrib = iter->k[0].attrib;
-	if (mainkey_attrib & COMPONENT_ABSENT) {
-		return luaL_error(L, "The main key can't be absent");
+	w->slot_free = h->slot_free;
+	w->rearrange_from = h->rearrange_from;
+	w->rearrange_id = h->rearrange_id;
+	w->rearrange_budget = h->rearrange_budget;
+	// the snapshot doesn't know the holes, run one more pass to be sure
+	w->rearrange_holes = (w->rearrange_from != 0);
+	if (w->image.base) {
+		// don't touch all the ids of image, update scans the pools and rebuilds the masks when it's needed
+		mask_lost(w);
+	} else {
+		mask_rebuild(w);
 	}
-	if (luaL_newmetatable(L, "ENTITY_GROUPITER")) {
-		lua_pushcfunction(L, lpairs_group);
-		lua_setfield(L, -2, "__call");
+	return 0;
+}
+
+// Delta of pools for replication, see world:delta_encoder .
+// The encoder keeps the ids and rows of last frame for each component, and each frame is encoded as
+// (all numbers are varint, the eids of a list are the differences to the previous one) :
+//	count, { stride, removed, eid..., added, eid..., rows of added, changed, { eid, mask of fields, fields... }... }...
+
+#define DELTA_MAXFIELD 64
+
+struct delta_field {
+	int offset;
+	int size;
+};
+
+struct delta_component {
+	int cid;
+	int stride;
+	int field_n;
+	int n;	// components in last frame
+	struct delta_field field[DELTA_MAXFIELD];
+};
+
+// uservalues : 2k+1 is the frame of last encode for component k, 2k+2 is a spare one, 2n+1 is the scratch
+struct delta_encoder {
+	struct entity_world *w;
+	int n;
+	struct delta_component c[1];
+};
+
+struct delta_change {
+	int index;
+	uint64_t mask;	// changed fields
+};
+
+struct delta_reader {
+	const unsigned char *ptr;
+	const unsigned char *end;
+};
+
+// spec is { cid, offset1, size1, offset2, size2, ... }
+static void
+delta_spec(lua_State *L, struct entity_world *w, int spec, struct delta_component *dc) {
+	lua_rawgeti(L, spec, 1);
+	int cid = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (cid <= 0 || cid >= MAX_COMPONENT || w->c[cid].cap == 0)
+		luaL_error(L, "Invalid type %d", cid);
+	struct component_pool *c = &w->c[cid];
+	if (c->stride < 0)
+		luaL_error(L, "Lua component or order key %d can't be encoded", cid);
+	int n = (int)(lua_rawlen(L, spec) - 1) / 2;
+	if (n > DELTA_MAXFIELD)
+		luaL_error(L, "Too many fields of type %d", cid);
+	if (c->stride > 0 && n == 0)
+		luaL_error(L, "Missing fields of type %d", cid);
+	dc->cid = cid;
+	dc->stride = c->stride;
+	dc->field_n = n;
+	dc->n = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		struct delta_field *f = &dc->field[i];
+		lua_rawgeti(L, spec, i*2+2);
+		lua_rawgeti(L, spec, i*2+3);
+		f->offset = lua_tointeger(L, -2);
+		f->size = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+		if (f->offset < 0 || f->size <= 0 || f->offset + f->size > c->stride)
+			luaL_error(L, "Invalid field %d of type %d", i, cid);
 	}
-	lua_setmetatable(L, -2);
-	return 1;
 }
 
+// world, { spec1, spec2, ... } -> encoder
 static int
-lremove(lua_State *L) {
+ldelta_encoder(lua_State *L) {
 	struct entity_world *w = getW(L);
 	luaL_checktype(L, 2, LUA_TTABLE);
-	int iter = get_integer(L, 2, 1, "index") - 1;
-	int mainkey = get_integer(L, 2, 2, "mainkey");
-	entity_remove_(w, mainkey, iter, L, 1);
-	return 0;
+	int n = lua_rawlen(L, 2);
+	if (n <= 0 || n > MAX_COMPONENT)
+		return luaL_error(L, "Invalid number of types %d", n);
+	size_t sz = sizeof(struct delta_encoder) + (n - 1) * sizeof(struct delta_component);
+	struct delta_encoder *enc = (struct delta_encoder *)lua_newuserdatauv(L, sz, n * 2 + 1);
+	enc->w = w;
+	enc->n = n;
+	int i;
+	for (i=0;i<n;i++) {
+		if (lua_rawgeti(L, 2, i+1) != LUA_TTABLE)
+			return luaL_error(L, "Invalid type spec %d", i+1);
+		delta_spec(L, w, lua_gettop(L), &enc->c[i]);
+		lua_pop(L, 1);
+	}
+	if (luaL_newmetatable(L, "ENTITY_DELTA")) {
+		lua_pushliteral(L, "ENTITY_DELTA");
+		lua_setfield(L, -2, "__name");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
 }
 
-static int
-lobject(lua_State *L) {
-	struct group_iter *iter = luaL_checkudata(L, 1, "ENTITY_GROUPITER");
-	int index = luaL_checkinteger(L, 3) - 1;
-	int cid = iter->k[0].id;
-	struct entity_world * w = iter->world;
-	if (cid < 0 || cid >=MAX_COMPONENT) {
-		return luaL_error(L, "Invalid object %d", cid);
+// userdata of uservalue index with sz bytes at least, it's on the top
+static void *
+delta_buffer(lua_State *L, int index, int n, size_t sz) {
+	if (lua_getiuservalue(L, index, n) == LUA_TUSERDATA && lua_rawlen(L, -1) >= sz)
+		return lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	void *buffer = lua_newuserdatauv(L, sz + sz / 2, 0);
+	lua_pushvalue(L, -1);
+	lua_setiuservalue(L, index, n);
+	return buffer;
+}
+
+// copy the rows of pool in the layout of struct
+static void
+delta_copy_rows(struct component_pool *c, char *rows) {
+	size_t stride = c->stride;
+	if (c->flags & POOL_SOA) {
+		int i, j;
+		for (i=0;i<c->soa_n;i++) {
+			struct soa_column *col = &c->soa[i];
+			const char *from = (const char *)soa_column(c, i);
+			for (j=0;j<c->n;j++) {
+				memcpy(rows + stride * j + col->offset, from + (size_t)col->size * j, col->size);
+			}
+		}
+	} else if (c->flags & POOL_CHUNK) {
+		int i;
+		for (i=0;i<c->n;i+=CHUNK_SIZE) {
+			int n = c->n - i < CHUNK_SIZE ? c->n - i : CHUNK_SIZE;
+			memcpy(rows + stride * i, c->chunk[i >> CHUNK_SHIFT], stride * n);
+		}
+	} else {
+		memcpy(rows, c->buffer, stride * c->n);
 	}
-	lua_settop(L, 2);
-	struct component_pool *c = &w->c[cid];
-	if (c->n <= index) {
-		return luaL_error(L, "No object %d", cid);
+}
+
+static inline void
+delta_write_varint(luaL_Buffer *b, uint64_t v) {
+	char *p = luaL_prepbuffsize(b, 10);
+	int n = 0;
+	while (v >= 0x80) {
+		p[n++] = (char)(v | 0x80);
+		v >>= 7;
 	}
-	if (c->stride == STRIDE_LUA) {
-		// lua object
-		if (lua_getiuservalue(L, 1, 1) != LUA_TUSERDATA) {
-			return luaL_error(L, "No world");
-		}
-		if (lua_getiuservalue(L, -1, cid * 2 + 2) != LUA_TTABLE) {
-			return luaL_error(L, "Missing lua table for %d", cid);
+	p[n++] = (char)v;
+	luaL_addsize(b, n);
+}
+
+// the eids of a list are written as the differences
+static void
+delta_write_id(luaL_Buffer *b, const unsigned int *id, const struct delta_change *list, int n) {
+	unsigned int last = 0;
+	int i;
+	delta_write_varint(b, n);
+	for (i=0;i<n;i++) {
+		unsigned int eid = id[list[i].index];
+		delta_write_varint(b, eid - last);
+		last = eid;
+	}
+}
+
+static uint64_t
+delta_diff_row(const struct delta_component *dc, const char *a, const char *b) {
+	uint64_t mask = 0;
+	if (memcmp(a, b, dc->stride) != 0) {
+		int i;
+		for (i=0;i<dc->field_n;i++) {
+			const struct delta_field *f = &dc->field[i];
+			if (memcmp(a + f->offset, b + f->offset, f->size) != 0)
+				mask |= (uint64_t)1 << i;
 		}
-		if (lua_isnil(L, 2)) {
-			lua_rawgeti(L, -1, index + 1);
+	}
+	return mask;
+}
+
+// Encode component k of encoder at enc_index, the delta string is on the top
+static void
+delta_encode_component(lua_State *L, struct entity_world *w, int enc_index, int k) {
+	struct delta_encoder *enc = (struct delta_encoder *)lua_touserdata(L, enc_index);
+	struct delta_component *dc = &enc->c[k];
+	struct component_pool *c = &w->c[dc->cid];
+	if (c->stride != dc->stride)
+		luaL_error(L, "Type %d changed", dc->cid);
+	if (c->flags & POOL_DIRTY)
+		bitset_materialize(c);
+	tag_settle(c);
+	int top = lua_gettop(L);
+	size_t stride = dc->stride;
+	int pn = dc->n;
+	const unsigned int *pid = NULL;
+	const char *prow = NULL;
+	if (lua_getiuservalue(L, enc_index, k*2+1) == LUA_TUSERDATA) {
+		pid = (const unsigned int *)lua_touserdata(L, -1);
+		prow = (const char *)(pid + pn);
+	}
+	// the spare frame becomes the last one
+	int cn = c->n;
+	unsigned int *id = (unsigned int *)delta_buffer(L, enc_index, k*2+2, (sizeof(unsigned int) + stride) * cn);
+	char *row = (char *)(id + cn);
+	memcpy(id, c->id, cn * sizeof(unsigned int));
+	if (stride > 0)
+		delta_copy_rows(c, row);
+	struct delta_change *removed = (struct delta_change *)delta_buffer(L, enc_index, enc->n * 2 + 1, (pn + cn * 2) * sizeof(struct delta_change));
+	struct delta_change *added = removed + pn;
+	struct delta_change *changed = added + cn;
+	int nr = 0, na = 0, nc = 0;
+	int i = 0, j = 0;
+	while (i < pn && j < cn) {
+		if (pid[i] < id[j]) {
+			removed[nr++].index = i++;
+		} else if (pid[i] > id[j]) {
+			added[na++].index = j++;
 		} else {
-			lua_pushvalue(L, 2);
-			lua_rawseti(L, -2, index + 1);
-			lua_settop(L, 2);
+			if (stride > 0) {
+				uint64_t mask = delta_diff_row(dc, prow + stride * i, row + stride * j);
+				if (mask) {
+					changed[nc].index = j;
+					changed[nc].mask = mask;
+					++nc;
+				}
+			}
+			++i;
+			++j;
 		}
-		return 1;
-	} else if (c->stride == 0) {
-		if (lua_type(L, 2) != LUA_TBOOLEAN)
-			return luaL_error(L, "%s is a tag, need boolean", iter->k[0].name);
-		if (!lua_toboolean(L, 2)) {
-			entity_disable_tag_(w, cid, index, cid);
+	}
+	for (;i<pn;i++)
+		removed[nr++].index = i;
+	for (;j<cn;j++)
+		added[na++].index = j;
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	delta_write_varint(&b, stride);
+	delta_write_id(&b, pid, removed, nr);
+	delta_write_id(&b, id, added, na);
+	if (stride > 0) {
+		for (i=0;i<na;i++) {
+			luaL_addlstring(&b, row + stride * added[i].index, stride);
 		}
-		return 1;
-	} else if (c->stride < 0) {
-		return luaL_error(L, "Invalid object %d", cid);
 	}
-	struct field *f = iter->f;
-	void * buffer = get_ptr(c, index);
-	if (lua_isnoneornil(L, 2)) {
-		// read object
-		if (f->key == NULL) {
-			// value type
-			read_value(L, f, buffer);
-		} else {
-			lua_createtable(L, 0, iter->k[0].field_n);
-			int lua_index = lua_gettop(L);
-			read_component(L, iter->k[0].field_n, f, lua_index, buffer);
+	delta_write_varint(&b, nc);
+	unsigned int last = 0;
+	for (i=0;i<nc;i++) {
+		int index = changed[i].index;
+		uint64_t mask = changed[i].mask;
+		delta_write_varint(&b, id[index] - last);
+		delta_write_varint(&b, mask);
+		last = id[index];
+		const char *from = row + stride * index;
+		char *p = luaL_prepbuffsize(&b, stride);
+		size_t sz = 0;
+		int f;
+		for (f=0;mask;f++,mask>>=1) {
+			if (mask & 1) {
+				memcpy(p + sz, from + dc->field[f].offset, dc->field[f].size);
+				sz += dc->field[f].size;
+			}
 		}
-	} else {
-		// write object
-		lua_pushvalue(L, 2);
-		write_component_object(L, iter->k[0].field_n, f, buffer);
+		luaL_addsize(&b, sz);
 	}
-	return 1;
-}
-
-static int
-lrelease(lua_State *L) {
-	struct entity_world *w = getW(L);
-	int cid = check_cid(L, w, 2);
-	int refid = luaL_checkinteger(L, 3) - 1;
-	int dead_tag = cid + 1;
-	entity_enable_tag_(w, cid, refid, dead_tag, L, 1);
-	return 0;
+	luaL_pushresult(&b);
+	// swap the frames
+	lua_getiuservalue(L, enc_index, k*2+2);
+	lua_setiuservalue(L, enc_index, k*2+1);
+	lua_pushvalue(L, top + 1);
+	lua_setiuservalue(L, enc_index, k*2+2);
+	dc->n = cn;
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
 }
 
+// world, encoder -> delta
 static int
-lreuse(lua_State *L) {
+ldelta_encode(lua_State *L) {
 	struct entity_world *w = getW(L);
-	int cid = check_cid(L, w, 2);
-	int dead_tagid = cid + 1;
-	struct component_pool *c = &w->c[dead_tagid];
-	if (c->stride != STRIDE_TAG) {
-		return luaL_error(L, "%d is not a tag", dead_tagid);
+	struct delta_encoder *enc = (struct delta_encoder *)luaL_checkudata(L, 2, "ENTITY_DELTA");
+	if (enc->w != w)
+		return luaL_error(L, "The encoder is created by another world");
+	command_playback(L, w);
+	luaL_checkstack(L, enc->n + LUA_MINSTACK, NULL);
+	lua_settop(L, 2);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	delta_write_varint(&b, enc->n);
+	luaL_pushresult(&b);
+	int i;
+	for (i=0;i<enc->n;i++) {
+		delta_encode_component(L, w, 2, i);
 	}
-	if (c->n == 0)
-		return 0;
-	int id = entity_sibling_index_(w, dead_tagid, 0, cid);
-	if (id == 0)
-		return luaL_error(L, "Invalid ref component %d", cid);
-	entity_disable_tag_(w, dead_tagid, 0, dead_tagid);
-	lua_pushinteger(L, id);
+	lua_concat(L, enc->n + 1);
 	return 1;
 }
 
-static int
-find_boundary(int from, int to, unsigned int *a, unsigned int eid) {
-	while(from < to) {
-		int mid = (from + to)/2;
-		unsigned int aa = a[mid];
-		if (aa == eid)
-			return mid;
-		else if (aa < eid) {
-			from = mid + 1;
-		} else {
-			to = mid;
-		}
+static uint64_t
+delta_read_varint(lua_State *L, struct delta_reader *r) {
+	uint64_t v = 0;
+	int shift;
+	for (shift=0;shift<64;shift+=7) {
+		if (r->ptr >= r->end)
+			break;
+		unsigned char c = *r->ptr++;
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return v;
 	}
-	return to;
+	luaL_error(L, "Invalid delta");
+	return 0;
 }
 
 static inline int
-next_removed_index(int removed_index, struct component_pool *removed, unsigned int *removed_eid) {
-	for (;;) {
-		++removed_index;
-		if (removed_index >= removed->n) {
-			*removed_eid = 0;
-			break;
-		}
-		unsigned int last_eid = *removed_eid;
-		*removed_eid = removed->id[removed_index];
-		if (*removed_eid != last_eid)
-			break;
+delta_read_count(lua_State *L, struct delta_reader *r) {
+	uint64_t n = delta_read_varint(L, r);
+	if (n > (uint64_t)(r->end - r->ptr))
+		luaL_error(L, "Invalid delta");
+	return (int)n;
+}
+
+// the next eid of the list after last, the eids are increasing
+static inline unsigned int
+delta_read_id(lua_State *L, struct delta_reader *r, unsigned int last, int first) {
+	uint64_t d = delta_read_varint(L, r);
+	if ((d == 0 && !first) || d > 0xffffffff - last)
+		luaL_error(L, "Invalid eid in delta");
+	return last + (unsigned int)d;
+}
+
+static const char *
+delta_read(lua_State *L, struct delta_reader *r, size_t sz) {
+	if (sz > (size_t)(r->end - r->ptr))
+		luaL_error(L, "Invalid delta (truncated)");
+	const char *p = (const char *)r->ptr;
+	r->ptr += sz;
+	return p;
+}
+
+static inline int
+delta_has(struct component_pool *c, int *pos, unsigned int eid) {
+	if (c->flags & POOL_BITSET)
+		return bitset_test(c, eid);
+	*pos = gallop_search(c->id, c->n, *pos, eid);
+	return *pos < c->n && c->id[*pos] == eid;
+}
+
+// the removed ones must exist, and the added ones must not, or the world isn't a replica
+static void
+delta_check(lua_State *L, struct component_pool *c, int cid, struct delta_reader r, int n, int exist) {
+	unsigned int eid = 0;
+	int pos = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		eid = delta_read_id(L, &r, eid, i == 0);
+		if (delta_has(c, &pos, eid) != exist)
+			luaL_error(L, "Entity %d %s in type %d", eid, exist ? "missing" : "exists", cid);
 	}
-	return removed_index;
 }
 
-// remove reference object where id == 0
 static void
-remove_unused_reference(lua_State *L, struct component_pool *c, int from) {
+delta_remove(lua_State *L, struct component_pool *c, struct delta_reader r, int n) {
+	unsigned int eid = 0;
 	int i;
-	int to = from;
-	for (i=from; i < c->n; i++) {
-		if (c->id[i]) {
-			c->id[to] = c->id[i];
-			lua_geti(L, -1, i+1);
-			lua_seti(L, -2, to+1);
-			++to;
+	if (c->flags & POOL_BITSET) {
+		for (i=0;i<n;i++) {
+			eid = delta_read_id(L, &r, eid, i == 0);
+			bitset_disable(c, eid);
 		}
+		return;
 	}
-	for (i=to;i<=c->n;i++) {
-		lua_pushnil(L);
-		lua_seti(L, -2, i+1);
+	// remove the runs between them like remove_all
+	int to = -1;
+	int from = 0;
+	int pos = 0;
+	for (i=0;i<n;i++) {
+		eid = delta_read_id(L, &r, eid, i == 0);
+		pos = gallop_search(c->id, c->n, pos, eid);
+		if (to < 0) {
+			to = pos;
+		} else {
+			move_range(L, c, from, to, pos - from);
+			to += pos - from;
+		}
+		from = pos = pos + 1;
+	}
+	if (to >= 0) {
+		move_range(L, c, from, to, c->n - from);
+		c->n = to + c->n - from;
+		++c->version;
 	}
-	c->n = to;
 }
 
-static int
-lupdate_reference(lua_State *L) {
-	struct entity_world *w = getW(L);
-	struct component_pool *removed = &w->c[ENTITY_REMOVED];
-	if (removed->n == 0)	// no removed entity
-		return 0;
-	int cid = check_cid(L, w, 2);
-	struct component_pool *reference = &w->c[cid];
-	if (reference->n == 0)
-		return 0;	// no reference
-	if (lua_getiuservalue(L, 1, cid * 2 + 2) != LUA_TTABLE) {
-		return luaL_error(L, "Invalid reference component %d", cid);
-	}
+static void
+delta_apply_component(lua_State *L, struct entity_world *w, struct delta_reader *r, const struct delta_component *dc) {
+	struct component_pool *c = &w->c[dc->cid];
+	if (delta_read_varint(L, r) != (uint64_t)dc->stride)
+		luaL_error(L, "Type %d mismatch in delta", dc->cid);
+	if (!(c->flags & POOL_BITSET))
+		tag_settle(c);
+	size_t stride = dc->stride;
+	int nr = delta_read_count(L, r);
+	struct delta_reader removed = *r;
 	int i;
-	int removed_index = 0;
-	unsigned int removed_eid = removed->id[removed_index];
-	int index = find_boundary(0, reference->n, reference->id, removed_eid);
-	int reference_index = index + 1;
-	int removed_reference = 0;
-	for (i=index; i< reference->n; i++) {
-		int rtype = lua_geti(L, -1, i+1);
-		if (rtype != LUA_TBOOLEAN && rtype != LUA_TTABLE) {
-			// false means removed reference
-			return luaL_error(L, "Invalid reference object");
-		}
-		if (removed_eid) {
-			while (removed_eid < reference->id[i]) {
-				removed_index = next_removed_index(removed_index, removed, &removed_eid);
-			}
+	for (i=0;i<nr;i++)
+		delta_read_varint(L, r);
+	int na = delta_read_count(L, r);
+	struct delta_reader added = *r;
+	for (i=0;i<na;i++)
+		delta_read_varint(L, r);
+	const char *rows = delta_read(L, r, stride * na);
+	delta_check(L, c, dc->cid, removed, nr, 1);
+	delta_check(L, c, dc->cid, added, na, 0);
+	delta_remove(L, c, removed, nr);
+	if (na > 0) {
+		struct command_op *ops = (struct command_op *)lua_newuserdatauv(L, na * sizeof(struct command_op), 0);
+		unsigned int eid = 0;
+		for (i=0;i<na;i++) {
+			eid = delta_read_id(L, &added, eid, i == 0);
+			ops[i].cid = dc->cid;
+			ops[i].op = ECS_CMD_ADD;
+			ops[i].eid = eid;
+			ops[i].order = i;
+			ops[i].payload = stride > 0 ? rows + stride * i : NULL;
 		}
-		if (removed_eid == reference->id[i]) {
-			// removed reference, clear reference id
-			lua_pushnil(L);
-			removed_index = next_removed_index(removed_index, removed, &removed_eid);
-		} else {
-			// update reference id
-			lua_pushinteger(L, reference_index);
-			++reference_index;
+		if (eid > w->max_id) {
+			mask_live(w, w->max_id + 1, eid + 1);
+			w->max_id = eid;
 		}
-		if (rtype == LUA_TBOOLEAN) {
-			// set id = 0, so removed_reference() can remove them
-			--reference_index;
-			reference->id[i] = 0;
-			if (removed_reference == 0) {
-				removed_reference = i + 1;
+		command_apply(L, w, dc->cid, ops, na);
+		lua_pop(L, 1);
+	}
+	int nc = delta_read_count(L, r);
+	if (nc > 0 && stride == 0)
+		luaL_error(L, "Invalid delta of tag %d", dc->cid);
+	unsigned int eid = 0;
+	int pos = 0;
+	for (i=0;i<nc;i++) {
+		eid = delta_read_id(L, r, eid, i == 0);
+		uint64_t mask = delta_read_varint(L, r);
+		if (!delta_has(c, &pos, eid))
+			luaL_error(L, "Entity %d missing in type %d", eid, dc->cid);
+		char *row = (char *)get_row(c, pos);
+		int f;
+		for (f=0;mask;f++,mask>>=1) {
+			if (mask & 1) {
+				if (f >= dc->field_n)
+					luaL_error(L, "Invalid field %d of type %d in delta", f, dc->cid);
+				memcpy(row + dc->field[f].offset, delta_read(L, r, dc->field[f].size), dc->field[f].size);
 			}
-			lua_pop(L, 2);
-		} else {
-			lua_seti(L, -2, 1);
-			lua_pop(L, 1);
 		}
+		commit_row(c, pos);
+		stamp_row(w, c, pos);
 	}
-	if (removed_reference) {
-		remove_unused_reference(L, reference, removed_reference - 1);
+}
+
+// world, delta, { spec1, spec2, ... }
+static int
+ldelta_apply(lua_State *L) {
+	struct entity_world *w = getW(L);
+	size_t sz;
+	const char *data = luaL_checklstring(L, 2, &sz);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	struct delta_reader r = { (const unsigned char *)data, (const unsigned char *)data + sz };
+	int n = delta_read_count(L, &r);
+	if (n != (int)lua_rawlen(L, 3))
+		return luaL_error(L, "Types mismatch in delta");
+	command_playback(L, w);
+	struct delta_component dc;
+	int i;
+	for (i=0;i<n;i++) {
+		if (lua_rawgeti(L, 3, i+1) != LUA_TTABLE)
+			return luaL_error(L, "Invalid type spec %d", i+1);
+		delta_spec(L, w, lua_gettop(L), &dc);
+		lua_pop(L, 1);
+		delta_apply_component(L, w, &r, &dc);
+	}
+	if (r.ptr != r.end)
+		return luaL_error(L, "Invalid delta");
+	return 0;
+}
+
+static int
+ldelete_world(lua_State *L) {
+	struct entity_world *w = getW(L);
+	int i;
+	for (i=0;i<MAX_COMPONENT;i++) {
+		struct component_pool *c = &w->c[i];
+		pool_free(w, c);
+		if (c->sparse)
+			sparse_index_free(w, c);
+		chunk_shrink(w, c, 0);
+		c->n = 0;
+		if (c->soa) {
+			world_free(w, c->row, c->stride);
+			world_free(w, c->soa, c->soa_n * sizeof(struct soa_column));
+			c->row = NULL;
+			c->soa = NULL;
+			c->soa_n = 0;
+		}
 	}
+	parallel_release(w);
+	command_release(w);
+	mask_release(w);
+	world_free(w, w->slot, w->slot_cap * sizeof(struct handle_slot));
+	w->slot = NULL;
+	w->slot_n = w->slot_cap = 0;
+	w->slot_free = -1;
+	image_unmap(&w->image);
+	arena_release(&w->arena);
 	return 0;
 }
 
@@ -1782,6 +6461,8 @@ ldumpid(lua_State *L) {
 	struct entity_world *w = getW(L);
 	int cid = check_cid(L, w, 2);
 	struct component_pool *c = &w->c[cid];
+	if (c->flags & POOL_BITSET)
+		bitset_materialize(c);
 	lua_createtable(L, c->n, 0);
 	int i;
 	for (i=0;i<c->n;i++) {
@@ -1796,6 +6477,8 @@ luaopen_ecs_core(lua_State *L) {
 	luaL_checkversion(L);
 	luaL_Reg l[] = {
 		{ "_world", lnew_world },
+		{ "_snapshot", lsnapshot_schema },
+		{ "_map", lmap },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
@@ -1804,23 +6487,40 @@ luaopen_ecs_core(lua_State *L) {
 	if (luaL_newmetatable(L, "ENTITY_WORLD")) {
 		luaL_Reg l[] = {
 			{ "__index", NULL },
+			{ "__gc", ldelete_world },
 			{ "memory", lcount_memory },
 			{ "collect", lcollect_memory },
 			{ "_newtype",lnew_type },
 			{ "_newentity", lnew_entity },
 			{ "_addcomponent", ladd_component },
+			{ "_fill", lfill },
 			{ "_update", lupdate },
+			{ "_rearrange", lrearrange },
+			{ "_handletype", lhandle_type },
+			{ "_handle", lhandle },
+			{ "_fetch", lhandle_index },
 			{ "_clear", lclear_type },
 			{ "_context", lcontext },
+			{ "_systems", lsystems },
+			{ "_tagbatch", ltag_batch },
+			{ "_chunkiter", lchunk_iter },
+			{ "_viewiter", lview_iter },
 			{ "_groupiter", lgroupiter },
 			{ "remove", lremove },
 			{ "_object", lobject },
+			{ "_objects", lobjects },
 			{ "_sync", lsync },
 			{ "_read", lread },
 			{ "_release", lrelease },
 			{ "_reuse", lreuse },
 			{ "_update_reference", lupdate_reference },
 			{ "_dumpid", ldumpid },
+			{ "_setop", lset_op },
+			{ "_save", lsave },
+			{ "_load", lload },
+			{ "_deltaencoder", ldelta_encoder },
+			{ "_deltaencode", ldelta_encode },
+			{ "_deltaapply", ldelta_apply },
 			{ NULL, NULL },
 		};
 		luaL_setfuncs(L,l,0);
@@ -1854,6 +6554,20 @@ luaopen_ecs_core(lua_State *L) {
 	lua_setfield(L, -2, "_REMOVED");
 	lua_pushinteger(L, STRIDE_ORDER);
 	lua_setfield(L, -2, "_ORDERKEY");
+	lua_pushinteger(L, POOL_SPARSE);
+	lua_setfield(L, -2, "_SPARSE");
+	lua_pushinteger(L, POOL_BITSET);
+	lua_setfield(L, -2, "_BITSET");
+	lua_pushinteger(L, POOL_CHUNK);
+	lua_setfield(L, -2, "_CHUNK");
+	lua_pushinteger(L, POOL_SOA);
+	lua_setfield(L, -2, "_SOA");
+	lua_pushinteger(L, ECS_SET_INTERSECT);
+	lua_setfield(L, -2, "_SET_INTERSECT");
+	lua_pushinteger(L, ECS_SET_UNION);
+	lua_setfield(L, -2, "_SET_UNION");
+	lua_pushinteger(L, ECS_SET_DIFFERENCE);
+	lua_setfield(L, -2, "_SET_DIFFERENCE");
 	lua_pushlightuserdata(L, NULL);
 	lua_setfield(L, -2, "NULL");
 
@@ -1935,6 +6649,235 @@ ltestuserdata(lua_State *L) {
 	return 0;
 }
 
+static int
+lsumcolumn(lua_State *L) {
+	struct ecs_context *ctx = lua_touserdata(L, 1);
+	int field = luaL_checkinteger(L, 2);
+	int n;
+	float *v = (float *)entity_column(ctx, COMPONENT_VECTOR2, field, &n);
+	float s = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		s += v[i];
+	}
+	lua_pushnumber(L, s);
+	return 1;
+}
+
+static int
+lnewbatch(lua_State *L) {
+	struct ecs_context *ctx = lua_touserdata(L, 1);
+	int count = luaL_checkinteger(L, 2);
+	struct vector2 v[4] = { { 1, 2 }, { 3, 4 }, { 5, 6 }, { 7, 8 } };
+	int first = entity_new_batch(ctx, COMPONENT_VECTOR2, v, count < 4 ? count : 4, sizeof(v[0]));
+	if (count > 4)
+		entity_new_batch(ctx, COMPONENT_VECTOR2, &v[0], count - 4, 0);
+	lua_pushinteger(L, first);
+	return 1;
+}
+
+// move the vector at index, and mark it changed
+static int
+lmove(lua_State *L) {
+	struct ecs_context *ctx = lua_touserdata(L, 1);
+	int index = luaL_checkinteger(L, 2) - 1;
+	struct vector2 *v = (struct vector2 *)entity_iter(ctx, COMPONENT_VECTOR2, index);
+	if (v == NULL)
+		return 0;
+	v->x += 1;
+	entity_mark_changed(ctx, COMPONENT_VECTOR2, index);
+	return 0;
+}
+
+struct parallel_sum {
+	double sum;
+	int mark;
+	int calls;
+	char padding[48];
+};
+
+static void
+parallel_scale(struct ecs_context *ctx, int from, int to, int thread, void *ud) {
+	struct parallel_sum *r = (struct parallel_sum *)ud + thread;
+	int i;
+	for (i=from;i<to;i++) {
+		struct vector2 *v = (struct vector2 *)entity_iter(ctx, COMPONENT_VECTOR2, i);
+		v->x *= 2;
+		v->y *= 2;
+		r->sum += v->x + v->y;
+		if (entity_sibling(ctx, COMPONENT_VECTOR2, i, TAG_MARK))
+			++r->mark;
+	}
+	++r->calls;
+}
+
+static int
+lparallel(lua_State *L) {
+	struct ecs_context *ctx = lua_touserdata(L, 1);
+	int grain = luaL_checkinteger(L, 2);
+	int n = entity_parallel_threads(ctx);
+	struct parallel_sum r[PARALLEL_MAXTHREAD];
+	memset(r, 0, sizeof(r));
+	if (entity_parallel_for(ctx, COMPONENT_VECTOR2, parallel_scale, r, grain))
+		return luaL_error(L, "parallel_for failed");
+	double sum = 0;
+	int mark = 0;
+	int calls = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		sum += r[i].sum;
+		mark += r[i].mark;
+		calls += r[i].calls;
+	}
+	lua_pushnumber(L, sum);
+	lua_pushinteger(L, mark);
+	lua_pushinteger(L, calls);
+	lua_pushinteger(L, n);
+	return 4;
+}
+
+static void
+parallel_command(struct ecs_context *ctx, int from, int to, int thread, void *ud) {
+	int i;
+	for (i=from;i<to;i++) {
+		struct vector2 *v = (struct vector2 *)entity_iter(ctx, COMPONENT_VECTOR2, i);
+		int x = (int)v->x;
+		uint64_t e = entity_cmd_entity(ctx, COMPONENT_VECTOR2, i);
+		if (x % 2 == 0)
+			entity_cmd_add(ctx, thread, i, e, TAG_MARK, NULL);
+		if (x % 4 == 0)
+			entity_cmd_disable_tag(ctx, thread, i, e, TAG_MARK);
+		if (x % 5 == 0) {
+			struct id id = { x * 10 };
+			entity_cmd_add(ctx, thread, i, e, COMPONENT_ID, &id);
+		}
+		if (x % 3 == 0)
+			entity_cmd_remove(ctx, thread, i, e);
+		if (x % 10 == 0) {
+			uint64_t spawn = entity_cmd_new(ctx, thread, i);
+			struct vector2 sv = { -v->x, v->y };
+			struct id sid = { -x };
+			entity_cmd_add(ctx, thread, i, spawn, COMPONENT_VECTOR2, &sv);
+			entity_cmd_add(ctx, thread, i, spawn, COMPONENT_ID, &sid);
+		}
+	}
+}
+
+static int
+lcommand(lua_State *L) {
+	struct ecs_context *ctx = lua_touserdata(L, 1);
+	int grain = luaL_checkinteger(L, 2);
+	if (entity_parallel_for(ctx, COMPONENT_VECTOR2, parallel_command, NULL, grain))
+		return luaL_error(L, "parallel_for failed");
+	return 0;
+}
+
+static void
+system_double(struct ecs_context *ctx, int thread, void *ud) {
+	struct vector2 *v;
+	int i;
+	for (i=0;(v=(struct vector2 *)entity_iter(ctx, COMPONENT_VECTOR2, i));i++) {
+		v->x *= 2;
+		v->y *= 2;
+	}
+}
+
+static void
+system_count(struct ecs_context *ctx, int thread, void *ud) {
+	int *count = (int *)ud;
+	int i;
+	for (i=0;entity_iter(ctx, COMPONENT_VECTOR2, i);i++) {
+		if (entity_sibling(ctx, COMPONENT_VECTOR2, i, TAG_MARK))
+			++count[thread];
+	}
+}
+
+// spawn and tagger run in the same wave, and both record commands
+static void
+system_spawn(struct ecs_context *ctx, int thread, void *ud) {
+	struct vector2 *v;
+	int i;
+	for (i=0;(v=(struct vector2 *)entity_iter(ctx, COMPONENT_VECTOR2, i));i++) {
+		if ((int)v->x % 3 == 0) {
+			uint64_t e = entity_cmd_new(ctx, thread, i);
+			struct vector2 sv = { -v->x, v->y };
+			entity_cmd_add(ctx, thread, i, e, COMPONENT_VECTOR2, &sv);
+		}
+	}
+}
+
+static void
+system_tagger(struct ecs_context *ctx, int thread, void *ud) {
+	struct vector2 *v;
+	int i;
+	for (i=0;(v=(struct vector2 *)entity_iter(ctx, COMPONENT_VECTOR2, i));i++) {
+		if ((int)v->x % 2 == 0) {
+			uint64_t e = entity_cmd_entity(ctx, COMPONENT_VECTOR2, i);
+			entity_cmd_add(ctx, thread, i, e, TAG_MARK, NULL);
+		}
+	}
+}
+
+static int test_counted[PARALLEL_MAXTHREAD];
+
+static int
+lsystem(lua_State *L) {
+	static struct ecs_system double_system = { system_double, NULL };
+	static struct ecs_system count_system = { system_count, test_counted };
+	static struct ecs_system spawn_system = { system_spawn, NULL };
+	static struct ecs_system tagger_system = { system_tagger, NULL };
+	const char *name = luaL_checkstring(L, 1);
+	if (strcmp(name, "double") == 0) {
+		lua_pushlightuserdata(L, &double_system);
+	} else if (strcmp(name, "count") == 0) {
+		lua_pushlightuserdata(L, &count_system);
+	} else if (strcmp(name, "spawn") == 0) {
+		lua_pushlightuserdata(L, &spawn_system);
+	} else if (strcmp(name, "tagger") == 0) {
+		lua_pushlightuserdata(L, &tagger_system);
+	} else {
+		return luaL_error(L, "Unknown system %s", name);
+	}
+	return 1;
+}
+
+static int
+lcounted(lua_State *L) {
+	int n = 0;
+	int i;
+	for (i=0;i<PARALLEL_MAXTHREAD;i++) {
+		n += test_counted[i];
+		test_counted[i] = 0;
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static size_t test_allocated = 0;
+
+static void *
+test_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	test_allocated = test_allocated - (ptr ? osize : 0) + nsize;
+	if (nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+	return realloc(ptr, nsize);
+}
+
+static int
+lallocator(lua_State *L) {
+	static struct ecs_allocator alloc = { test_alloc, NULL };
+	lua_pushlightuserdata(L, &alloc);
+	return 1;
+}
+
+static int
+lallocated(lua_State *L) {
+	lua_pushinteger(L, test_allocated);
+	return 1;
+}
+
 LUAMOD_API int
 luaopen_ecs_ctest(lua_State *L) {
 	luaL_checkversion(L);
@@ -1943,6 +6886,15 @@ luaopen_ecs_ctest(lua_State *L) {
 		{ "sum", lsum },
 		{ "get", lget },
 		{ "testuserdata", ltestuserdata },
+		{ "sumcolumn", lsumcolumn },
+		{ "newbatch", lnewbatch },
+		{ "move", lmove },
+		{ "parallel", lparallel },
+		{ "system", lsystem },
+		{ "command", lcommand },
+		{ "counted", lcounted },
+		{ "allocator", lallocator },
+		{ "allocated", lallocated },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
@@ -2,9 +2,41 @@
 #define lua_ecs_cdata_h
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ECS_SET_INTERSECT 1
+#define ECS_SET_UNION 2
+#define ECS_SET_DIFFERENCE 3
+
+#define ECS_CMD_NEW 0
+#define ECS_CMD_ADD 1
+#define ECS_CMD_DEL 2
 
 struct entity_world;
 
+// The world owns the memory of components through this allocator, the same protocol as lua_Alloc.
+// It should outlive the world.
+struct ecs_allocator {
+	void * (*alloc)(void *ud, void *ptr, size_t osize, size_t nsize);
+	void *ud;
+};
+
+struct ecs_context;
+
+// Runs on [from, to) of a pool. thread is 0 for the caller of entity_parallel_for, 1 .. threads-1 for the workers.
+typedef void (*ecs_parallel_func)(struct ecs_context *ctx, int from, int to, int thread, void *ud);
+
+// A C system for the scheduler (world:system in ecs.lua), pass its address as a lightuserdata.
+// Systems of a wave run in parallel, so they must not change any pool, the same as ecs_parallel_func.
+// thread is the one it runs on, for the command buffers and per thread data.
+typedef void (*ecs_system_func)(struct ecs_context *ctx, int thread, void *ud);
+
+struct ecs_system {
+	ecs_system_func func;
+	void *ud;
+};
+
 struct ecs_capi {
 	void * (*iter)(struct entity_world *w, int cid, int index);
 	void (*clear_type)(struct entity_world *w, int cid);
@@ -16,6 +48,18 @@ struct ecs_capi {
 	void (*disable_tag)(struct entity_world *w, int cid, int index, int tag_id);
 	void * (*iter_lua)(struct entity_world *w, int cid, int index, void *L, int world_index);
 	int (*assign_lua)(struct entity_world *w, int cid, int index, void *L, int world_index);
+	const unsigned int * (*ids)(struct entity_world *w, int cid, int *n);
+	int (*set_op)(int op, const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out);
+	void * (*column)(struct entity_world *w, int cid, int field, int *n);
+	int (*new_batch)(struct entity_world *w, int cid, const void *buffer, int count, int stride, void *L, int world_index);
+	uint64_t (*handle)(struct entity_world *w, int cid, int index);
+	int (*handle_index)(struct entity_world *w, uint64_t handle, int cid);
+	int (*parallel_for)(struct entity_world *w, int cid, ecs_parallel_func fn, struct ecs_context *ctx, void *ud, int grain);
+	int (*threads)(struct entity_world *w);
+	uint64_t (*command)(struct entity_world *w, int thread, int key, int op, uint64_t entity, int cid, const void *buffer);
+	void (*tag_batch)(struct entity_world *w, int cid, const unsigned int *eid, int n, int enable, void *L, int world_index);
+	void (*changed)(struct entity_world *w, int cid, int index);
+	unsigned int (*eid)(struct entity_world *w, int cid, int index);
 };
 
 struct ecs_context {
@@ -37,6 +81,14 @@ entity_iter(struct ecs_context *ctx, int cid, int index) {
 	return ctx->api->iter(ctx->world, ctx->cid[cid], index);
 }
 
+// For a soa component, entity_iter returns the address of its first field.
+// Use entity_column for the others.
+static inline void *
+entity_column(struct ecs_context *ctx, int cid, int field, int *n) {
+	check_id_(ctx, cid);
+	return ctx->api->column(ctx->world, ctx->cid[cid], field, n);
+}
+
 static inline void *
 entity_ref_object(struct ecs_context *ctx, int cid, int index) {
 	if (index <= 0)
@@ -83,6 +135,87 @@ entity_new(struct ecs_context *ctx, int cid, const void *buffer) {
 	return ctx->api->new_entity(ctx->world, ctx->cid[cid], buffer, ctx->L, 1);
 }
 
+// Create count entities with component cid, returns the index of the first one.
+// Component i comes from buffer + stride * i, stride 0 copies the same buffer. buffer can be NULL.
+static inline int
+entity_new_batch(struct ecs_context *ctx, int cid, const void *buffer, int count, int stride) {
+	check_id_(ctx, cid);
+	return ctx->api->new_batch(ctx->world, ctx->cid[cid], buffer, count, stride, ctx->L, 1);
+}
+
+// Generational handle of the entity, 0 if the world has no handles. It's still valid after rearrange.
+static inline uint64_t
+entity_handle(struct ecs_context *ctx, int cid, int index) {
+	check_id_(ctx, cid);
+	return ctx->api->handle(ctx->world, ctx->cid[cid], index);
+}
+
+// Returns the index of the entity in cid, or -1 if the handle is stale or the entity has no cid.
+static inline int
+entity_handle_index(struct ecs_context *ctx, uint64_t handle, int cid) {
+	check_id_(ctx, cid);
+	return ctx->api->handle_index(ctx->world, handle, ctx->cid[cid]);
+}
+
+// Splits the pool of cid into ranges of grain components, and runs fn on them in the thread pool of the world.
+// fn may read and write the components (iter, sibling, handle_index) but must not change any pool.
+// Returns -1 when it's called in fn.
+static inline int
+entity_parallel_for(struct ecs_context *ctx, int cid, ecs_parallel_func fn, void *ud, int grain) {
+	check_id_(ctx, cid);
+	return ctx->api->parallel_for(ctx->world, ctx->cid[cid], fn, ctx, ud, grain);
+}
+
+// The number of threads of entity_parallel_for, for the size of per thread data.
+static inline int
+entity_parallel_threads(struct ecs_context *ctx) {
+	return ctx->api->threads(ctx->world);
+}
+
+// Deferred structural changes, they are safe in parallel_for and systems, and played back in the next update.
+// thread is the one of ecs_parallel_func or ecs_system_func (0 out of them), each thread records into its own buffer.
+// The commands are played back in the order of key (then thread and recording order), so use a key
+// from the work, such as the index in parallel_for, for a deterministic result.
+
+// An entity created in playback, it can be the target of other commands.
+static inline uint64_t
+entity_cmd_new(struct ecs_context *ctx, int thread, int key) {
+	return ctx->api->command(ctx->world, thread, key, ECS_CMD_NEW, 0, 0, NULL);
+}
+
+// An existing entity as the target of commands
+static inline uint64_t
+entity_cmd_entity(struct ecs_context *ctx, int cid, int index) {
+	check_id_(ctx, cid);
+	return ctx->api->eid(ctx->world, ctx->cid[cid], index);
+}
+
+// Add a component (the buffer is copied) or enable a tag (buffer is NULL). Lua objects and order keys are not supported.
+static inline void
+entity_cmd_add(struct ecs_context *ctx, int thread, int key, uint64_t entity, int cid, const void *buffer) {
+	check_id_(ctx, cid);
+	ctx->api->command(ctx->world, thread, key, ECS_CMD_ADD, entity, ctx->cid[cid], buffer);
+}
+
+static inline void
+entity_cmd_disable_tag(struct ecs_context *ctx, int thread, int key, uint64_t entity, int tag_id) {
+	check_id_(ctx, tag_id);
+	ctx->api->command(ctx->world, thread, key, ECS_CMD_DEL, entity, ctx->cid[tag_id], NULL);
+}
+
+static inline void
+entity_cmd_remove(struct ecs_context *ctx, int thread, int key, uint64_t entity) {
+	ctx->api->command(ctx->world, thread, key, ECS_CMD_ADD, entity, ctx->cid[0], NULL);
+}
+
+// Mark the component at index as changed after writing it through entity_iter, for the patterns of name:changed.
+// It's safe in parallel_for and systems for the rows each one writes.
+static inline void
+entity_mark_changed(struct ecs_context *ctx, int cid, int index) {
+	check_id_(ctx, cid);
+	ctx->api->changed(ctx->world, ctx->cid[cid], index);
+}
+
 static inline void
 entity_remove(struct ecs_context *ctx, int cid, int index) {
 	check_id_(ctx, cid);
@@ -103,6 +236,20 @@ entity_disable_tag(struct ecs_context *ctx, int cid, int index, int tag_id) {
 	ctx->api->disable_tag(ctx->world, ctx->cid[cid], index, ctx->cid[tag_id]);
 }
 
+// Enable a tag of n entities in one merge, eid (from entity_ids or entity_cmd_entity) needn't be sorted.
+// Don't use it on the tag in iteration.
+static inline void
+entity_enable_tag_batch(struct ecs_context *ctx, int tag_id, const unsigned int *eid, int n) {
+	check_id_(ctx, tag_id);
+	ctx->api->tag_batch(ctx->world, ctx->cid[tag_id], eid, n, 1, ctx->L, 1);
+}
+
+static inline void
+entity_disable_tag_batch(struct ecs_context *ctx, int tag_id, const unsigned int *eid, int n) {
+	check_id_(ctx, tag_id);
+	ctx->api->tag_batch(ctx->world, ctx->cid[tag_id], eid, n, 0, ctx->L, 1);
+}
+
 static inline int
 entity_assign_lua(struct ecs_context *ctx, int cid, int index) {
 	check_id_(ctx, cid);
@@ -110,6 +257,27 @@ entity_assign_lua(struct ecs_context *ctx, int cid, int index) {
 	return ctx->api->assign_lua(ctx->world, ctx->cid[cid], index-1, ctx->L, 1);
 }
 
+// sorted eids of a type, valid until next structural change
+static inline const unsigned int *
+entity_ids(struct ecs_context *ctx, int cid, int *n) {
+	check_id_(ctx, cid);
+	return ctx->api->ids(ctx->world, ctx->cid[cid], n);
+}
+
+// out can be NULL to count only, it should be large enough for na + nb ids
+static inline int
+entity_set_op(struct ecs_context *ctx, int op, const unsigned int *a, int na, const unsigned int *b, int nb, unsigned int *out) {
+	return ctx->api->set_op(op, a, na, b, nb, out);
+}
+
+static inline int
+entity_count_set(struct ecs_context *ctx, int op, int cid_a, int cid_b) {
+	int na, nb;
+	const unsigned int *a = entity_ids(ctx, cid_a, &na);
+	const unsigned int *b = entity_ids(ctx, cid_b, &nb);
+	return ctx->api->set_op(op, a, na, b, nb, NULL);
+}
+
 static inline int
 entity_new_ref(struct ecs_context *ctx, int cid) {
 	check_id_(ctx, cid);
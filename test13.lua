@@ -0,0 +1,55 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "value",
+	type = "int",
+	sparse = true,
+}
+
+w:register {
+	name = "mark",
+	sparse = true,
+}
+
+w:register {
+	name = "index",
+	type = "int",
+}
+
+for i = 1, 10 do
+	w:new {
+		index = i,
+		value = i * 10,
+		mark = (i % 2 == 0) or nil,
+	}
+end
+
+w:new { index = 11 }
+
+local function check(pat)
+	print(pat)
+	for v in w:select(pat) do
+		print(v.index, v.value, v.mark)
+	end
+end
+
+check "index:in value:in mark?in"
+
+for v in w:select "index:in mark?out" do
+	v.mark = (v.index % 3 == 0)
+end
+
+check "index:in mark:exist"
+
+for v in w:select "index:in" do
+	if v.index % 4 == 0 then
+		w:remove(v)
+	end
+end
+
+w:update()
+
+check "index:in value?in mark?in"
+check "mark:in index:in"
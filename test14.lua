@@ -0,0 +1,61 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "index",
+	type = "int",
+}
+
+w:register {
+	name = "visible",
+	bitset = true,
+}
+
+w:register {
+	name = "dirty",
+	bitset = true,
+}
+
+for i = 1, 10 do
+	w:new {
+		index = i,
+		visible = (i % 2 == 0) or nil,
+	}
+end
+
+local function check(pat)
+	print(pat)
+	for v in w:select(pat) do
+		print(v.index, v.visible, v.dirty)
+	end
+end
+
+check "index:in visible?in"
+
+for v in w:select "index:in visible?out dirty?out" do
+	v.visible = (v.index % 3 == 0)
+	v.dirty = (v.index > 5)
+end
+
+check "visible index:in"
+check "index:in visible:absent dirty?in"
+
+for v in w:select "dirty index:in" do
+	if v.index % 4 == 0 then
+		w:remove(v)
+	end
+end
+
+w:update()
+
+check "dirty:in index:in visible?in"
+
+for v in w:select "dirty:out" do
+	v.dirty = false
+end
+
+check "index:in dirty:exist"
+
+print(pcall(w.register, w, { name = "bad", bitset = true, sparse = true }))
+print(pcall(w.register, w, { name = "bad2", type = "int", bitset = true }))
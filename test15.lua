@@ -0,0 +1,56 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "index",
+	type = "int",
+}
+
+w:register {
+	name = "a",
+}
+
+w:register {
+	name = "b",
+	bitset = true,
+}
+
+w:register {
+	name = "c",
+}
+
+for i = 1, 100 do
+	w:new {
+		index = i,
+		a = (i % 2 == 0) or nil,
+		b = (i % 3 == 0) or nil,
+		c = (i % 5 == 0) or nil,
+	}
+end
+
+-- disable some tags, make duplicated ids in tag a
+for v in w:select "index:in a?out" do
+	if v.index % 7 == 0 then
+		v.a = false
+	end
+end
+
+local function check(expr)
+	local ids = w:ids(expr)
+	print(expr, w:count(expr), #ids, table.concat(ids, " "))
+end
+
+check "a"
+check "a & b"
+check "a & b - c"
+check "a | b"
+check "b | c - a"
+check "index - a - b - c"
+check "a&c"
+
+local n = 0
+for v in w:select "a b c:absent" do
+	n = n + 1
+end
+assert(n == w:count "a & b - c")
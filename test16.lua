@@ -0,0 +1,67 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+	chunk = true,
+}
+
+w:register {
+	name = "index",
+	type = "int",
+	chunk = true,
+}
+
+local N = 40000
+
+for i = 1, N do
+	w:new {
+		index = i,
+		vector = (i % 2 == 0) and { x = i, y = -i } or nil,
+	}
+end
+
+local function check()
+	local n, sum = 0, 0
+	for v in w:select "index:in vector:in" do
+		assert(v.vector.x == v.index and v.vector.y == -v.index)
+		n = n + 1
+		sum = sum + v.index
+	end
+	print("count", n, "sum", sum)
+end
+
+check()
+
+for v in w:select "index:in" do
+	if v.index % 3 == 0 then
+		w:remove(v)
+	end
+end
+
+w:update()
+check()
+
+for v in w:select "index:in" do
+	if v.index > 1000 then
+		w:remove(v)
+	end
+end
+
+w:update()
+check()
+local before = w:memory()
+w:collect()
+print("shrink", w:memory() < before)
+check()
+
+for i = 1, 20000 do
+	w:new {
+		index = N + i,
+		vector = { x = N + i, y = -(N + i) },
+	}
+end
+check()
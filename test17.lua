@@ -0,0 +1,60 @@
+local ecs = require "ecs"
+local test = require "ecs.ctest"
+
+local w = ecs.world { allocator = test.allocator() }
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+}
+
+w:register {
+	name = "mark",
+}
+
+w:register {
+	name = "visible",
+	bitset = true,
+}
+
+w:register {
+	name = "index",
+	type = "int",
+	sparse = true,
+}
+
+for i = 1, 1000 do
+	w:new {
+		vector = { x = i, y = i },
+		index = i,
+		mark = (i % 2 == 0) or nil,
+		visible = (i % 3 == 0) or nil,
+	}
+end
+
+-- all the memory of components comes from the allocator
+local size = w:memory() - test.allocated()
+print("allocated", test.allocated() > 0)
+
+for v in w:select "index:in" do
+	if v.index > 10 then
+		w:remove(v)
+	end
+end
+w:update()
+
+local n = 0
+for v in w:select "vector:in mark:exist visible:exist" do
+	n = n + 1
+end
+print("count", n)
+
+print("exact", w:memory() - test.allocated() == size)
+local allocated = test.allocated()
+w:collect()
+print("shrink", test.allocated() < allocated, w:memory() - test.allocated() == size)
+
+-- release all the memory explicitly
+getmetatable(w).__gc(w)
+print("free", test.allocated())
@@ -0,0 +1,58 @@
+local ecs = require "ecs"
+local test = require "ecs.ctest"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+	"z:double",
+	layout = "soa",
+}
+
+w:register {
+	name = "index",
+	type = "int",
+}
+
+for i = 1, 300 do
+	w:new {
+		index = i,
+		vector = { x = i, y = i * 2, z = i * 0.5 },
+	}
+end
+
+local ctx = w:context { "vector" }
+
+print("sum x", test.sumcolumn(ctx, 0), "sum y", test.sumcolumn(ctx, 1))
+
+for v in w:select "index:in vector:update" do
+	v.vector.x = -v.vector.x
+end
+
+for v in w:select "index:in vector:in" do
+	if v.index % 2 == 0 then
+		w:remove(v)
+	end
+end
+w:update()
+
+print("sum x", test.sumcolumn(ctx, 0), "sum y", test.sumcolumn(ctx, 1))
+
+for v in w:select "index:in vector:in" do
+	if v.index <= 5 then
+		print(v.index, v.vector.x, v.vector.y, v.vector.z)
+	end
+end
+
+w:collect()
+
+for v in w:select "index:in vector:update" do
+	if v.index > 290 then
+		v.vector.x = 0
+		v.vector.z = 0
+	end
+end
+
+print("sum x", test.sumcolumn(ctx, 0), "sum y", test.sumcolumn(ctx, 1))
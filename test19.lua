@@ -0,0 +1,63 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "value",
+	type = "int",
+}
+
+w:register {
+	name = "mark",
+}
+
+w:register {
+	name = "extra",
+	type = "int",
+}
+
+for i = 1, 20 do
+	w:new {
+		value = i,
+		mark = (i % 3 == 0) or nil,
+		extra = (i % 4 == 0) and i * 100 or nil,
+	}
+end
+
+local function dump(pat)
+	local t = {}
+	for v in w:select(pat) do
+		t[#t+1] = v.value .. ":" .. tostring(v.extra)
+	end
+	print(pat, table.concat(t, " "))
+end
+
+-- the second pass records the matches, and the third one uses them
+dump "value:in mark:exist extra?in"
+dump "value:in mark:exist extra?in"
+dump "value:in mark:exist extra?in"
+
+-- writing values keeps the cache
+for v in w:select "value:update mark:exist" do
+	v.value = v.value + 1000
+end
+dump "value:in mark:exist extra?in"
+
+-- structural changes invalidate the cache
+for v in w:select "value:in mark?out" do
+	v.mark = (v.value % 2 == 0)
+end
+dump "value:in mark:exist extra?in"
+
+w:new { value = 21, mark = true, extra = 1 }
+dump "value:in mark:exist extra?in"
+
+for v in w:select "value:in" do
+	if v.value > 1015 then
+		w:remove(v)
+	end
+end
+w:update()
+dump "value:in mark:exist extra?in"
+dump "value:in mark:absent"
+dump "value:in mark:absent"
@@ -0,0 +1,121 @@
+local ecs = require "ecs"
+local test = require "ecs.ctest"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+}
+
+w:register {
+	name = "soa",
+	"a:int",
+	"b:float",
+	layout = "soa",
+}
+
+w:register {
+	name = "value",
+	type = "int",
+	chunk = true,
+}
+
+w:register {
+	name = "name",
+	type = "lua",
+}
+
+w:register {
+	name = "mark",
+	bitset = true,
+}
+
+w:register {
+	name = "tag",
+}
+
+w:new { value = -1, name = "single" }
+
+w:new_batch({
+	vector = { x = 1, y = 2 },
+	soa = { a = 3, b = 0.5 },
+	value = function(i) return i * 10 end,
+	name = function(i) return "batch" .. i end,
+	mark = true,
+	tag = true,
+}, 1000)
+
+local eid, count = w:new_batch({ value = 42, name = "same", tag = false }, 7)
+print("eid", eid, count)
+
+-- the eids of batch are in a range
+local eids = {}
+for i = 0, count - 1 do
+	eids[#eids+1] = eid + i
+end
+w:tag_batch("mark", eids)
+local marked = 0
+for v in w:select "value:in mark" do
+	if v.value == 42 then
+		marked = marked + 1
+	end
+end
+w:tag_batch("mark", eids, false)
+print("marked", marked)
+
+local n = 0
+local sum = 0
+for v in w:select "vector:in soa:in value:in name:in mark tag" do
+	n = n + 1
+	assert(v.vector.x == 1 and v.vector.y == 2)
+	assert(v.soa.a == 3 and v.soa.b == 0.5)
+	assert(v.name == "batch" .. v.value // 10)
+	sum = sum + v.value
+end
+print("batch", n, sum)
+
+local same = 0
+for v in w:select "value:in name:in tag:absent" do
+	if v.value == 42 then
+		assert(v.name == "same")
+		same = same + 1
+	else
+		print(v.value, v.name)
+	end
+end
+print("same", same)
+
+for v in w:select "value:in vector:in" do
+	if v.value % 20 == 0 then
+		w:remove(v)
+	end
+end
+w:update()
+
+print("vector", w:count "vector", "mark", w:count "mark", "value", w:count "value")
+
+local ctx = w:context { "vector" }
+local first = test.newbatch(ctx, 6)
+print("first", first)
+local t = {}
+for v in w:select "vector:in value:absent" do
+	t[#t+1] = v.vector.x .. "," .. v.vector.y
+end
+print(table.concat(t, " "))
+
+-- struct components from function
+w:new_batch({
+	vector = function(i) return { x = -i, y = i * 2 } end,
+	soa = function(i) return { a = -i, b = i / 4 } end,
+}, 100)
+local n = 0
+for v in w:select "vector:in soa:in" do
+	if v.vector.x < 0 then
+		assert(v.vector.y == -v.vector.x * 2)
+		assert(v.soa.a == v.vector.x and v.soa.b == -v.vector.x / 4)
+		n = n + 1
+	end
+end
+print("function", n)
@@ -0,0 +1,70 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+local N = 120
+
+for i = 1, N do
+	w:register {
+		name = "t" .. i,
+		type = "int",
+	}
+end
+
+w:register {
+	name = "mark",
+	bitset = true,
+}
+
+for i = 1, N * 100 do
+	local k = i % N + 1
+	w:new {
+		["t" .. k] = i,
+		["t" .. (k % N + 1)] = -i,
+		mark = (i % 7 == 0),
+	}
+end
+
+-- remove a few entities of two types
+for v in w:select "t1:in" do
+	if v.t1 % 3 == 0 then
+		w:remove(v)
+	end
+end
+w:update()
+
+local function count(name)
+	local n = 0
+	for _ in w:select(name) do
+		n = n + 1
+	end
+	return n
+end
+
+print("t1", count "t1", "t2", count "t2", "t3", count "t3", "t120", count "t120", "mark", count "mark")
+
+for v in w:select "t1:in t2?in" do
+	assert(v.t1 % 3 ~= 0 and v.t2 == nil)
+end
+
+-- remove everything, all the pools are dirty
+for i = 1, N do
+	for v in w:select("t" .. i) do
+		w:remove(v)
+	end
+end
+w:update()
+
+local total = 0
+for i = 1, N do
+	total = total + count("t" .. i)
+end
+print("total", total, "mark", count "mark")
+
+w:new { t5 = 5, mark = true }
+w:new { t6 = 6 }
+for v in w:select "t5 mark" do
+	w:remove(v)
+end
+w:update()
+print("t5", count "t5", "t6", count "t6", "mark", count "mark")
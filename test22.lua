@@ -0,0 +1,151 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "index",
+	type = "int",
+}
+
+w:register {
+	name = "mark",
+}
+
+w:register {
+	name = "order",
+	order = true,
+}
+
+w:register {
+	name = "name",
+	type = "lua",
+}
+
+for i = 1, 40 do
+	w:new {
+		index = i,
+		mark = (i % 2 == 0),
+		order = (i % 3 == 0),
+		name = (i % 5 == 0) and ("n" .. i) or nil,
+	}
+end
+
+-- only the order key
+w:new { order = true }
+
+for v in w:select "index:in" do
+	if v.index % 4 ~= 1 then
+		w:remove(v)
+	end
+end
+w:update()
+
+local function dump()
+	local t = {}
+	for v in w:select "index:in mark?in name?in" do
+		t[#t+1] = v.index .. (v.mark and "*" or "") .. (v.name and v.name or "")
+	end
+	print(table.concat(t, " "))
+	local o = {}
+	for v in w:select "order index?in" do
+		o[#o+1] = tostring(v.index)
+	end
+	print("order", table.concat(o, " "))
+	print("ids", table.concat(w:dumpid "index", " "))
+end
+
+dump()
+
+-- renumber all at once
+w:rearrange()
+dump()
+
+for i = 41, 60 do
+	w:new { index = i, mark = (i % 2 == 0), order = (i % 3 == 0) }
+end
+for v in w:select "index:in" do
+	if v.index % 4 == 3 then
+		w:remove(v)
+	end
+end
+w:update()
+
+-- renumber 4 entities in each update
+w:rearrange(4)
+for i = 1, 10 do
+	w:update()
+end
+dump()
+
+-- remove entities in the middle of a pass, the ids are still dense at last
+local function alive()
+	local set = {}
+	for _, name in ipairs { "index", "mark", "order", "name" } do
+		for _, id in ipairs(w:dumpid(name)) do
+			set[id] = true
+		end
+	end
+	local ids = {}
+	for id in pairs(set) do
+		ids[#ids+1] = id
+	end
+	table.sort(ids)
+	return ids
+end
+
+local function dense(ids)
+	for i, id in ipairs(ids) do
+		if id ~= i then
+			return false
+		end
+	end
+	return true
+end
+
+for i = 61, 100 do
+	w:new { index = i }
+end
+for v in w:select "index:in" do
+	if v.index % 2 == 0 then
+		w:remove(v)
+	end
+end
+w:update()
+w:rearrange(4)
+w:update()
+w:update()
+-- some of them are renumbered already
+for v in w:select "index:in" do
+	if v.index % 5 == 1 then
+		w:remove(v)
+	end
+end
+w:update()
+w:rearrange()
+local ids = alive()
+print("dense", #ids, dense(ids))
+assert(dense(ids))
+
+-- the same for a pass of updates only
+for i = 101, 140 do
+	w:new { index = i }
+end
+for v in w:select "index:in" do
+	if v.index % 3 == 0 then
+		w:remove(v)
+	end
+end
+w:update()
+w:rearrange(3)
+w:update()
+for v in w:select "index:in" do
+	if v.index % 7 == 2 then
+		w:remove(v)
+	end
+end
+for i = 1, 40 do
+	w:update()
+end
+ids = alive()
+print("dense", #ids, dense(ids))
+assert(dense(ids))
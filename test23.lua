@@ -0,0 +1,91 @@
+local ecs = require "ecs"
+
+local w = ecs.world { handle = true }
+
+w:register {
+	name = "value",
+	type = "int",
+}
+
+w:register {
+	name = "name",
+	type = "lua",
+}
+
+w:register {
+	name = "mark",
+}
+
+-- the hidden type of handles doesn't take the name
+w:register {
+	name = "handle",
+	type = "int",
+}
+
+for i = 1, 10 do
+	w:new {
+		value = i,
+		name = "e" .. i,
+		mark = (i % 2 == 0),
+		handle = -i,
+	}
+end
+
+local handles = {}
+for v in w:select "value:in" do
+	handles[v.value] = w:handle(v)
+end
+
+local function show(h)
+	local v = w:fetch(h, "value")
+	if v == nil then
+		return "stale"
+	end
+	w:sync("value:in name:in mark?in", v)
+	return v.value .. v.name .. (v.mark and "*" or "")
+end
+
+local function dump()
+	local t = {}
+	for i = 1, 10 do
+		t[#t+1] = show(handles[i])
+	end
+	print(table.concat(t, " "))
+end
+
+dump()
+
+for v in w:select "value:in" do
+	if v.value % 3 == 0 then
+		w:remove(v)
+	end
+end
+-- removed entities are alive until update
+dump()
+w:update()
+dump()
+
+-- the slots are recycled with a new generation
+for i = 11, 13 do
+	w:new { value = i, name = "e" .. i }
+end
+for v in w:select "value:in" do
+	if v.value > 10 then
+		local h = w:handle(v)
+		assert(h ~= handles[3] and h ~= handles[6] and h ~= handles[9])
+		handles[v.value] = h
+	end
+end
+print(show(handles[11]), show(handles[12]), show(handles[13]))
+
+-- handles are still valid after rearrange
+w:rearrange()
+dump()
+print(show(handles[11]), show(handles[12]), show(handles[13]))
+
+assert(w:fetch(handles[2], "mark"))
+assert(w:sync("handle:in", w:fetch(handles[2], "handle")).handle == -2)
+assert(w:fetch(handles[1], "mark") == nil)
+
+-- the slot of last removed entity is used first
+assert((handles[11] & 0xffffffff) == (handles[9] & 0xffffffff))
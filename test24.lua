@@ -0,0 +1,69 @@
+local ecs = require "ecs"
+local test = require "ecs.ctest"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+}
+
+w:register {
+	name = "mark",
+}
+
+w:register {
+	name = "id",
+	type = "int",
+}
+
+local N = 10000
+
+for i = 1, N do
+	w:new {
+		vector = { x = i % 100, y = 1 },
+		mark = (i % 3 == 0),
+		id = i,
+	}
+end
+
+-- duplicated tags in the pool are removed before the threads run
+for v in w:select "mark id:in" do
+	if v.id % 2 == 0 then
+		v.mark = true
+	end
+end
+
+local function sum()
+	local s = 0
+	for v in w:select "vector:in" do
+		s = s + v.vector.x + v.vector.y
+	end
+	return s
+end
+
+local ctx = w:context { "vector", "mark", "id" }
+
+for _, grain in ipairs { 1, 64, 1000, N } do
+	local s, mark, calls, threads = test.parallel(ctx, grain)
+	assert(threads >= 1)
+	assert(s == sum())
+	assert(mark == N // 3)
+	-- a single thread runs the whole pool in one call
+	assert(calls == (threads == 1 and 1 or (N + grain - 1) // grain))
+	print("grain", grain, "sum", s, "mark", mark)
+end
+
+-- the pools are fine after parallel_for
+w:new { vector = { x = 1, y = 1 } }
+for v in w:select "vector id:in" do
+	if v.id % 10 ~= 0 then
+		w:remove(v)
+	end
+end
+w:update()
+print("vector", w:count "vector", "mark", w:count "mark")
+local s, mark = test.parallel(ctx, 16)
+assert(s == sum())
+print("sum", s, "mark", mark)
@@ -0,0 +1,74 @@
+local ecs = require "ecs"
+local test = require "ecs.ctest"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+}
+
+w:register {
+	name = "mark",
+}
+
+w:register {
+	name = "value",
+	type = "int",
+}
+
+w:register {
+	name = "sum",
+	type = "int",
+}
+
+for i = 1, 100 do
+	w:new {
+		vector = { x = i, y = 1 },
+		mark = (i % 4 == 0),
+		value = i,
+	}
+end
+w:new { sum = 0 }
+
+w:system("double", "vector:update", test.system "double", { "vector" })
+w:system("value", "value:update", function(world)
+	for v in world:select "value:update" do
+		v.value = v.value + 1
+	end
+end)
+w:system("count", "vector:in mark:in", test.system "count", { "vector", "mark" })
+w:system("sum", "value:in vector:in sum:update", function(world)
+	local s = 0
+	for v in world:select "value:in vector:in" do
+		s = s + v.value + math.tointeger(v.vector.x)
+	end
+	for v in world:select "sum:update" do
+		v.sum = s
+	end
+end)
+w:system("count2", "mark:in", test.system "count", { "vector", "mark" })
+
+for i, wave in ipairs(w:schedule()) do
+	print("wave", i, table.concat(wave, " "))
+end
+
+for i = 1, 3 do
+	w:run_systems()
+	print("sum", w:singleton("sum", "sum:in").sum, "counted", test.counted())
+end
+
+-- the schedule is rebuilt with new system
+w:system("clear", "mark:out", function(world)
+	for v in world:select "mark:out" do
+		v.mark = false
+	end
+end)
+for i, wave in ipairs(w:schedule()) do
+	print("wave", i, table.concat(wave, " "))
+end
+w:run_systems()
+print("sum", w:singleton("sum", "sum:in").sum, "counted", test.counted())
+w:run_systems()
+print("counted", test.counted())
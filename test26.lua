@@ -0,0 +1,58 @@
+local ecs = require "ecs"
+local test = require "ecs.ctest"
+
+local function init(opt)
+	local w = ecs.world()
+	w:register {
+		name = "vector",
+		"x:float",
+		"y:float",
+		chunk = opt.chunk,
+	}
+	w:register {
+		name = "mark",
+		bitset = opt.bitset,
+	}
+	w:register {
+		name = "id",
+		type = "int",
+		sparse = opt.sparse,
+	}
+	for i = 1, 40 do
+		w:new {
+			vector = { x = i, y = 1 },
+			id = (i % 2 == 1) and i or nil,
+			mark = (i % 8 == 0),
+		}
+	end
+	return w
+end
+
+local function dump(w)
+	local t = {}
+	for v in w:select "vector:in id?in mark?in" do
+		t[#t+1] = math.tointeger(v.vector.x) .. (v.id and ("=" .. v.id) or "") .. (v.mark and "*" or "")
+	end
+	return table.concat(t, " ")
+end
+
+local result
+for _, opt in ipairs { {}, { chunk = true, sparse = true }, { bitset = true } } do
+	local w = init(opt)
+	local ctx = w:context { "vector", "mark", "id" }
+	test.command(ctx, 3)
+	-- nothing changes before update
+	assert(w:count "vector" == 40)
+	w:update()
+	local r = dump(w)
+	if result == nil then
+		result = r
+		print(r)
+	else
+		assert(r == result)
+	end
+	for v in w:select "id:in" do
+		assert(v.id % 2 == 1 or v.id % 5 == 0)
+	end
+	print("vector", w:count "vector", "id", w:count "id", "mark", w:count "mark")
+end
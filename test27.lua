@@ -0,0 +1,64 @@
+local ecs = require "ecs"
+
+local function test(opt)
+	local w = ecs.world()
+	w:register {
+		name = "value",
+		type = "int",
+	}
+	w:register {
+		name = "visible",
+		sparse = opt.sparse,
+		bitset = opt.bitset,
+	}
+	local N = 30000
+	for i = 1, N do
+		w:new {
+			value = i,
+			visible = (i % 7 == 0),
+		}
+	end
+	-- duplicated ids in the tag pool
+	for v in w:select "visible value:in" do
+		if v.value % 2 == 0 then
+			v.visible = true
+		end
+	end
+	local ids = w:ids "value"
+	local even = {}
+	for i = #ids, 1, -1 do
+		if i % 2 == 0 then
+			even[#even+1] = ids[i]
+		end
+	end
+	even[#even+1] = ids[2]	-- duplicated eid
+	w:tag_batch("visible", even)
+	local n = 0
+	for v in w:select "visible value:in" do
+		assert(v.value % 2 == 0 or v.value % 7 == 0)
+		n = n + 1
+	end
+	local three = {}
+	for i = 3, N, 3 do
+		three[#three+1] = ids[i]
+	end
+	w:tag_batch("visible", three, false)
+	local m = 0
+	for v in w:select "visible value:in" do
+		assert(v.value % 3 ~= 0)
+		m = m + 1
+	end
+	-- remove some entities, the tag is still fine
+	for v in w:select "value:in" do
+		if v.value % 5 == 0 then
+			w:remove(v)
+		end
+	end
+	w:update()
+	w:tag_batch("visible", w:ids "value")
+	print(n, m, w:count "visible", w:count "value & visible")
+end
+
+test {}
+test { sparse = true }
+test { bitset = true }
@@ -0,0 +1,105 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+}
+
+w:register {
+	name = "pos",
+	"x:float",
+	"y:float",
+	layout = "soa",
+}
+
+w:register {
+	name = "value",
+	type = "int",
+	chunk = true,
+}
+
+w:register {
+	name = "name",
+	type = "lua",
+}
+
+w:register {
+	name = "mark",
+}
+
+for i = 1, 1000 do
+	w:new {
+		vector = { x = i, y = -i },
+		pos = (i % 2 == 0) and { x = 0, y = 0 } or nil,
+		value = i,
+		name = (i % 3 == 0) and ("n" .. i) or nil,
+		mark = (i % 5 == 0),
+	}
+end
+
+-- read only, the size of the last chunk is 1000 % 64
+local count, sum, chunks = 0, 0, 0
+for c in w:select_chunk("vector:in value:in", 64) do
+	chunks = chunks + 1
+	local x, value = c.vector.x, c.value
+	for i = 1, c.n do
+		assert(x[i] == value[i])
+		sum = sum + value[i]
+	end
+	count = count + c.n
+	assert(#value == c.n)
+end
+print("read", chunks, count, sum)
+
+-- update and out, with optional key and filter
+for c in w:select_chunk("value:in pos:out vector:update name?in mark:absent", 100) do
+	local px, py, vx, name = c.pos.x, c.pos.y, c.vector.x, c.name
+	for i = 1, c.n do
+		px[i] = c.value[i] * 2
+		-- py is not written
+		vx[i] = vx[i] + 0.5
+		if name[i] then
+			c.value[i] = 0	-- value is readonly, ignored
+		end
+	end
+end
+
+local n = 0
+for v in w:select "value:in pos:in vector:in mark?in" do
+	if v.mark then
+		assert(v.pos.x == 0 and v.vector.x == v.value)
+	else
+		assert(v.pos.x == v.value * 2 and v.pos.y == 0 and v.vector.x == v.value + 0.5)
+		n = n + 1
+	end
+end
+print("written", n)
+
+-- lua objects and optional tag
+for c in w:select_chunk("name:update mark?in", 50) do
+	for i = 1, c.n do
+		if c.mark[i] then
+			c.name[i] = c.name[i] .. "*"
+		end
+	end
+end
+local t = {}
+for v in w:select "name:in value:in" do
+	if v.value > 900 then
+		t[#t+1] = v.name
+	end
+end
+print(table.concat(t, " "))
+
+-- structural change in iteration
+local ok, err = pcall(function()
+	for c in w:select_chunk("value:update", 10) do
+		w:new { value = 0 }
+	end
+end)
+print(ok, err:match "changed" ~= nil)
+
+assert(not pcall(w.select_chunk, w, "mark:out value:in"))
@@ -0,0 +1,124 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+}
+
+w:register {
+	name = "pos",
+	"x:float",
+	"y:float",
+	"z:int",
+	layout = "soa",
+}
+
+w:register {
+	name = "value",
+	type = "int",
+}
+
+w:register {
+	name = "big",
+	"a:int",
+	"b:int",
+	chunk = true,
+}
+
+w:register {
+	name = "name",
+	type = "lua",
+}
+
+w:register {
+	name = "mark",
+}
+
+for i = 1, 100 do
+	w:new {
+		vector = { x = i, y = 0 },
+		pos = (i % 2 == 0) and { x = 0, y = 0, z = i } or nil,
+		value = i,
+		big = { a = i, b = 0 },
+		name = "n" .. i,
+		mark = (i % 10 == 0),
+	}
+end
+
+local sum = 0
+for v in w:select_view "vector:update pos?in value:in name:in mark:absent" do
+	assert(v.name == "n" .. v.value)
+	v.vector.y = v.vector.x * 2
+	if v.pos then
+		assert(v.pos.z == v.value)
+		assert(not pcall(function() v.pos.x = 1 end))	-- readonly
+	end
+	sum = sum + v.vector.x
+end
+print("sum", sum)
+
+local n = 0
+for v in w:select "vector:in value:in" do
+	if v.value % 10 == 0 then
+		assert(v.vector.y == 0)
+	else
+		assert(v.vector.y == v.value * 2)
+		n = n + 1
+	end
+end
+print("written", n)
+
+-- soa
+for v in w:select_view "pos:update" do
+	v.pos.x = v.pos.z + 0.5
+end
+for v in w:select "pos:in" do
+	assert(v.pos.x == v.pos.z + 0.5 and v.pos.y == 0)
+end
+
+-- chunk
+for v in w:select_view "big:update value:in" do
+	assert(v.big.a == v.value)
+	v.big.b = -v.value
+end
+for v in w:select "big:in" do
+	assert(v.big.b == -v.big.a)
+end
+
+-- remove in iteration, the view is still valid until update
+for v in w:select_view "value:in vector:in" do
+	if v.value % 3 == 0 then
+		w:remove(v)
+	end
+	assert(v.vector.x == v.value)
+end
+w:update()
+print("vector", w:count "vector")
+
+-- a view is only valid in its step, it moves to the next entity, and it's invalid after the loop
+local saved
+for v in w:select_view "vector:update value:in" do
+	if v.value == 2 then
+		saved = v.vector
+	elseif v.value == 4 then
+		assert(saved.x == 4)
+	end
+end
+print(pcall(function() return saved.x end))
+assert(not pcall(function() saved.y = 0 end))
+
+-- invalid after structural change
+local keep
+for v in w:select_view "vector:in" do
+	keep = v.vector
+	break
+end
+print(keep.x)
+w:new { vector = { x = 0, y = 0 } }
+print(pcall(function() return keep.x end))
+assert(not pcall(function() return keep.w end))
+
+assert(not pcall(w.select_view, w, "value:update"))
@@ -0,0 +1,58 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "all",
+	"a:byte",
+	"b:byte",
+	"c:word",
+	"d:int",
+	"e:int",
+	"f:float",
+	"g:float",
+	"h:double",
+	"i:int64",
+	"j:dword",
+	"k:bool",
+	"l:userdata",
+}
+
+local p = ecs.NULL
+for i = 1, 10 do
+	w:new {
+		all = { a = i, b = 255 - i, c = i * 1000, d = -i, e = i, f = i / 2, g = -i / 4, h = i / 3, i = i << 40, j = 0xffffffff - i, k = i % 2 == 0, l = p },
+	}
+end
+
+local function check(v, i, a)
+	local t = v.all
+	assert(t.a == a and t.b == 255 - i and t.c == i * 1000 and t.d == -i and t.e == i)
+	assert(t.f == i / 2 and t.g == -i / 4 and t.h == i / 3 and t.i == i << 40 and t.j == 0xffffffff - i)
+	assert(t.k == (i % 2 == 0) and t.l == p)
+end
+
+for v in w:select "all:update" do
+	local i = v.all.e
+	check(v, i, i)
+	v.all.a = 255
+end
+
+-- write a byte doesn't touch the next one
+for v in w:select "all:in" do
+	check(v, v.all.e, 255)
+end
+
+local function write(k, value)
+	return pcall(function()
+		for v in w:select "all:update" do
+			v.all[k] = value
+		end
+	end)
+end
+
+print(write("d", 1.5))
+print(write("f", "1"))
+print(write("i", 1.0))
+print(write("a", 256))
+print(write("k", 1))
@@ -0,0 +1,121 @@
+local ecs = require "ecs"
+
+local function init(w)
+	w:register { name = "vector", "x:float", "y:float" }
+	w:register { name = "soa", "a:int", "b:byte", "c:double", layout = "soa" }
+	w:register { name = "value", type = "int", chunk = true }
+	w:register { name = "name", type = "lua" }
+	w:register { name = "mark" }
+	w:register { name = "flag", bitset = true }
+	w:register { name = "rare", type = "int64", sparse = true }
+	w:register { name = "order", order = true }
+	w:register { name = "index", type = "int" }
+end
+
+local w = ecs.world { handle = true }
+init(w)
+
+for i = 1, 100 do
+	w:new {
+		index = i,
+		vector = (i % 2 == 0) and { x = i, y = -i } or nil,
+		soa = (i % 3 == 0) and { a = i, b = i % 256, c = i / 7 } or nil,
+		value = i * 10,
+		name = (i % 5 == 0) and ("name" .. i) or nil,
+		mark = (i % 4 == 0),
+		flag = (i % 6 == 0),
+		rare = (i % 25 == 0) and (i << 33) or nil,
+		order = (i % 7 == 0) or nil,
+	}
+end
+
+local handles = {}
+for v in w:select "index:in" do
+	if v.index % 11 == 0 then
+		w:remove(v)
+	end
+	handles[v.index] = w:handle(v)
+end
+w:update()
+-- removed until the next update
+for v in w:select "index:in" do
+	if v.index == 50 then
+		w:remove(v)
+	end
+end
+
+local PAT <const> = "index:in vector?in soa?in value?in name?in mark?in flag?in rare?in"
+local function dump(w)
+	local t = {}
+	for v in w:select(PAT) do
+		local s = { v.index }
+		if v.vector then s[#s+1] = v.vector.x .. "," .. v.vector.y end
+		if v.soa then s[#s+1] = v.soa.a .. "," .. v.soa.b .. "," .. v.soa.c end
+		s[#s+1] = v.value
+		s[#s+1] = v.name
+		s[#s+1] = v.mark and "M"
+		s[#s+1] = v.flag and "F"
+		s[#s+1] = v.rare
+		t[#t+1] = table.concat(s, " ")
+	end
+	local o = {}
+	for v in w:select "order index:in" do
+		o[#o+1] = v.index
+	end
+	return table.concat(t, "\n") .. "\norder " .. table.concat(o, " ")
+end
+
+local sections = {}
+w:save(function(s) sections[#sections+1] = s end, function(name, obj)
+	return obj
+end)
+
+local i = 0
+local w2 = ecs.load(function()
+	i = i + 1
+	return sections[i]
+end, function(name, s)
+	assert(name == "name")
+	return s
+end)
+
+local d1 = dump(w)
+assert(d1 == dump(w2))
+print(#table.concat(sections), "bytes")
+
+-- the handles are valid
+for k, h in pairs(handles) do
+	local v = w2:fetch(h, "index")
+	if k % 11 == 0 then
+		assert(v == nil)
+	else
+		assert(w2:sync("index:in", v).index == k)
+	end
+end
+
+-- both worlds go on the same way
+local function step(w)
+	w:update()
+	for v in w:select "index:in mark?out" do
+		if v.index % 3 == 0 then
+			w:remove(v)
+		else
+			v.mark = v.index % 2 == 0
+		end
+	end
+	w:update()
+	w:new { index = 1000, rare = 1, flag = true, name = "new", order = true }
+	w:rearrange()
+end
+step(w)
+step(w2)
+assert(dump(w) == dump(w2))
+print(dump(w2))
+
+print(pcall(w.save, w, function() end))
+local bad = { "bad" }
+print(pcall(ecs.load, function() return table.remove(bad) end))
+-- truncated
+local s = table.concat(sections)
+bad = { s:sub(1, #s // 2) }
+print(pcall(ecs.load, function() return table.remove(bad) end, function(_, s) return s end))
@@ -0,0 +1,91 @@
+local ecs = require "ecs"
+
+local w = ecs.world { handle = true }
+w:register { name = "vector", "x:float", "y:float" }
+w:register { name = "soa", "a:int", "b:double", layout = "soa" }
+w:register { name = "value", type = "int", chunk = true }
+w:register { name = "name", type = "lua" }
+w:register { name = "mark" }
+w:register { name = "flag", bitset = true }
+w:register { name = "rare", type = "int", sparse = true }
+
+w:new_batch({
+	vector = function(i) return { x = i, y = 0 } end,
+	soa = function(i) return { a = i, b = i / 2 } end,
+	value = function(i) return i end,
+	mark = true,
+}, 20000)
+for v in w:select "value:in flag?out rare?new name?new" do
+	if v.value % 10 == 0 then
+		v.flag = true
+		v.rare = -v.value
+		v.name = "n" .. v.value
+	else
+		v.rare = nil
+		v.name = nil
+	end
+end
+
+local filename = os.tmpname()
+w:save(filename, function(_, s) return s end)
+
+local function dump(w)
+	local n, sum = 0, 0
+	for v in w:select "value:in vector:in soa:in rare?in name?in flag?in mark" do
+		n = n + 1
+		assert(v.vector.x == v.value and v.soa.a == v.value and v.soa.b == v.value / 2)
+		assert((v.rare ~= nil) == (v.value % 10 == 0) and (v.name ~= nil) == (v.flag == true))
+		sum = sum + v.value + v.vector.y
+	end
+	return n, sum
+end
+
+local w1 = ecs.map(filename, function(_, s) return s end)
+local w2 = ecs.map(filename, function(_, s) return s end)
+print("map", dump(w1))
+assert(w1:fetch(w:handle { 1, 2 }, "value"))
+
+-- write values, the pages of file are copy-on-write
+for v in w1:select "vector:update" do
+	v.vector.y = 1
+end
+print("write", dump(w1))
+print("other", dump(w2))
+
+-- structural changes copy the pools out of image
+for v in w1:select "value:in" do
+	if v.value % 3 == 0 then
+		w1:remove(v)
+	end
+end
+w1:update()
+w1:new_batch({ value = 0, vector = { x = 0, y = 0 }, soa = { a = 0, b = 0 }, flag = true, rare = 0 }, 20000)
+for v in w1:select "value:in flag:in rare:update" do
+	if v.value % 2 == 0 then
+		v.flag = false
+	end
+	v.rare = v.rare + 1
+end
+w1:update()
+w1:collect()
+print("change", dump(w1), w1:count "flag", w1:count "rare")
+w1:rearrange()
+print("rearrange", dump(w1))
+w1 = nil
+collectgarbage()
+
+-- the file is not changed
+local w3 = ecs.map(filename, function(_, s) return s end)
+print("file", dump(w3))
+w3:save(filename .. ".2", function(_, s) return s end)
+local function read(f)
+	local f <close> = assert(io.open(f, "rb"))
+	return f:read "a"
+end
+assert(read(filename) == read(filename .. ".2"))
+w2 = nil
+w3 = nil
+collectgarbage()
+os.remove(filename)
+os.remove(filename .. ".2")
+print(pcall(ecs.map, filename))
@@ -0,0 +1,118 @@
+local ecs = require "ecs"
+
+local function world()
+	local w = ecs.world()
+	w:register {
+		name = "vector",
+		"x:float",
+		"y:float",
+	}
+	w:register {
+		name = "soa",
+		"a:int",
+		"b:double",
+		layout = "soa",
+	}
+	w:register {
+		name = "value",
+		type = "int",
+		chunk = true,
+	}
+	w:register {
+		name = "hp",
+		type = "word",
+		sparse = true,
+	}
+	w:register {
+		name = "mark",
+		bitset = true,
+	}
+	w:register {
+		name = "tag",
+	}
+	return w
+end
+
+local NAMES <const> = { "vector", "soa", "value", "hp", "mark", "tag" }
+
+local server = world()
+local client = world()
+local encoder = server:delta_encoder(NAMES)
+
+local function dump(w)
+	local t = {}
+	for v in w:select "value:in vector?in soa?in hp?in mark?in tag?in" do
+		local s = { v.value }
+		if v.vector then s[#s+1] = v.vector.x .. "," .. v.vector.y end
+		if v.soa then s[#s+1] = v.soa.a .. "," .. v.soa.b end
+		if v.hp then s[#s+1] = "hp" .. v.hp end
+		if v.mark then s[#s+1] = "*" end
+		if v.tag then s[#s+1] = "#" end
+		t[#t+1] = table.concat(s, " ")
+	end
+	return table.concat(t, "\n")
+end
+
+local function sync(what)
+	local delta = server:delta_encode(encoder)
+	client:delta_apply(delta, NAMES)
+	local a, b = dump(server), dump(client)
+	assert(a == b, what)
+	print(what, #delta, client:count "value")
+end
+
+for i = 1, 100 do
+	server:new {
+		value = i,
+		vector = { x = i, y = -i },
+		soa = (i % 2 == 0) and { a = i, b = i / 2 } or nil,
+		hp = (i % 3 == 0) and i or nil,
+		mark = (i % 5 == 0),
+		tag = (i % 7 == 0),
+	}
+end
+sync "new"
+
+-- nothing changed
+sync "idle"
+
+-- change one field of a few
+for v in server:select "value:in vector:update" do
+	if v.value % 10 == 0 then
+		v.vector.y = v.vector.y * 2
+	end
+end
+sync "field"
+
+for v in server:select "value:in soa:update hp?update mark?out" do
+	v.soa.b = v.soa.b + 1
+	if v.hp then
+		v.hp = v.hp + 1
+	end
+	v.mark = (v.value % 4 == 0)
+end
+sync "soa"
+
+-- remove some entities and add some components
+for v in server:select "value:in tag?out" do
+	if v.value % 6 == 0 then
+		server:remove(v)
+	else
+		v.tag = (v.value % 3 == 0)
+	end
+end
+server:update()
+for i = 101, 110 do
+	server:new { value = i, hp = i }
+end
+sync "remove"
+
+-- the ids are renumbered
+server:rearrange()
+sync "rearrange"
+
+-- apply to a world that isn't a replica
+local ok, err = pcall(client.delta_apply, client, server:delta_encode(server:delta_encoder(NAMES)), NAMES)
+print(ok, err:match "Entity %d+ exists")
+
+assert(not pcall(server.delta_encoder, server, { "value", "nothing" }))
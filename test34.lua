@@ -0,0 +1,114 @@
+local ecs = require "ecs"
+local test = require "ecs.ctest"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+}
+
+w:register {
+	name = "value",
+	type = "int",
+}
+
+w:register {
+	name = "soa",
+	"a:int",
+	"b:int",
+	layout = "soa",
+}
+
+w:register {
+	name = "mark",
+}
+
+for i = 1, 10 do
+	w:new {
+		vector = { x = i, y = i },
+		value = i,
+		soa = (i % 2 == 0) and { a = i, b = 0 } or nil,
+	}
+end
+
+local function changed(pat)
+	local t = {}
+	for v in w:select(pat) do
+		t[#t+1] = v.value
+	end
+	return table.concat(t, " ")
+end
+
+-- everything is changed at the first run of a pattern
+print("first", changed "vector:changed value:in")
+print("none", changed "vector:changed value:in")
+changed "value:changed"
+changed "soa:changed value:in"
+changed "vector:changed value:changed"
+
+-- write back the same values, they are not changed
+for v in w:select "vector:update" do
+	v.vector.x = v.vector.x
+end
+print("same", changed "vector:changed value:in")
+
+for v in w:select "value:in vector:update" do
+	if v.value % 3 == 0 then
+		v.vector.y = -v.value
+	end
+end
+print("update", changed "vector:changed value:in")
+
+-- new components are changed, both keys should be changed
+for v in w:select "value:in mark?out" do
+	v.mark = v.value > 8
+end
+for v in w:select "mark value:in vector:out" do
+	v.vector = { x = 0, y = 0 }
+end
+w:new { vector = { x = 0, y = 0 }, value = 11 }
+print("new", changed "vector:changed value:in")
+print("both", changed "vector:changed value:changed")
+
+-- removed entities move the rows, the stamps move with them
+for v in w:select "value:in" do
+	if v.value % 2 == 1 then
+		w:remove(v)
+	end
+end
+w:update()
+for v in w:select "value:update" do
+	if v.value == 8 then
+		v.value = 80
+	end
+end
+print("moved", changed "value:changed")
+
+-- soa, view, object and C writes
+for v in w:select_view "value:in soa:update" do
+	if v.value == 4 then
+		v.soa.b = 1
+	end
+end
+for v in w:select "value:in soa:update" do
+	if v.value == 6 then
+		v.soa.a = 60
+	end
+end
+print("soa", changed "soa:changed value:in")
+local ctx = w:context { "vector" }
+test.move(ctx, 2)
+print("capi", changed "vector:changed value:in")
+
+-- chunk iteration shares the last run with select of the same pattern
+for v in w:select "value:in soa:update" do
+	v.soa.b = v.soa.b + 1
+end
+for chunk in w:select_chunk("soa:changed value:in", 2) do
+	print("chunk", table.concat(chunk.value, " ", 1, chunk.n))
+end
+print("chunk", changed "soa:changed value:in")
+
+assert(not pcall(w.select, w, "mark:changed"))
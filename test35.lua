@@ -0,0 +1,54 @@
+local ecs = require "ecs"
+local test = require "ecs.ctest"
+
+local w = ecs.world()
+
+w:register {
+	name = "vector",
+	"x:float",
+	"y:float",
+}
+
+w:register {
+	name = "mark",
+}
+
+for i = 1, 100 do
+	w:new {
+		vector = { x = i, y = 1 },
+	}
+end
+
+-- both systems only read vector, so they are in one wave and record commands at the same time
+w:system("spawn", "vector:in", test.system "spawn", { "vector", "mark" })
+w:system("tagger", "vector:in", test.system "tagger", { "vector", "mark" })
+
+for i, wave in ipairs(w:schedule()) do
+	print("wave", i, table.concat(wave, " "))
+end
+
+w:run_systems()
+w:update()
+
+local function dump()
+	local spawned, marked = 0, 0
+	local s = {}
+	for v in w:select "vector:in mark?in" do
+		if v.vector.x < 0 then
+			spawned = spawned + 1
+			s[#s+1] = math.tointeger(v.vector.x)
+		end
+		if v.mark then
+			assert(v.vector.x % 2 == 0)
+			marked = marked + 1
+		end
+	end
+	print("spawned", spawned, "marked", marked)
+	print(table.concat(s, " ", 1, 5))
+end
+
+dump()
+
+w:run_systems()
+w:update()
+dump()
@@ -0,0 +1,104 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "id",
+	type = "int",
+}
+
+-- dense
+w:register {
+	name = "a",
+	type = "int",
+}
+
+-- a few runs far from each other, so the cursor gallops
+w:register {
+	name = "b",
+	type = "int",
+}
+
+-- only the head of the pool
+w:register {
+	name = "head",
+}
+
+-- only the tail of the pool
+w:register {
+	name = "tail",
+	type = "int",
+}
+
+w:register {
+	name = "s",
+	type = "int",
+	sparse = true,
+}
+
+local N = 5000
+local model = {}
+
+for i = 1, N do
+	local e = {
+		id = i,
+		a = (i % 7 ~= 0) and i or nil,
+		b = ((i > 100 and i <= 110) or (i > 2000 and i <= 2003) or i == N) and -i or nil,
+		head = (i <= 5) or nil,
+		tail = (i > N - 5) and i or nil,
+		s = (i % 500 == 1) and i * 2 or nil,
+	}
+	model[i] = e
+	w:new(e)
+end
+
+local function match(pat)
+	local r = {}
+	for v in w:select(pat) do
+		r[#r+1] = v.id
+	end
+	return table.concat(r, " ")
+end
+
+local function expect(f)
+	local r = {}
+	for i = 1, N do
+		local e = model[i]
+		if e and f(e) then
+			r[#r+1] = i
+		end
+	end
+	return table.concat(r, " ")
+end
+
+local function check(pat, f)
+	local got = match(pat)
+	assert(got == expect(f), pat)
+	local n = 0
+	for _ in got:gmatch "%d+" do n = n + 1 end
+	print(pat, n)
+end
+
+local function run()
+	check("id:in a:in b:in", function(e) return e.a and e.b end)
+	check("id:in b:in a:in", function(e) return e.a and e.b end)
+	check("id:in head:in tail:in", function(e) return e.head and e.tail end)
+	check("id:in a:in tail:in", function(e) return e.a and e.tail end)
+	check("id:in a:in head:in", function(e) return e.a and e.head end)
+	check("id:in s:in a:in", function(e) return e.s and e.a end)
+	check("id:in b:in s?in a:absent", function(e) return e.b and not e.a end)
+	check("id:in tail?in b:in", function(e) return e.b end)
+	check("id:in a:absent b:in", function(e) return e.b and not e.a end)
+end
+
+run()
+
+-- holes in the middle of runs
+for v in w:select "id:in" do
+	if v.id % 3 == 0 or (v.id > 2000 and v.id <= 2002) then
+		w:remove(v)
+		model[v.id] = nil
+	end
+end
+w:update()
+run()
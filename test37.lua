@@ -0,0 +1,92 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "id",
+	type = "int",
+}
+
+w:register {
+	name = "big",
+	type = "int",
+}
+
+w:register {
+	name = "small",
+	type = "int",
+}
+
+w:register {
+	name = "tiny",
+}
+
+w:register {
+	name = "flag",
+	bitset = true,
+}
+
+w:register {
+	name = "empty",
+	type = "int",
+}
+
+local N = 2000
+local model = {}
+
+for i = 1, N do
+	local e = {
+		id = i,
+		big = (i % 10 ~= 0) and i or nil,
+		small = (i % 50 == 0 or i % 50 == 1) and i or nil,
+		tiny = (i % 400 == 1) or nil,
+		flag = (i % 3 == 0) or nil,
+	}
+	model[i] = e
+	w:new(e)
+end
+
+local function check(pat, f)
+	local got = {}
+	for v in w:select(pat) do
+		got[#got+1] = v.id
+	end
+	local exp = {}
+	for i = 1, N do
+		local e = model[i]
+		if e and f(e) then
+			exp[#exp+1] = i
+		end
+	end
+	got = table.concat(got, " ")
+	assert(got == table.concat(exp, " "), pat)
+	print(pat, #exp)
+end
+
+local function run()
+	-- the smallest required pool drives
+	check("id:in big:in small:in", function(e) return e.big and e.small end)
+	check("big:in id:in small:in tiny:in", function(e) return e.big and e.small and e.tiny end)
+	-- optional or absent keys can't drive
+	check("id:in big:in small?in", function(e) return e.big end)
+	check("id:in big:in tiny:absent", function(e) return e.big and not e.tiny end)
+	check("id:in small:absent tiny?in", function(e) return not e.small end)
+	check("id:in empty?in", function(e) return true end)
+	-- an empty driver
+	check("id:in big:in empty:in", function(e) return false end)
+	-- bitset can't drive
+	check("id:in small:in flag:in", function(e) return e.small and e.flag end)
+	check("id:in big:in flag:absent small:in", function(e) return e.big and e.small and not e.flag end)
+end
+
+run()
+
+-- the sizes of pools change, so does the driver
+for v in w:select "id:in small?in" do
+	if v.small == nil and v.id % 4 ~= 1 then
+		w:remove(v)
+		model[v.id] = nil
+	end
+end
+w:update()
+run()
@@ -0,0 +1,126 @@
+local ecs = require "ecs"
+
+local w = ecs.world()
+
+w:register {
+	name = "id",
+	type = "int",
+}
+
+w:register {
+	name = "value",
+	type = "int",
+}
+
+w:register {
+	name = "soa",
+	"a:int",
+	"b:double",
+	layout = "soa",
+}
+
+-- more than one chunk
+w:register {
+	name = "chunk",
+	type = "int",
+	chunk = true,
+}
+
+w:register {
+	name = "sparse",
+	type = "int",
+	sparse = true,
+}
+
+w:register {
+	name = "name",
+	type = "lua",
+}
+
+w:register {
+	name = "mark",
+}
+
+w:register {
+	name = "order",
+	order = true,
+}
+
+local N = 20000
+local model = {}
+
+for i = 1, N do
+	model[i] = true
+	w:new {
+		id = i,
+		value = (i % 5 ~= 0) and i or nil,
+		soa = (i % 2 == 0) and { a = i, b = i / 2 } or nil,
+		chunk = -i,
+		sparse = (i % 3 == 0) and i * 3 or nil,
+		name = (i % 4 == 0) and ("n" .. i) or nil,
+		mark = (i % 6 == 0),
+		order = (i <= 100) or nil,
+	}
+end
+
+local function check(tag)
+	local n = 0
+	for v in w:select "id:in value?in soa?in chunk:in sparse?in name?in mark?in" do
+		local i = v.id
+		assert(model[i])
+		assert(v.chunk == -i)
+		assert(v.value == ((i % 5 ~= 0) and i or nil))
+		if i % 2 == 0 then
+			assert(v.soa.a == i and v.soa.b == i / 2)
+		else
+			assert(v.soa == nil)
+		end
+		assert(v.sparse == ((i % 3 == 0) and i * 3 or nil))
+		assert(v.name == ((i % 4 == 0) and ("n" .. i) or nil))
+		assert((v.mark or false) == (i % 6 == 0))
+		n = n + 1
+	end
+	local alive = 0
+	for i = 1, N do
+		if model[i] then alive = alive + 1 end
+	end
+	assert(n == alive)
+	local order = 0
+	for v in w:select "order id:in" do
+		assert(model[v.id] and v.id <= 100)
+		order = order + 1
+	end
+	print(tag, n, "soa", w:count "soa", "sparse", w:count "sparse", "name", w:count "name", "order", order)
+end
+
+local function remove(f)
+	for v in w:select "id:in" do
+		if f(v.id) then
+			w:remove(v)
+			model[v.id] = nil
+		end
+	end
+	w:update()
+end
+
+check "init"
+
+-- the first and the last ones of pools
+remove(function(i) return i == 1 or i == 2 or i == N or i == N - 1 end)
+check "boundary"
+
+-- a run across the chunk boundary, and a long run to the end of the pool
+remove(function(i) return (i > 16000 and i <= 17000) or i > N - 1000 end)
+check "runs"
+
+-- a run from the head of the pool
+remove(function(i) return i <= 50 end)
+check "head"
+
+-- scattered ones
+remove(function(i) return i % 7 == 0 or i % 11 == 0 end)
+check "scattered"
+
+-- remove all
+remove(function(i) return true end)
+check "all"